@@ -18,8 +18,9 @@ fi
 
 cd "$WORK_DIR" || exit
 
-CONFIG_BLOCK_SZ=512
-BLOCK_COUNT=8192
+KERNEL_PARAM_PATH="/sys/module/ddriver/parameters"
+KERNEL_DISK_SZ="4M"
+KERNEL_BLOCK_SZ="1K"
 
 
 function usage(){
@@ -39,6 +40,7 @@ function usage(){
     echo "-d            导出ddriver至当前工作目录[PWD]"
     echo "-r            擦除ddriver"
     echo "-l            显示ddriver的Log"
+    echo "-m [设备...]  实时监控用户态ddriver的IOPS、带宽、队列深度与寻道率"
     echo "-v            显示ddriver的类型[内核模块 / 用户静态链接库]"
     echo "-h            打印本帮助菜单"
     echo "===================================================================="
@@ -61,6 +63,26 @@ function root_permission_check() {
     fi
 }
 
+# 带K/M/G后缀的大小换算为字节，按十进制解析
+function size_bytes() {
+    local num=${1%[kKmMgG]}
+    case "$1" in
+        *[kK]) echo $((10#$num << 10)) ;;
+        *[mM]) echo $((10#$num << 20)) ;;
+        *[gG]) echo $((10#$num << 30)) ;;
+        *)     echo $((10#$num)) ;;
+    esac
+}
+
+# 内核ddriver的块大小与块数，取自加载时的模块参数
+function kernel_geometry() {
+    local disk_sz block_sz
+    disk_sz=$(cat $KERNEL_PARAM_PATH/disk_size 2>/dev/null || echo $KERNEL_DISK_SZ)
+    block_sz=$(cat $KERNEL_PARAM_PATH/block_size 2>/dev/null || echo $KERNEL_BLOCK_SZ)
+    BLOCK_SZ=$(size_bytes "$block_sz")
+    BLOCK_COUNT=$(( $(size_bytes "$disk_sz") / BLOCK_SZ ))
+}
+
 function install() {
     DDRIVER_TYPE=$1
     echo "$DDRIVER_TYPE"
@@ -80,7 +102,8 @@ function install() {
         sudo rm $KERNEL_DEV_PATH>/dev/null 2>&1 
         sudo rmmod ddriver>/dev/null 2>&1 
         sudo dmesg -C
-        sudo insmod ./ddriver.ko
+        sudo insmod ./ddriver.ko ${DDRIVER_DISK_SIZE:+disk_size=$DDRIVER_DISK_SIZE} \
+                                 ${DDRIVER_BLOCK_SIZE:+block_size=$DDRIVER_BLOCK_SIZE}
         in=$(dmesg | tail -n 1)
         tokens=("$in")
         major_number=${tokens[${#tokens[*]}-1]}
@@ -122,12 +145,13 @@ function install() {
 
 function test(){
     if [ "$DDRIVER_TYPE" == "k" ]; then   
+        kernel_geometry
         # test read
-        sudo dd if=$KERNEL_DEV_PATH of=read1 bs=$CONFIG_BLOCK_SZ count=$BLOCK_COUNT
+        sudo dd if=$KERNEL_DEV_PATH of=read1 bs=$BLOCK_SZ count=$BLOCK_COUNT
         # test write
-        sudo dd if=/dev/random of=$KERNEL_DEV_PATH bs=$CONFIG_BLOCK_SZ count=2
+        sudo dd if=/dev/random of=$KERNEL_DEV_PATH bs=$BLOCK_SZ count=2
         # test read
-        sudo dd if=$KERNEL_DEV_PATH of=read2 bs=$CONFIG_BLOCK_SZ count=$BLOCK_COUNT
+        sudo dd if=$KERNEL_DEV_PATH of=read2 bs=$BLOCK_SZ count=$BLOCK_COUNT
     else 
         exit
     fi
@@ -141,14 +165,23 @@ function log() {
     fi
 }
 
+function monitor() {
+    if [ "$DDRIVER_TYPE" == "k" ]; then  
+        echo "实时监控仅支持用户态ddriver"
+    else
+        "$WORK_DIR"/$USER_DDRIVER/bin/ddriver-mon "$@"
+    fi
+}
+
 function dump(){
     sudo rm "$ORIGIN_WORK_DIR"/ddriver_dump>/dev/null 2>&1 
     if [ "$DDRIVER_TYPE" == "k" ]; then  
         echo "目标设备 $KERNEL_DEV_PATH"
-        sudo dd if=$KERNEL_DEV_PATH of="$ORIGIN_WORK_DIR"/ddriver_dump bs=$CONFIG_BLOCK_SZ count=$BLOCK_COUNT
+        kernel_geometry
+        sudo dd if=$KERNEL_DEV_PATH of="$ORIGIN_WORK_DIR"/ddriver_dump bs=$BLOCK_SZ count=$BLOCK_COUNT
     else 
         echo "目标设备 $USER_DEV_PATH"
-        dd if="$USER_DEV_PATH" of="$ORIGIN_WORK_DIR"/ddriver_dump bs=$CONFIG_BLOCK_SZ count=$BLOCK_COUNT
+        "$WORK_DIR"/$USER_DDRIVER/bin/ddriver-image dump "$ORIGIN_WORK_DIR"/ddriver_dump
     fi
     echo "文件已导出至$ORIGIN_WORK_DIR/ddriver_dump，请安装HexEditor插件查看其内容"
 }
@@ -156,10 +189,11 @@ function dump(){
 function clean(){
     if [ "$DDRIVER_TYPE" == "k" ]; then  
         echo "目标设备 $KERNEL_DEV_PATH"
-        sudo dd if=/dev/zero of=$KERNEL_DEV_PATH bs=$CONFIG_BLOCK_SZ count=$BLOCK_COUNT
+        kernel_geometry
+        sudo dd if=/dev/zero of=$KERNEL_DEV_PATH bs=$BLOCK_SZ count=$BLOCK_COUNT
     else
         echo "目标设备 $USER_DEV_PATH"
-        dd if=/dev/zero of="$USER_DEV_PATH" bs=$CONFIG_BLOCK_SZ count=$BLOCK_COUNT
+        "$WORK_DIR"/$USER_DDRIVER/bin/ddriver-image erase
     fi 
 }
 
@@ -174,7 +208,7 @@ function version () {
 if [ $# == 0 ]; then
     usage
 else 
-    while getopts 'i:tdhrlv' OPT; do
+    while getopts 'i:tdhrlmv' OPT; do
         case $OPT in
             i) install "$OPTARG"
             ;;
@@ -186,6 +220,9 @@ else
             ;;
             l) log
             ;;
+            m) monitor "${@:$OPTIND}"
+               break
+            ;;
             v) version 
             ;;
             h) usage
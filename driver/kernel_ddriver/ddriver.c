@@ -2,6 +2,8 @@
 #include <linux/kernel.h>
 #include <linux/init.h>
 #include <linux/fs.h>
+#include <linux/moduleparam.h>
+#include <linux/vmalloc.h>
 #include <asm/uaccess.h>
 #include <linux/uaccess.h>
 #include "ddriver_ctl.h"
@@ -27,14 +29,14 @@
                         "filp_open/cpp-filp_open-function-examples.html>"
 #define DRIVER_VERSION  "0.1.0"
 
-#define CONFIG_DISK_SZ  (4 * 1024 * 1024)
-#define CONFIG_BLOCK_SZ (1024)
+#define CONFIG_DISK_SZ  "4M"
+#define CONFIG_BLOCK_SZ "1K"
 /******************************************************************************
 * SECTION: Macro Functions 
 *******************************************************************************/
 #define IGNORE_ARG(arg)         ((void)arg)
-#define IS_ADDR_ALIGN(addr)     (addr % CONFIG_BLOCK_SZ == 0)
-#define ADDR_ROUND_UP(addr)     ((addr / CONFIG_BLOCK_SZ) * CONFIG_BLOCK_SZ)
+#define IS_ADDR_ALIGN(addr)     (((addr) & (disk.iounit_size - 1)) == 0)
+#define ADDR_ROUND_UP(addr)     ((addr) & ~((loff_t)disk.iounit_size - 1))
 
 #define GET_HEAD_POS(disk)      (disk.head - disk.layout)
 #define FORWARD_HEAD(disk, dis) (disk.head += dis)
@@ -51,12 +53,19 @@ MODULE_LICENSE("GPL");
 MODULE_AUTHOR(DRIVER_AUTHOR);	    
 MODULE_DESCRIPTION(DRIVER_DESC);	
 MODULE_VERSION(DRIVER_VERSION);	
+
+static char *disk_size  = CONFIG_DISK_SZ;
+static char *block_size = CONFIG_BLOCK_SZ;
+module_param(disk_size, charp, 0444);
+MODULE_PARM_DESC(disk_size, "Disk size, K/M/G suffixes, at most 2G-1 (default " CONFIG_DISK_SZ ")");
+module_param(block_size, charp, 0444);
+MODULE_PARM_DESC(block_size, "IO unit, a power of 2 in [512, 1M] (default " CONFIG_BLOCK_SZ ")");
 /******************************************************************************
 * SECTION: Type definitions
 *******************************************************************************/
 struct ddriver
 {
-    char layout[CONFIG_DISK_SZ];                      /* Disk Layout */
+    char *layout;                                     /* Disk Layout, vmalloc'ed */
     char *head;                                       /* Disk Head */
     int  read_cnt;
     int  write_cnt;
@@ -68,27 +77,61 @@ struct ddriver
 };
 
 static struct ddriver disk = {
+    .layout      = NULL,
     .head        = NULL,
     .read_cnt    = 0,
     .write_cnt   = 0,
     .seek_cnt    = 0,
     .major_num   = 0,
     .open_count  = 0,
-    .layout_size = CONFIG_DISK_SZ,
-    .iounit_size = CONFIG_BLOCK_SZ
+    .layout_size = 0,                                 /* From disk_size at load */
+    .iounit_size = 0                                  /* From block_size at load */
 };
 /******************************************************************************
 * SECTION: Helper Functions
 *******************************************************************************/
 int check_valid(size_t size){
-    if (GET_HEAD_POS(disk) >=  CONFIG_DISK_SZ) {
+    if (GET_HEAD_POS(disk) < 0 || GET_HEAD_POS(disk) >= disk.layout_size) {
         kernel_alert("disk head reach the end");
         return -EINVAL;
     }
-    if (size != CONFIG_BLOCK_SZ){
-        kernel_alert("io size %ld should align to %d", size, CONFIG_BLOCK_SZ);
+    if (size == 0 || size % disk.iounit_size != 0){
+        kernel_alert("io size %zu should be a multiple of %d", size, disk.iounit_size);
         return -EIO;
     }
+    if (size > disk.layout_size - GET_HEAD_POS(disk)) {
+        kernel_alert("io [%ld, %ld) out of disk range %d", GET_HEAD_POS(disk),
+                     GET_HEAD_POS(disk) + (long)size, disk.layout_size);
+        return -EINVAL;
+    }
+    return 0;
+}
+/**
+ * @brief Parse the disk_size and block_size parameters: the block size is a
+ *        power of 2 in [512, 1M], the disk a multiple of it that still fits
+ *        the int of IOC_REQ_DEVICE_SIZE
+ * 
+ * @return int          state
+ */
+static int parse_geometry(void) {
+    char *end;
+    unsigned long long layout_size, iounit_size;
+
+    iounit_size = memparse(block_size, &end);
+    if (*end != '\0' || iounit_size < 512 || iounit_size > (1 << 20) ||
+        (iounit_size & (iounit_size - 1)) != 0) {
+        kernel_alert("block_size %s should be a power of 2 in [512, 1M]", block_size);
+        return -EINVAL;
+    }
+    layout_size = memparse(disk_size, &end);
+    if (*end != '\0' || layout_size < iounit_size || (layout_size & (iounit_size - 1)) != 0 ||
+        layout_size > INT_MAX) {
+        kernel_alert("disk_size %s should be a multiple of block_size %s below 2G",
+                     disk_size, block_size);
+        return -EINVAL;
+    }
+    disk.layout_size = layout_size;
+    disk.iounit_size = iounit_size;
     return 0;
 }
 /******************************************************************************
@@ -119,7 +162,7 @@ static struct file_operations file_ops = {
  * 
  * @param file          Ignored
  * @param user_buffer   User space buffer
- * @param size          Must equal to Blocksize @CONFIG_BLOCK_SZ
+ * @param size          A multiple of the block size, read in one request
  * @param offset        Ignored
  * @return ssize_t      Bytes have been read 
  */
@@ -130,18 +173,18 @@ device_read(struct file *file, char *user_buffer, size_t size, loff_t *offset) {
     int res = check_valid(size);
     if(res < 0)
         return res;
-    if (copy_to_user(user_buffer, disk.head, CONFIG_BLOCK_SZ))
+    if (copy_to_user(user_buffer, disk.head, size))
         return -EFAULT;
-    FORWARD_HEAD(disk, CONFIG_BLOCK_SZ);
+    FORWARD_HEAD(disk, size);
     INC_READCNT(disk);
-    return CONFIG_BLOCK_SZ;
+    return size;
 }
 /**
  * @brief Disk Write
  * 
  * @param file          Ignored
  * @param user_buffer   User space buffer, copy content from
- * @param size          Must equal to Blocksize @CONFIG_BLOCK_SZ
+ * @param size          A multiple of the block size, written in one request
  * @param offset        Ignored
  * @return ssize_t      Bytes have been written
  */
@@ -153,17 +196,17 @@ device_write(struct file *file, const char *user_buffer, size_t size, loff_t *of
     if(res < 0)
         return res;
 
-    if (copy_from_user(disk.head, user_buffer, CONFIG_BLOCK_SZ))
+    if (copy_from_user(disk.head, user_buffer, size))
         return -EFAULT;
-    FORWARD_HEAD(disk, CONFIG_BLOCK_SZ);
+    FORWARD_HEAD(disk, size);
     INC_WRITECNT(disk);
-    return CONFIG_BLOCK_SZ;
+    return size;
 }
 /**
  * @brief Disk Seek
  * 
  * @param file          Ignored
- * @param offset        Aligned to @CONFIG_BLOCK_SZ
+ * @param offset        Aligned to the block size
  * @param whence        SEEK_CUR, SEEK_SET
  * @return loff_t       cur pos
  */
@@ -172,7 +215,7 @@ device_seek(struct file *file, loff_t offset, int whence) {
     IGNORE_ARG(file);
     if (!IS_ADDR_ALIGN(offset)) {
         kernel_alert("offset %lld must be aligned to block size %d", 
-                      offset, CONFIG_BLOCK_SZ);
+                      offset, disk.iounit_size);
         return -EINVAL;
     }
     switch (whence)
@@ -276,16 +319,28 @@ device_release(struct inode *inode, struct file *file) {
 static int __init 
 ddriver_init(void)
 {
-    int major_num = register_chrdev(0, DEVICE_NAME, &file_ops);   
+    int major_num;
+    int ret = parse_geometry();
+    if (ret < 0)
+        return ret;
+    disk.layout = vzalloc(disk.layout_size);          /* Zeroed, like a fresh image */
+    if (disk.layout == NULL) {
+        kernel_alert("Can't allocate a %d byte disk", disk.layout_size);
+        return -ENOMEM;
+    }
+    kernel_info("disk size %d, block size %d", disk.layout_size, disk.iounit_size);
+
+    major_num = register_chrdev(0, DEVICE_NAME, &file_ops);   
                                                       /* Register an device */
     if (major_num < 0) {                              /* Register fail */
         kernel_alert("Can't register device, ret %d", major_num);
+        vfree(disk.layout);
+        disk.layout = NULL;
         return major_num;
     } 
     else {                                            /* Register success */                                                  
         kernel_info("module loaded with device major number %d", major_num);
         disk.major_num = major_num;
-        memset(disk.layout, 0, CONFIG_DISK_SZ);
         return 0;
     }
     return 0;
@@ -299,6 +354,7 @@ ddriver_exit(void)
     if(major_num != 0){
         unregister_chrdev(major_num, DEVICE_NAME);
     }
+    vfree(disk.layout);
 }
 
 module_init(ddriver_init);
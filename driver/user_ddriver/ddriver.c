@@ -1,201 +1,944 @@
-#include "stdio.h"
-#include "stdlib.h"
-#include <unistd.h>
 #include <sys/stat.h>
 #include <fcntl.h>
-#include "string.h"
 #include <linux/fs.h>
-#include "ddriver_ctl.h"
-#include "stdio.h"
-#include "errno.h"
 #include <pwd.h>
 #include <time.h>
+#include <limits.h>
+#include <sched.h>
+#include <stddef.h>
+#include "ddriver_priv.h"
 
 extern int errno;
-
-#define USER_INFO     "INFO: "
-#define USER_ALERT    "WARNING: "
-
-#define USER_PANIC    "PANIC: "
 /******************************************************************************
 * SECTION: Macro definitions
 *******************************************************************************/   
-#define DEVICE_NAME   "ddriver"
-#define DEVICE_LOG    "ddriver_log"
-
-#define user_info(fmt, ...)\
-	do {\
-		printf(USER_INFO DEVICE_NAME " " fmt "\n", ##__VA_ARGS__);\
-        fprintf(debugf, USER_PANIC  " " fmt "\n", ##__VA_ARGS__);\
-	} while(0)\
-
-#define user_alert(fmt, ...)\
-	do {\
-		printf(USER_ALERT DEVICE_NAME " " fmt "\n", ##__VA_ARGS__);\
-        fprintf(debugf, USER_PANIC  " " fmt "\n", ##__VA_ARGS__);\
-	} while(0)\
-
-#define user_panic(fmt, ...)\
-    do {\
-        printf(USER_PANIC  " " fmt "\n", ##__VA_ARGS__);\
-    } while (0)\
-
 #define DRIVER_AUTHOR   "Deadpool <deadpoolmine@qq.com>"
 #define DRIVER_DESC     "A Fake disk driver in user space"
 #define DRIVER_VERSION  "0.1.0"
+#ifndef IOV_MAX                                       /* Only exported under _XOPEN_SOURCE */
+#define IOV_MAX         1024
+#endif
 
-#define CONFIG_DISK_SZ  (4 * 1024 * 1024)
-#define CONFIG_BLOCK_SZ (1024)
 /******************************************************************************
 * SECTION: Macro Functions 
 *******************************************************************************/
 #define IGNORE_ARG(arg)         ((void)arg)
-#define IS_ADDR_ALIGN(addr)     (addr % CONFIG_BLOCK_SZ == 0)
-#define ADDR_ROUND_UP(addr)     ((addr / CONFIG_BLOCK_SZ) * CONFIG_BLOCK_SZ)
+#define IS_ADDR_ALIGN(disk, addr)   ((addr) % (disk)->iounit_size == 0)
+#define ADDR_ROUND_UP(disk, addr)   (((addr) / (disk)->iounit_size) * (disk)->iounit_size)
 
-#define INC_READCNT(disk)       (disk.read_cnt++)
-#define INC_WRITECNT(disk)      (disk.write_cnt++)
-#define INC_SEEKCNT(disk)       (disk.seek_cnt++)
-
-#define RW_DELAY(disk, rw_ops)  (usleep(disk.rw_ops##_lat * 1000))
-/******************************************************************************
-* SECTION: Type definitions
-*******************************************************************************/
-struct ddriver
-{
-    int  ddriver_fd;                                 /* Disk ddriver_fd */
-    int  read_cnt;
-    int  write_cnt;
-    int  seek_cnt;
-    int  read_lat;
-    int  write_lat;
-    int  seek_lat;
-    int  track_num;
-    int  major_num;
-    int  layout_size;
-    int  iounit_size;
-};
+#define INC_SEEKCNT(disk)       STAT_ADD((disk)->stats->seek_cnt, 1)
 /******************************************************************************
 * SECTION: Global Variable
 *******************************************************************************/
-/* reference: https://en.wikipedia.org/wiki/Hard_disk_drive_performance_characteristics */
-struct ddriver disk = {
-    .read_cnt    = 0,
-    .write_cnt   = 0,
-    .seek_cnt    = 0,
-    .read_lat    = 2,       /* 2ms */       
-    .write_lat   = 1,       /* 1ms */
-    .seek_lat    = 4,       /* 4.17ms per 360 degree */
-    .major_num   = 0,
-    .track_num   = 100,
+/* Latencies come from the profile, see ddriver_profile.c */
+static const struct ddriver disk_template = {
+    .head        = 0,
+    .backend     = &ddriver_file_backend,
     .layout_size = CONFIG_DISK_SZ,
     .iounit_size = CONFIG_BLOCK_SZ
 };
 
+/* Open devices and their handles, changed only under devices_lock */
+static pthread_mutex_t devices_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct ddriver *devices[DDRIVER_MAX_DEVICES];
+static int nr_devices;
+static int exit_hook;                                /* withdraw_at_exit registered */
+static struct ddriver_handle handles[DDRIVER_MAX_HANDLES];
+
 FILE *debugf = NULL;
+
+static __thread long delay_owed_us;                  /* Slept by ddriver_unlock */
+static __thread unsigned long long model_spent_us;   /* Modeled time charged by this thread */
+
+static const struct ddriver_backend *backends[] = {
+    &ddriver_file_backend,
+    &ddriver_mmap_backend,
+    &ddriver_stripe_backend,
+    &ddriver_direct_backend,
+    &ddriver_thin_backend
+};
+
+/* Stands in for a backend that could not be reopened, every request fails */
+static int dead_open(struct ddriver *disk, const char *path) { return -EIO; }
+static int dead_close(struct ddriver *disk) { return 0; }
+static int dead_op(struct ddriver *disk) { return -EIO; }
+static int dead_discard(struct ddriver *disk, off_t offset, off_t size) { return -EIO; }
+static int dead_io(struct ddriver *disk, const struct iovec *iov, int iovcnt, off_t offset) {
+    return -EIO;
+}
+
+static const struct ddriver_backend ddriver_dead_backend = {
+    .name    = "dead",
+    .open    = dead_open,
+    .close   = dead_close,
+    .readv   = dead_io,
+    .writev  = dead_io,
+    .flush   = dead_op,
+    .reset   = dead_op,
+    .discard = dead_discard
+};
 /******************************************************************************
 * SECTION: Helper Functions
 *******************************************************************************/
-int check_valid(size_t size) {
-    if (size != CONFIG_BLOCK_SZ){
-        user_alert("io size %ld should align to %d", size, CONFIG_BLOCK_SZ);
+int check_valid(struct ddriver *disk, size_t size) {
+    if (size != disk->iounit_size){
+        user_alert("io size %ld should align to %d", size, disk->iounit_size);
         return -EIO;
     }
     return 0;
 }
 
-int emulate_rotate(int fd, off_t start, off_t end) {
-    int bytes_per_track = disk.layout_size / disk.track_num;
-    int lat_per_track = disk.seek_lat;
-    int distance = abs(end - start) % bytes_per_track; 
-    
-    if (distance == 0) {
-        return 0;
+int check_valid_blocks(struct ddriver *disk, size_t size) {
+    if (size == 0 || size % disk->iounit_size != 0 || size > INT_MAX){
+        user_alert("io size %ld should be a multiple of %d", size, disk->iounit_size);
+        return -EIO;
     }
+    return 0;
+}
 
-    usleep(distance * lat_per_track / bytes_per_track * 1000);
+int check_valid_range(struct ddriver *disk, off_t offset, size_t size) {
+    if (offset < 0 || offset + size > disk->layout_size) {
+        user_alert("io [%ld, %ld) out of disk range %ld", 
+                   offset, offset + size, disk->layout_size);
+        return -EINVAL;
+    }
     return 0;
 }
-/******************************************************************************
-* SECTION: Global Function Implementation
-*******************************************************************************/
+
+size_t iov_total(const struct iovec *iov, int iovcnt) {
+    size_t size = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        size += iov[i].iov_len;
+    }
+    return size;
+}
+
 /**
- * @brief 打开驱动
+ * @brief 按名字选择存储后端，缺省为file
  * 
- * @return int 文件描述符
+ * @param name 
+ * @return const struct ddriver_backend* 
  */
-int ddriver_open(char *path) {
-    int fd, ret = 0;
-    char device_path[128] = {0};
-    char log_path[128] = {0};
-    
-    sprintf(device_path, "%s/" DEVICE_NAME, getpwuid(getuid())->pw_dir);
-    sprintf(log_path, "%s/" DEVICE_LOG, getpwuid(getuid())->pw_dir);
-    
-    if (strcmp(device_path, path) != 0) {
-        user_panic("wrong path [%s], should be [%s]", path, device_path);
-        return -1;
+const struct ddriver_backend *select_backend(const char *name) {
+    if (*name == '\0') {
+        return &ddriver_file_backend;
+    }
+    for (int i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+        if (strcmp(backends[i]->name, name) == 0) {
+            return backends[i];
+        }
+    }
+    user_panic("unknown backend [%s], fall back to [%s]", 
+               name, ddriver_file_backend.name);
+    return &ddriver_file_backend;
+}
+/**
+ * @brief 设备模型耗时(us)：总是推进虚拟时钟，仅在real模式下真正睡眠；
+ *        设备能同时服务多个请求时不在设备锁内睡眠，而是留到ddriver_unlock，
+ *        多通道时记到当前通道上，释放设备锁时再排进通道
+ * 
+ * @param us 
+ */
+void emulate_delay(struct ddriver *disk, long us) {
+    if (us <= 0)
+        return;
+    model_spent_us += us;
+    if (disk->nr_channels > 1) {
+        us = channel_charge(disk, us);
+        if (!disk->virtual_clock && us > delay_owed_us)
+            delay_owed_us = us;                       /* Channels sleep side by side */
+        return;
+    }
+    STAT_ADD(disk->stats->clock_us, us);
+    if (disk->virtual_clock)
+        return;
+    if (disk->profile.parallelism > 1)
+        delay_owed_us += us;
+    else
+        usleep(us);
+}
+/**
+ * @brief 释放设备锁，再睡完本线程持锁期间欠下的模型耗时，
+ *        每个通道上同时睡眠的线程不超过profile.parallelism个
+ * 
+ * @param disk 
+ */
+void ddriver_unlock(struct ddriver *disk) {
+    long us = delay_owed_us;
+    unsigned long long mask = disk->nr_channels > 1 ? channel_commit(disk) : 1;
+
+    pthread_mutex_unlock(&disk->lock);
+    if (us == 0) {
+        if (mask != 0 && disk->nr_channels > 1)
+            sched_yield();                             /* Let other issuers catch up */
+        return;
+    }
+    delay_owed_us = 0;
+    for (int c = 0; c < disk->nr_channels; c++) {     /* In order, so no deadlock */
+        if (mask & (1ULL << c))
+            sem_wait(&disk->channels[c].units);
     }
+    usleep(us);
+    for (int c = 0; c < disk->nr_channels; c++) {
+        if (mask & (1ULL << c))
+            sem_post(&disk->channels[c].units);
+    }
+}
+/**
+ * @brief 当前时间加上尚未睡完的模型耗时，即请求实际完成的时间
+ * 
+ * @return unsigned long long 
+ */
+static unsigned long long wall_now(void) {
+    return ddriver_wall_us() + delay_owed_us;
+}
+/**
+ * @brief 移动磁盘头并计入寻道次数、距离与按时延配置的寻道、旋转延迟
+ * 
+ * @param to 
+ */
+void move_head(struct ddriver *disk, off_t to) {
+    off_t from = disk->head;
+    unsigned long long model_us = model_spent_us;
+    unsigned long long wall_us  = wall_now();
+
+    INC_SEEKCNT(disk);
+    STAT_ADD(disk->stats->seek_dist, llabs(to - from));
+    disk->head = to;
+    if (disk->flash == NULL && disk->nr_channels == 1)   /* Flash has no head to move */
+        emulate_delay(disk, profile_seek_us(disk, from, to, disk->layout_size));
+    disk->pending_model_us += model_spent_us - model_us;
+    disk->pending_wall_us  += wall_now() - wall_us;
+}
+/**
+ * @brief 在磁盘头处完成一次请求：计延迟、访问后端、前移磁盘头
+ * 
+ * @param op 
+ * @param iov 为NULL时数据已被就地访问，只计延迟与统计
+ * @param iovcnt 
+ * @param size iov总长度
+ * @return int 传输的字节数
+ */
+int do_request(struct ddriver *disk, enum ddriver_op op, const struct iovec *iov, int iovcnt,
+               size_t size) {
+    unsigned long long model_us = model_spent_us;
+    unsigned long long wall_us  = wall_now();
+    int ret = check_valid_range(disk, disk->head, size);
+    if (ret < 0)
+        return ret;
 
-    if (access(device_path, F_OK) == 0) {
-        fd = open(device_path, O_RDWR);
+    if (disk->nr_channels > 1) {
+        channel_request(disk, op, disk->head, size);
+    }
+    else if (disk->flash != NULL) {
+        flash_request(disk, op, disk->head, size);
     }
     else {
-        fd = open(device_path, O_CREAT | O_TRUNC | O_RDWR, 0644);
+        emulate_delay(disk, profile_request_us(disk, op, size));
+    }
+    if (op == DDRIVER_OP_READ)
+        ret = iov == NULL ? size : disk->backend->readv(disk, iov, iovcnt, disk->head);
+    else
+        ret = iov == NULL ? size : disk->backend->writev(disk, iov, iovcnt, disk->head);
+    if (ret < 0)
+        return ret;
+    if (disk->integrity != NULL) {
+        ret = integrity_request(disk, op, iov, iovcnt, disk->head, size);
+        if (ret < 0)
+            return ret;
+    }
+
+    stats_account(disk, op, size, disk->head == disk->last_end,
+                  model_spent_us - model_us + disk->pending_model_us,
+                  wall_now() - wall_us + disk->pending_wall_us);
+    disk->pending_model_us = 0;
+    disk->pending_wall_us  = 0;
+    disk->head += size;
+    disk->last_end = disk->head;
+    return size;
+}
+/**
+ * @brief 调用者已在映射中就地读写[offset, offset + size)，只按一次请求计延迟与统计，
+ *        调用者需持有设备锁
+ * 
+ * @param op 
+ * @param offset 
+ * @param size 
+ * @return int 
+ */
+int request_in_place(struct ddriver *disk, enum ddriver_op op, off_t offset, size_t size) {
+    if (disk->head != offset) {
+        move_head(disk, offset);
+    }
+    return do_request(disk, op, NULL, 0, size);
+}
+/**
+ * @brief 绕过缓存的定位请求：必要时移动磁盘头后完成请求，调用者需持有设备锁
+ * 
+ * @param op 
+ * @param iov 
+ * @param iovcnt 
+ * @param offset 
+ * @return int 传输的字节数
+ */
+int request_at_device(struct ddriver *disk, enum ddriver_op op, const struct iovec *iov,
+                      int iovcnt, off_t offset) {
+    if (disk->head != offset) {
+        move_head(disk, offset);
+    }
+    return do_request(disk, op, iov, iovcnt, iov_total(iov, iovcnt));
+}
+/**
+ * @brief 定位请求，开启缓存时经缓存完成，调用者需持有设备锁并已检查参数
+ * 
+ * @param op 
+ * @param iov 
+ * @param iovcnt 
+ * @param offset 
+ * @return int 传输的字节数
+ */
+int request_at(struct ddriver *disk, enum ddriver_op op, const struct iovec *iov, int iovcnt,
+               off_t offset) {
+    if (disk->cache != NULL)
+        return cache_request(disk, op, iov, iovcnt, offset);
+    return request_at_device(disk, op, iov, iovcnt, offset);
+}
+/**
+ * @brief 检查参数后持有设备锁完成定位请求
+ * 
+ * @param op 
+ * @param iov 
+ * @param iovcnt 
+ * @param offset 
+ * @return int 传输的字节数
+ */
+int do_request_at(struct ddriver *disk, enum ddriver_op op, const struct iovec *iov, int iovcnt,
+                  off_t offset) {
+    unsigned long long start = TRACE_START(disk);
+    size_t size = iov_total(iov, iovcnt);
+    int ret = check_valid_blocks(disk, size);
+    if (ret < 0)
+        goto out;
+    if (!IS_ADDR_ALIGN(disk, offset) || check_valid_range(disk, offset, size) < 0) {
+        ret = -EINVAL;
+        goto out;
+    }
+
+    MON_ENTER(disk, 1);
+    DISK_LOCK(disk);
+    ret = request_at(disk, op, iov, iovcnt, offset);
+    DISK_UNLOCK(disk);
+    MON_LEAVE(disk, 1);
+out:
+    trace_record(disk, op == DDRIVER_OP_READ ? DDRIVER_TRACE_READ : DDRIVER_TRACE_WRITE,
+                 offset, size, ret, start);
+    return ret;
+}
+/**
+ * @brief 丢弃[offset, offset + size)的内容，之后读出为0，调用者需持有设备锁
+ * 
+ * @param offset 
+ * @param size 
+ * @return int 
+ */
+int discard_range(struct ddriver *disk, off_t offset, off_t size) {
+    int ret;
+    if (size <= 0 || !IS_ADDR_ALIGN(disk, offset) || !IS_ADDR_ALIGN(disk, size) ||
+        check_valid_range(disk, offset, size) < 0)
+        return -EINVAL;
+
+    cache_invalidate(disk, offset, size);
+    ret = disk->backend->discard(disk, offset, size);
+    if (ret == 0) {
+        flash_trim(disk, offset, size);
+        integrity_discard(disk, offset, size);
+        STAT_ADD(disk->stats->discard_cnt, 1);
+        STAT_ADD(disk->stats->discard_bytes, size);
+    }
+    return ret;
+}
+/**
+ * @brief 持有设备锁丢弃一段内容
+ * 
+ * @param offset 
+ * @param size 
+ * @return int 
+ */
+int do_discard(struct ddriver *disk, off_t offset, off_t size) {
+    unsigned long long start = TRACE_START(disk);
+    int ret;
+    MON_ENTER(disk, 1);
+    DISK_LOCK(disk);
+    ret = discard_range(disk, offset, size);
+    DISK_UNLOCK(disk);
+    MON_LEAVE(disk, 1);
+    trace_record(disk, DDRIVER_TRACE_DISCARD, offset, size, ret, start);
+    return ret;
+}
+/**
+ * @brief 刷回屏障：写回缓存中的所有脏块后刷回持久存储，调用者需持有设备锁
+ * 
+ * @return int 
+ */
+int flush_device(struct ddriver *disk) {
+    int ret = cache_writeback(disk);
+    if (ret < 0)
+        return ret;
+    ret = disk->backend->flush(disk);
+    if (ret < 0)
+        return ret;
+    return integrity_flush(disk);
+}
+/**
+ * @brief 持有设备锁完成刷回屏障
+ * 
+ * @return int 
+ */
+int do_flush(struct ddriver *disk) {
+    unsigned long long start = TRACE_START(disk);
+    int ret;
+    MON_ENTER(disk, 1);
+    DISK_LOCK(disk);
+    ret = flush_device(disk);
+    DISK_UNLOCK(disk);
+    MON_LEAVE(disk, 1);
+    trace_record(disk, DDRIVER_TRACE_FLUSH, 0, 0, ret, start);
+    return ret;
+}
+/**
+ * @brief 按配置建立块缓存，失败时不使用缓存，调用者需持有设备锁
+ */
+static void setup_cache(struct ddriver *disk) {
+    if (disk->cache_size > 0 && cache_init(disk, disk->cache_size, disk->cache_ways) < 0) {
+        user_alert("can't set up a %ld byte cache of %d byte blocks, run uncached",
+                   disk->cache_size, disk->iounit_size);
+    }
+}
+/**
+ * @brief 按配置建立闪存模型，失败时退回机械盘模型，调用者需持有设备锁
+ */
+static void setup_flash(struct ddriver *disk) {
+    if (disk->flash_mode && flash_init(disk) < 0) {
+        user_alert("can't set up the flash model, use the HDD model");
+    }
+}
+/**
+ * @brief 按配置打开块校验表，失败时不做校验，调用者需持有设备锁
+ */
+static void setup_integrity(struct ddriver *disk) {
+    int ret = integrity_open(disk, disk->integrity_mode);
+    if (ret < 0) {
+        user_alert("can't set up the checksums of [%s]: %d, run unchecked", disk->path, ret);
+    }
+}
+/**
+ * @brief 按fd查找句柄，句柄只在open/close时变化
+ * 
+ * @param fd 
+ * @return struct ddriver_handle* 
+ */
+struct ddriver_handle *get_handle(int fd) {
+    for (int i = 0; i < DDRIVER_MAX_HANDLES; i++) {
+        if (__atomic_load_n(&handles[i].in_use, __ATOMIC_ACQUIRE) &&
+            __atomic_load_n(&handles[i].fd, __ATOMIC_RELAXED) == fd) {
+            return &handles[i];
+        }
+    }
+    return NULL;
+}
+/**
+ * @brief 在disk上分配一个句柄，fd为设备fd的副本，调用者需持有设备表锁
+ * 
+ * @param disk 
+ * @return int 句柄fd
+ */
+static int alloc_handle(struct ddriver *disk) {
+    struct ddriver_handle *handle;
+    int fd;
+    for (int i = 0; i < DDRIVER_MAX_HANDLES; i++) {
+        handle = &handles[i];
+        if (!handle->in_use) {
+            fd = dup(disk->ddriver_fd);
+            if (fd < 0)
+                return -errno;
+            __atomic_store_n(&handle->fd, fd, __ATOMIC_RELAXED);  /* get_handle scans unlocked */
+            handle->pos = 0;
+            handle->disk = disk;
+            __atomic_store_n(&handle->in_use, 1, __ATOMIC_RELEASE);  /* After the fields above */
+            return fd;
+        }
+    }
+    return -EMFILE;
+}
+/**
+ * @brief 句柄SEEK，同时移动磁盘头，调用者需持有设备锁
+ * 
+ * @param handle 
+ * @param offset 
+ * @param whence 
+ * @return off_t 
+ */
+static off_t do_seek(struct ddriver_handle *handle, off_t offset, int whence) {
+    struct ddriver *disk = handle->disk;
+    off_t ret = 0;
+
+    if (!IS_ADDR_ALIGN(disk, offset)) {
+        user_alert("offset %ld must be aligned to block size %d", 
+                      offset, disk->iounit_size);
+        return -EINVAL;
     }
+
+    switch (whence)
+    {
+    case SEEK_SET:
+        ret = offset;
+        break;
+    case SEEK_CUR:
+        ret = handle->pos + offset;
+        break;
+    case SEEK_END:
+        ret = disk->layout_size + offset;
+        break;
+    default:
+        ret = -1;
+        break;
+    }
+    if (ret < 0 || ret > disk->layout_size) {
+        user_panic("seek error: offset %ld whence %d", offset, whence);
+        return -EINVAL;
+    }
+    move_head(disk, ret);
+    handle->pos = ret;
+    return ret;
+}
+/**
+ * @brief 以新的几何参数重新打开后端，设备fd保持不变，调用者需持有设备锁。
+ *        缓存写回失败时不做改变；新几何参数打不开时按原参数重新打开，
+ *        仍打不开时设备之后的所有请求返回-EIO
+ * 
+ * @param disk 
+ * @param layout_size 
+ * @param iounit_size 
+ * @return int 
+ */
+int set_geometry(struct ddriver *disk, off_t layout_size, off_t iounit_size) {
+    int new_fd;
+    int fd = disk->ddriver_fd;
+    off_t old_layout_size = disk->layout_size;
+    off_t old_iounit_size = disk->iounit_size;
+    int ret = ddriver_check_geometry(layout_size, iounit_size);
+    if (ret < 0)
+        return ret;
+    if (disk->pins != NULL) {
+        user_alert("can't change geometry while blocks are held by ddriver_get_range");
+        return -EBUSY;
+    }
+    ret = cache_writeback(disk);                      /* Dirty lines stay cached on failure */
+    if (ret < 0)
+        return ret;
+
+    cache_destroy(disk);
+    flash_destroy(disk);
+    disk->backend->close(disk);
+    integrity_close(disk);
+    disk->layout_size = layout_size;
+    disk->iounit_size = iounit_size;
+    integrity_stamp(disk, disk->image_stamp);
+    new_fd = disk->backend->open(disk, disk->path);
+    if (new_fd < 0) {
+        user_alert("can't reopen [%s] as %ld / %ld bytes: %d, keep the old geometry",
+                   disk->path, layout_size, iounit_size, new_fd);
+        ret = new_fd;
+        disk->layout_size = old_layout_size;
+        disk->iounit_size = old_iounit_size;
+        integrity_stamp(disk, disk->image_stamp);
+        new_fd = disk->backend->open(disk, disk->path);
+    }
+    if (new_fd < 0) {
+        user_panic("can't reopen [%s]: %d, every request fails until it is closed",
+                   disk->path, new_fd);
+        disk->backend = &ddriver_dead_backend;
+        disk->priv    = NULL;
+        return ret;
+    }
+    if (new_fd != fd) {
+        dup2(new_fd, fd);
+        close(new_fd);
+    }
+    disk->ddriver_fd = fd;
+    disk->head = 0;
+    channel_rewind(disk);
+    stats_geometry(disk);
+    for (int i = 0; i < DDRIVER_MAX_HANDLES; i++) {
+        if (__atomic_load_n(&handles[i].in_use, __ATOMIC_ACQUIRE) && handles[i].disk == disk)
+            handles[i].pos = 0;
+    }
+    setup_integrity(disk);
+    setup_flash(disk);
+    setup_cache(disk);
+    return ret;
+}
+/**
+ * @brief 快照、回滚或丢弃覆盖层：快照前写回缓存，回滚与丢弃后作废缓存，调用者需持有设备锁
+ * 
+ * @param disk 
+ * @param cmd 
+ * @return int 
+ */
+static int overlay_request(struct ddriver *disk, unsigned long cmd) {
+    int (*op)(struct ddriver *disk);
+    int ret = 0;
+
+    if (cmd == IOC_REQ_DEVICE_SNAPSHOT)
+        op = disk->backend->snapshot;
+    else if (cmd == IOC_REQ_DEVICE_ROLLBACK)
+        op = disk->backend->rollback;
+    else
+        op = disk->backend->drop_overlay;
+    if (op == NULL) {
+        user_alert("backend %s has no overlays, use backend = thin", disk->backend->name);
+        return -EOPNOTSUPP;
+    }
+    if (disk->pins != NULL) {
+        user_alert("can't switch overlays while blocks are held by ddriver_get_range");
+        return -EBUSY;
+    }
+
+    if (cmd == IOC_REQ_DEVICE_SNAPSHOT)
+        ret = cache_writeback(disk);
+    else
+        cache_invalidate(disk, 0, disk->layout_size);
+    if (ret == 0)
+        ret = op(disk);
+    if (ret == 0 && cmd != IOC_REQ_DEVICE_SNAPSHOT)
+        ret = integrity_rebuild(disk);                /* The image went back in time */
+    return ret;
+}
+/**
+ * @brief 按路径查找已打开的设备，调用者需持有设备表锁
+ * 
+ * @param path 
+ * @return struct ddriver* 
+ */
+static struct ddriver *find_device(const char *path) {
+    for (int i = 0; i < DDRIVER_MAX_DEVICES; i++) {
+        if (devices[i] != NULL && strcmp(devices[i]->path, path) == 0) {
+            return devices[i];
+        }
+    }
+    return NULL;
+}
+/**
+ * @brief 进程退出时仍打开的设备不会再更新统计页，删除它们的文件
+ */
+static void withdraw_at_exit(void) {
+    pthread_mutex_lock(&devices_lock);
+    for (int i = 0; i < DDRIVER_MAX_DEVICES; i++) {
+        if (devices[i] != NULL)
+            stats_withdraw(devices[i]);
+    }
+    pthread_mutex_unlock(&devices_lock);
+}
+/**
+ * @brief 按配置初始化path处的设备并加入设备表，第一个设备同时启动日志，调用者需持有设备表锁
+ * 
+ * @param path 
+ * @param home 
+ * @param out 
+ * @return int 
+ */
+static int create_device(const char *path, const char *home, struct ddriver **out) {
+    struct ddriver_config conf;
+    struct ddriver_profile profile;
+    struct ddriver *disk;
+    char conf_path[512] = {0};
+    char dev_conf_path[256] = {0};
+    char log_path[512] = {0};
+    int  slot, fd;
+
+    for (slot = 0; slot < DDRIVER_MAX_DEVICES && devices[slot] != NULL; slot++)
+        ;
+    if (slot == DDRIVER_MAX_DEVICES) {
+        user_panic("can't open [%s], %d devices are open", path, DDRIVER_MAX_DEVICES);
+        return -EMFILE;
+    }
+    snprintf(conf_path, sizeof(conf_path), "%s/" DEVICE_CONF, home);
+    snprintf(dev_conf_path, sizeof(dev_conf_path), "%s.conf", path);
+    snprintf(log_path, sizeof(log_path), "%s/" DEVICE_LOG, home);
+    if (ddriver_load_config(&conf, conf_path,
+                            strcmp(dev_conf_path, conf_path) != 0 ? dev_conf_path : NULL) < 0)
+        return -EINVAL;
+    if (conf.base[0] != '\0' && strcmp(conf.backend, ddriver_thin_backend.name) != 0) {
+        user_panic("base needs backend = thin");
+        return -EINVAL;
+    }
+    if (profile_load(&profile, conf.profile, conf.profile_file) < 0)
+        return -EINVAL;
+
+    disk = (struct ddriver *)malloc(sizeof(struct ddriver));
+    if (disk == NULL)
+        return -ENOMEM;
+    *disk = disk_template;
+    disk->layout_size   = conf.layout_size;
+    disk->iounit_size   = conf.iounit_size;
+    disk->virtual_clock = strcmp(conf.latency, "virtual") == 0;
+    disk->backend       = select_backend(conf.backend);
+    disk->sched         = ddriver_sched_parse(conf.sched);
+    disk->sched_dir     = 1;
+    disk->cache_size    = conf.cache_size;
+    disk->cache_ways    = conf.cache_ways;
+    disk->stripes       = conf.stripes;
+    disk->stripe_unit   = conf.stripe_unit;
+    disk->flash_mode    = conf.flash;
+    disk->flash_page    = conf.flash_page;
+    disk->flash_block   = conf.flash_block;
+    disk->flash_op      = conf.flash_op;
+    disk->thin_cluster  = conf.thin_cluster;
+    strcpy(disk->base, conf.base);
+    disk->profile       = profile;
+    disk->integrity_mode = conf.integrity;
+    disk->nr_channels   = conf.channels;
+    disk->channel_unit  = conf.channel_unit;
+    disk->slot          = slot;
+    strcpy(disk->path, path);
+    fd = channel_init(disk);
     if (fd < 0) {
-        user_panic("can't open device: %d", fd);
+        free(disk);
         return fd;
     }
-    ret = posix_fallocate(fd, 0, CONFIG_DISK_SZ);
-    if (ret < 0) {
-        user_panic("low space");
+    fd = stats_publish(disk, conf.monitor);
+    if (fd < 0) {
+        channel_destroy(disk);
+        free(disk);
+        return fd;
+    }
+    if (disk->mon_shared && !exit_hook) {
+        atexit(withdraw_at_exit);
+        exit_hook = 1;
+    }
+    pthread_mutex_init(&disk->lock, NULL);
+
+    integrity_stamp(disk, disk->image_stamp);
+    fd = disk->backend->open(disk, path);
+    if (fd < 0) {
+        pthread_mutex_destroy(&disk->lock);
+        channel_destroy(disk);
+        stats_unpublish(disk);
+        free(disk);
+        return fd;
+    }
+    disk->ddriver_fd = fd;
+
+    if (nr_devices == 0) {
+        debugf = fopen(log_path, "w+");
+        if (debugf == NULL) {
+            user_panic("can't init log: %s", log_path);
+            disk->backend->close(disk);
+            pthread_mutex_destroy(&disk->lock);
+            channel_destroy(disk);
+            stats_unpublish(disk);
+            free(disk);
+            return -1;
+        }
+        ddriver_log_level = conf.log_level;
+        log_start();
+    }
+    DISK_LOCK(disk);
+    setup_integrity(disk);
+    setup_flash(disk);
+    setup_cache(disk);
+    if (conf.trace[0] != '\0') {
+        trace_open(disk, conf.trace);
+    }
+    DISK_UNLOCK(disk);
+    devices[slot] = disk;
+    nr_devices++;
+    *out = disk;
+    return 0;
+}
+/**
+ * @brief 关闭设备并移出设备表，最后一个设备同时停止日志，调用者需持有设备表锁
+ * 
+ * @param disk 
+ * @return int 
+ */
+static int destroy_device(struct ddriver *disk) {
+    int ret, res;
+
+    DISK_LOCK(disk);
+    block_release_all(disk);
+    trace_close(disk);
+    ret = cache_destroy(disk);
+    flash_destroy(disk);
+    res = disk->backend->close(disk);
+    integrity_close(disk);                            /* Stamps the image as closed */
+    if (ret == 0)
+        ret = res;
+    DISK_UNLOCK(disk);
+    for (int i = 0; i < DDRIVER_MAX_DEVICES; i++) {
+        if (devices[i] == disk)
+            devices[i] = NULL;
+    }
+    pthread_mutex_destroy(&disk->lock);
+    channel_destroy(disk);
+    stats_unpublish(disk);
+    free(disk);
+
+    if (--nr_devices == 0) {
+        log_stop();
+        fclose(debugf);
+        debugf = NULL;
+    }
+    return ret;
+}
+/******************************************************************************
+* SECTION: Global Function Implementation
+*******************************************************************************/
+/**
+ * @brief 打开驱动，每次打开得到一个独立的句柄(fd)，各自维护读写位置。
+ *        不同的path是互相独立的设备，各自有几何参数、模型与统计；
+ *        设备在第一次打开时初始化，最后一个句柄关闭时关闭
+ * 
+ * @param path 镜像路径，相对路径基于$HOME，缺省设备为~/ddriver
+ * @return int 文件描述符
+ */
+int ddriver_open(char *path) {
+    int fd, ret;
+    struct ddriver *disk;
+    char home[256];
+    char device_path[sizeof(disk->path)] = {0};
+    
+    if (path == NULL || *path == '\0')
+        return -EINVAL;
+    if ((ret = ddriver_home(home, sizeof(home))) < 0)
         return ret;
+    if (path[0] == '/')
+        ret = snprintf(device_path, sizeof(device_path), "%s", path);
+    else
+        ret = snprintf(device_path, sizeof(device_path), "%s/%s", home, path);
+    if (ret >= sizeof(device_path)) {
+        user_panic("path [%s] too long", path);
+        return -ENAMETOOLONG;
     }
 
-    debugf = fopen(log_path, "w+");
-    if (debugf == NULL) {
-        user_panic("can't init log: %s", log_path);
-        return -1;
+    pthread_mutex_lock(&devices_lock);
+    disk = find_device(device_path);
+    if (disk == NULL && (ret = create_device(device_path, home, &disk)) < 0) {
+        pthread_mutex_unlock(&devices_lock);
+        return ret;
     }
 
+    fd = alloc_handle(disk);
+    if (fd >= 0) {
+        disk->open_cnt++;
+    }
+    else if (disk->open_cnt == 0) {
+        destroy_device(disk);
+    }
+    pthread_mutex_unlock(&devices_lock);
     return fd;
 }
 /**
- * @brief 关闭驱动
+ * @brief 关闭驱动句柄，设备的最后一个句柄关闭时关闭设备
  * 
  * @param fd 
  * @return int 
  */
 int ddriver_close(int fd) {
-    return close(fd) && fclose(debugf);
+    int ret = 0;
+    struct ddriver_handle *handle;
+
+    pthread_mutex_lock(&devices_lock);
+    handle = get_handle(fd);
+    if (handle == NULL) {
+        pthread_mutex_unlock(&devices_lock);
+        return -EBADF;
+    }
+    __atomic_store_n(&handle->in_use, 0, __ATOMIC_RELEASE);  /* Before the fd can be reused */
+    close(handle->fd);
+    if (--handle->disk->open_cnt == 0) {
+        ret = destroy_device(handle->disk);
+    }
+    pthread_mutex_unlock(&devices_lock);
+    return ret;
 }
 /**
- * @brief 磁盘头SEEK
+ * @brief 取得fd所在的设备并加一个引用，在device_release之前设备不会关闭
+ * 
+ * @param fd 
+ * @return struct ddriver* fd无效时返回NULL
+ */
+struct ddriver *device_hold(int fd) {
+    struct ddriver_handle *handle;
+    struct ddriver *disk = NULL;
+
+    pthread_mutex_lock(&devices_lock);
+    handle = get_handle(fd);
+    if (handle != NULL) {
+        disk = handle->disk;
+        disk->open_cnt++;
+    }
+    pthread_mutex_unlock(&devices_lock);
+    return disk;
+}
+/**
+ * @brief 释放device_hold取得的引用，最后一个引用释放时关闭设备
+ * 
+ * @param disk 
+ * @return int 
+ */
+int device_release(struct ddriver *disk) {
+    int ret = 0;
+
+    pthread_mutex_lock(&devices_lock);
+    if (--disk->open_cnt == 0) {
+        ret = destroy_device(disk);
+    }
+    pthread_mutex_unlock(&devices_lock);
+    return ret;
+}
+/**
+ * @brief 移动句柄的读写位置，同时移动磁盘头
  * 
  * @param fd 
  * @param offset 
  * @param whence 
  * @return int 
  */
-int ddriver_seek(int fd, off_t offset, int whence){
-    int ret = 0;
-    int cur = 0;
+off_t ddriver_seek(int fd, off_t offset, int whence){
+    unsigned long long start;
+    off_t ret;
+    struct ddriver_handle *handle = get_handle(fd);
+    if (handle == NULL)
+        return -EBADF;
 
-    if (!IS_ADDR_ALIGN(offset)) {
-        user_alert("offset %ld must be aligned to block size %d", 
-                      offset, CONFIG_BLOCK_SZ);
+    start = TRACE_START(handle->disk);
+    DISK_LOCK(handle->disk);
+    ret = do_seek(handle, offset, whence);
+    DISK_UNLOCK(handle->disk);
+    trace_record(handle->disk, DDRIVER_TRACE_SEEK, ret < 0 ? offset : ret, whence, ret < 0 ? ret : 0, start);
+    return ret;
+}
+/**
+ * @brief 在句柄的读写位置完成请求并前移读写位置
+ * 
+ * @param fd 
+ * @param op 
+ * @param iov 
+ * @param iovcnt 同readv(2)，不超过IOV_MAX
+ * @return int 
+ */
+static int handle_request(int fd, enum ddriver_op op, const struct iovec *iov, int iovcnt) {
+    int ret;
+    struct ddriver_handle *handle = get_handle(fd);
+    if (handle == NULL)
+        return -EBADF;
+    if (iovcnt < 0 || iovcnt > IOV_MAX)
         return -EINVAL;
-    }
 
-    INC_SEEKCNT(disk);
-    cur = lseek(fd, 0, SEEK_CUR);
-    ret = lseek(fd, offset, whence);
-    if (ret < 0) {
-        user_panic("seek error: %s", strerror(errno));
-        return ret;
-    }
-    emulate_rotate(fd, cur, ret);
+    ret = do_request_at(handle->disk, op, iov, iovcnt, handle->pos);
+    if (ret > 0)
+        handle->pos += ret;
     return ret;
 }
 /**
@@ -207,15 +950,16 @@ int ddriver_seek(int fd, off_t offset, int whence){
  * @return int 
  */
 int ddriver_write(int fd, char *buf, size_t size){
-    int res = check_valid(size);
+    struct iovec iov = { .iov_base = buf, .iov_len = size };
+    struct ddriver_handle *handle = get_handle(fd);
+    int res;
+    if (handle == NULL)
+        return -EBADF;
+    res = check_valid(handle->disk, size);
     if(res < 0)
         return res;
-        
-    RW_DELAY(disk, write);
-    write(fd, buf, size);
 
-    INC_WRITECNT(disk);
-    return CONFIG_BLOCK_SZ;
+    return handle_request(fd, DDRIVER_OP_WRITE, &iov, 1);
 }
 /**
  * @brief 
@@ -226,15 +970,149 @@ int ddriver_write(int fd, char *buf, size_t size){
  * @return int 
  */
 int ddriver_read(int fd, char *buf, size_t size){
-    int res = check_valid(size);
+    struct iovec iov = { .iov_base = buf, .iov_len = size };
+    struct ddriver_handle *handle = get_handle(fd);
+    int res;
+    if (handle == NULL)
+        return -EBADF;
+    res = check_valid(handle->disk, size);
     if(res < 0)
         return res;
 
-    RW_DELAY(disk, read);
-    read(fd, buf, size);
+    return handle_request(fd, DDRIVER_OP_READ, &iov, 1);
+}
+/**
+ * @brief 磁盘连续多块读，一次请求只计一次延迟
+ * 
+ * @param fd 
+ * @param iov 每段长度必须为块大小的整数倍
+ * @param iovcnt 
+ * @return int 读出的字节数
+ */
+int ddriver_readv(int fd, const struct iovec *iov, int iovcnt){
+    return handle_request(fd, DDRIVER_OP_READ, iov, iovcnt);
+}
+/**
+ * @brief 磁盘连续多块写，一次请求只计一次延迟
+ * 
+ * @param fd 
+ * @param iov 每段长度必须为块大小的整数倍
+ * @param iovcnt 
+ * @return int 写入的字节数
+ */
+int ddriver_writev(int fd, const struct iovec *iov, int iovcnt){
+    return handle_request(fd, DDRIVER_OP_WRITE, iov, iovcnt);
+}
+/**
+ * @brief 定位读，不使用也不改变句柄的读写位置，可多线程并发调用
+ * 
+ * @param fd 
+ * @param buf 
+ * @param size 块大小的整数倍
+ * @param offset 
+ * @return int 读出的字节数
+ */
+int ddriver_pread(int fd, char *buf, size_t size, off_t offset){
+    struct iovec iov = { .iov_base = buf, .iov_len = size };
+    struct ddriver_handle *handle = get_handle(fd);
+    if (handle == NULL)
+        return -EBADF;
+    return do_request_at(handle->disk, DDRIVER_OP_READ, &iov, 1, offset);
+}
+/**
+ * @brief 定位写，不使用也不改变句柄的读写位置，可多线程并发调用
+ * 
+ * @param fd 
+ * @param buf 
+ * @param size 块大小的整数倍
+ * @param offset 
+ * @return int 写入的字节数
+ */
+int ddriver_pwrite(int fd, char *buf, size_t size, off_t offset){
+    struct iovec iov = { .iov_base = buf, .iov_len = size };
+    struct ddriver_handle *handle = get_handle(fd);
+    if (handle == NULL)
+        return -EBADF;
+    return do_request_at(handle->disk, DDRIVER_OP_WRITE, &iov, 1, offset);
+}
+/**
+ * @brief 从offset处连续读blks块，等价于一次seek加一次readv，但整体原子
+ * 
+ * @param fd 
+ * @param buf 
+ * @param blks 
+ * @param offset 
+ * @return int 读出的字节数
+ */
+int ddriver_pread_blocks(int fd, char *buf, int blks, off_t offset){
+    struct ddriver_handle *handle = get_handle(fd);
+    struct iovec iov;
+    int ret;
+    if (handle == NULL)
+        return -EBADF;
 
-    INC_READCNT(disk);
-    return CONFIG_BLOCK_SZ;
+    iov.iov_base = buf;
+    iov.iov_len  = (size_t)blks * handle->disk->iounit_size;
+    ret = do_request_at(handle->disk, DDRIVER_OP_READ, &iov, 1, offset);
+    if (ret > 0)
+        handle->pos = offset + ret;
+    return ret;
+}
+/**
+ * @brief 从offset处连续写blks块，等价于一次seek加一次writev，但整体原子
+ * 
+ * @param fd 
+ * @param buf 
+ * @param blks 
+ * @param offset 
+ * @return int 写入的字节数
+ */
+int ddriver_pwrite_blocks(int fd, char *buf, int blks, off_t offset){
+    struct ddriver_handle *handle = get_handle(fd);
+    struct iovec iov;
+    int ret;
+    if (handle == NULL)
+        return -EBADF;
+
+    iov.iov_base = buf;
+    iov.iov_len  = (size_t)blks * handle->disk->iounit_size;
+    ret = do_request_at(handle->disk, DDRIVER_OP_WRITE, &iov, 1, offset);
+    if (ret > 0)
+        handle->pos = offset + ret;
+    return ret;
+}
+/**
+ * @brief 提交一批请求，按调度策略排序合并后派发，完成后返回
+ * 
+ * @param fd 
+ * @param reqs 每个请求的result回填为传输字节数或负的错误码
+ * @param nr 
+ * @return int 成功完成的请求数
+ */
+int ddriver_submit(int fd, struct ddriver_req *reqs, int nr){
+    struct ddriver_handle *handle = get_handle(fd);
+    struct ddriver *disk;
+    unsigned long long start;
+    int ret;
+    if (handle == NULL)
+        return -EBADF;
+    disk  = handle->disk;
+    start = TRACE_START(disk);
+    if (nr < 0 || (nr > 0 && reqs == NULL))
+        return -EINVAL;
+    if (nr == 0)
+        return 0;
+
+    MON_ENTER(disk, nr);
+    DISK_LOCK(disk);
+    ret = ddriver_sched_dispatch(disk, reqs, nr);
+    DISK_UNLOCK(disk);
+    MON_LEAVE(disk, nr);
+    for (int i = 0; i < nr && start != 0; i++) {
+        trace_record(disk, reqs[i].op == DDRIVER_REQ_READ ? DDRIVER_TRACE_READ : DDRIVER_TRACE_WRITE,
+                     reqs[i].offset, reqs[i].size, reqs[i].result, start);
+    }
+    return ret;
 }
 /**
  * @brief 
@@ -245,35 +1123,120 @@ int ddriver_read(int fd, char *buf, size_t size){
  * @return int 
  */
 int ddriver_ioctl(int fd, unsigned long cmd, void *arg){
+    struct ddriver_handle *handle = get_handle(fd);
+    struct ddriver *disk;
+    unsigned long long start;
+    int ret = 0;
+    int size, sched;
     struct ddriver_state state;
-    switch (cmd)
+    struct ddriver_geometry geo;
+    unsigned long long clock_us;
+    struct ddriver_stats stats;
+    unsigned int stats_size;
+    struct ddriver_range range;
+
+    if (handle == NULL)
+        return -EBADF;
+    disk  = handle->disk;
+    start = TRACE_START(disk);
+
+    switch (cmd)                                      /* Lock-free queries */
     {
     case IOC_REQ_DEVICE_SIZE:                         /* Device Size */
-        memcpy(arg, &disk.layout_size, sizeof(int));
-        break;
+        if (disk->layout_size > INT_MAX) {
+            user_alert("device size %ld overflows int, use IOC_REQ_DEVICE_GEOMETRY", 
+                       disk->layout_size);
+            return -EOVERFLOW;
+        }
+        size = disk->layout_size;
+        memcpy(arg, &size, sizeof(int));
+        return 0;
     case IOC_REQ_DEVICE_STATE:                        /* Device State */
-        state.read_cnt = disk.read_cnt;
-        state.write_cnt = disk.write_cnt;
-        state.seek_cnt = disk.seek_cnt;
+        state.read_cnt = STAT_READ(disk->stats->read_cnt);
+        state.write_cnt = STAT_READ(disk->stats->write_cnt);
+        state.seek_cnt = STAT_READ(disk->stats->seek_cnt);
         memcpy(arg, &state, sizeof(struct ddriver_state));
+        return 0;
+    case IOC_REQ_DEVICE_STATS:                        /* Extended Statistics */
+        memcpy(&stats_size, &((struct ddriver_stats *)arg)->size, sizeof(unsigned int));
+        if (stats_size < offsetof(struct ddriver_stats, read_cnt))
+            return -EINVAL;
+        if (stats_size > sizeof(struct ddriver_stats))
+            stats_size = sizeof(struct ddriver_stats);
+        stats_fill(disk, &stats);
+        stats.size = stats_size;
+        memcpy(arg, &stats, stats_size);
+        return 0;
+    case IOC_REQ_DEVICE_IO_SZ:
+        memcpy(arg, &disk->iounit_size, sizeof(int));
+        return 0;
+    case IOC_REQ_DEVICE_CLOCK:                        /* Modeled Device Time */
+        clock_us = STAT_READ(disk->stats->clock_us);
+        memcpy(arg, &clock_us, sizeof(unsigned long long));
+        return 0;
+    case IOC_REQ_DEVICE_GEOMETRY:                     /* 64-bit Device Geometry */
+        geo.layout_size = disk->layout_size;
+        geo.iounit_size = disk->iounit_size;
+        memcpy(arg, &geo, sizeof(struct ddriver_geometry));
+        return 0;
+    default:
         break;
+    }
+
+    DISK_LOCK(disk);
+    switch (cmd)
+    {
     case IOC_REQ_DEVICE_RESET:                        /* Reset Device */
-        lseek(fd, 0, SEEK_SET);
-        char buf[4096] = {'\0'};
-        for (size_t i = 0; i < CONFIG_DISK_SZ; i += 4096)
-        {
-            write(fd, buf, 4096);
+        cache_invalidate(disk, 0, disk->layout_size);
+        ret = disk->backend->reset(disk);
+        flash_reset(disk);
+        if (ret == 0)
+            integrity_discard(disk, 0, disk->layout_size);
+        disk->head = 0;
+        channel_rewind(disk);
+        stats_reset(disk);
+        break;
+    case IOC_REQ_DEVICE_RESET_STATS:                  /* Reset Statistics Only */
+        stats_reset(disk);
+        break;
+    case IOC_REQ_DEVICE_DISCARD:                      /* Discard/TRIM a Range */
+        memcpy(&range, arg, sizeof(struct ddriver_range));
+        if (range.offset > LLONG_MAX || range.size > LLONG_MAX) {
+            ret = -EINVAL;
+            break;
         }
-        lseek(fd, 0, SEEK_SET);
-        disk.read_cnt = 0;
-        disk.write_cnt = 0;
-        disk.seek_cnt = 0;
+        ret = discard_range(disk, range.offset, range.size);
+        DISK_UNLOCK(disk);
+        trace_record(disk, DDRIVER_TRACE_DISCARD, range.offset, range.size, ret, start);
+        return ret;
+    case IOC_REQ_DEVICE_SET_GEOMETRY:                 /* Resize Device */
+        memcpy(&geo, arg, sizeof(struct ddriver_geometry));
+        ret = set_geometry(disk, geo.layout_size, geo.iounit_size);
         break;
-    case IOC_REQ_DEVICE_IO_SZ:
-        memcpy(arg, &disk.iounit_size, sizeof(int));
+    case IOC_REQ_DEVICE_FLUSH:                        /* Write-back barrier */
+        ret = flush_device(disk);
+        DISK_UNLOCK(disk);
+        trace_record(disk, DDRIVER_TRACE_FLUSH, 0, 0, ret, start);
+        return ret;
+    case IOC_REQ_DEVICE_SCHED:                        /* Switch I/O Scheduler */
+        memcpy(&sched, arg, sizeof(int));
+        if (sched < DDRIVER_SCHED_FIFO || sched > DDRIVER_SCHED_DEADLINE) {
+            ret = -EINVAL;
+            break;
+        }
+        disk->sched = sched;
+        disk->sched_dir = 1;
         break;
-    default:
+    case IOC_REQ_DEVICE_SNAPSHOT:                     /* Freeze into a snapshot */
+    case IOC_REQ_DEVICE_ROLLBACK:                     /* Back to the last snapshot */
+    case IOC_REQ_DEVICE_DROP_OVERLAY:                 /* Back to the base image */
+        ret = overlay_request(disk, cmd);
+        break;
+    default:                                          /* Unknown or from a stale header */
+        ret = -ENOTTY;
         break;
     }
-    return 0;
-}
\ No newline at end of file
+    DISK_UNLOCK(disk);
+    trace_record(disk, DDRIVER_TRACE_IOCTL, 0, cmd, ret, start);
+    return ret;
+}
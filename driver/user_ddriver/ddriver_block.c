@@ -0,0 +1,228 @@
+#include <limits.h>
+#include "ddriver_priv.h"
+/******************************************************************************
+* SECTION: Zero-copy block access, ddriver_get_range/ddriver_put_range
+*
+* ddriver_get_range hands out a pointer to blks device blocks that stays
+* valid until the matching put, so a filesystem can parse and update
+* metadata in place instead of reading into a temporary buffer and copying
+* it out. Where the pointer comes from depends on what holds the data:
+*   PIN_CACHE  a single block with the block cache on: the cache line itself,
+*              pinned so it is not evicted; a dirty put dirties the line
+*   PIN_MAP    a backend with map (mmap) and no cache: the mapped image
+*              itself; get/put only charge the modeled request
+*   PIN_BUF    everything else: a block-aligned buffer filled by one request
+*              and written back by one request on a dirty put
+* A get with DDRIVER_BLK_READ costs one read request and a dirty put one
+* write request, exactly as the equivalent pread/pwrite would, and both are
+* traced as such. Outstanding pins are kept on disk->pins under disk->lock.
+*******************************************************************************/
+#define BLOCK_BUF_ALIGN         4096                  /* Direct backend needs no bounce */
+
+enum pin_kind
+{
+    PIN_CACHE,
+    PIN_MAP,
+    PIN_BUF
+};
+
+struct ddriver_pin
+{
+    struct ddriver_pin *next;
+    char              *ptr;
+    off_t              offset;
+    size_t             size;
+    int                flags;                         /* DDRIVER_BLK_* */
+    enum pin_kind      kind;
+    struct cache_line *line;                          /* PIN_CACHE only */
+};
+/**
+ * @brief 在offset处建立钉住，调用者需持有设备锁并已检查参数
+ *
+ * @param pin
+ * @return int
+ */
+static int pin_acquire(struct ddriver *disk, struct ddriver_pin *pin) {
+    struct iovec iov;
+    void  *buf;
+    int    ret;
+
+    if (disk->cache != NULL && pin->size == disk->iounit_size) {
+        pin->kind = PIN_CACHE;
+        return cache_pin(disk, pin->offset, pin->flags & DDRIVER_BLK_READ, &pin->line, &pin->ptr);
+    }
+    if (disk->cache == NULL && disk->backend->map != NULL) {
+        pin->kind = PIN_MAP;
+        pin->ptr  = (char *)disk->backend->map(disk, pin->offset);
+        if (pin->flags & DDRIVER_BLK_READ) {
+            ret = request_in_place(disk, DDRIVER_OP_READ, pin->offset, pin->size);
+            return ret < 0 ? ret : 0;
+        }
+        return 0;
+    }
+
+    pin->kind = PIN_BUF;
+    if (posix_memalign(&buf, BLOCK_BUF_ALIGN, pin->size) != 0)
+        return -ENOMEM;
+    pin->ptr = (char *)buf;
+    if (pin->flags & DDRIVER_BLK_READ) {
+        iov.iov_base = pin->ptr;
+        iov.iov_len  = pin->size;
+        ret = request_at(disk, DDRIVER_OP_READ, &iov, 1, pin->offset);
+        if (ret < 0) {
+            free(pin->ptr);
+            return ret;
+        }
+    }
+    return 0;
+}
+/**
+ * @brief 解除钉住，dirty时把内容提交到设备，调用者需持有设备锁
+ *
+ * @param pin
+ * @param dirty
+ * @return int
+ */
+static int pin_release(struct ddriver *disk, struct ddriver_pin *pin, int dirty) {
+    struct iovec iov = { .iov_base = pin->ptr, .iov_len = pin->size };
+    int ret = 0;
+
+    switch (pin->kind)
+    {
+    case PIN_CACHE:
+        cache_unpin(disk, pin->line, dirty);
+        break;
+    case PIN_MAP:
+        if (dirty)
+            ret = request_in_place(disk, DDRIVER_OP_WRITE, pin->offset, pin->size);
+        break;
+    case PIN_BUF:
+        if (dirty)
+            ret = request_at(disk, DDRIVER_OP_WRITE, &iov, 1, pin->offset);
+        free(pin->ptr);
+        break;
+    }
+    return ret < 0 ? ret : 0;
+}
+/**
+ * @brief 最后一个句柄关闭时放弃所有未归还的块，其中的修改丢失，调用者需持有设备锁
+ */
+void block_release_all(struct ddriver *disk) {
+    struct ddriver_pin *pin;
+
+    if (disk->pins != NULL)
+        user_alert("device closed with blocks still held, changes to them are lost");
+    while ((pin = disk->pins) != NULL) {
+        disk->pins = pin->next;
+        pin_release(disk, pin, 0);
+        free(pin);
+    }
+}
+/**
+ * @brief 取得offset起blks个块的指针，直到ddriver_put_range之前一直有效
+ *
+ * @param fd
+ * @param offset
+ * @param blks
+ * @param flags DDRIVER_BLK_READ / DDRIVER_BLK_WRITE
+ * @return void* 失败返回NULL
+ */
+void *ddriver_get_range(int fd, off_t offset, int blks, int flags) {
+    struct ddriver_handle *handle = get_handle(fd);
+    struct ddriver *disk;
+    struct ddriver_pin *pin;
+    unsigned long long start;
+    size_t size;
+    int    ret;
+
+    if (handle == NULL)
+        return NULL;
+    disk  = handle->disk;
+    start = TRACE_START(disk);
+    size  = (size_t)blks * disk->iounit_size;
+    if (blks <= 0 || size > INT_MAX || offset % disk->iounit_size != 0 ||
+        check_valid_range(disk, offset, size) < 0 ||
+        (flags & ~(DDRIVER_BLK_READ | DDRIVER_BLK_WRITE)) != 0)
+        return NULL;
+    pin = (struct ddriver_pin *)calloc(1, sizeof(struct ddriver_pin));
+    if (pin == NULL)
+        return NULL;
+    pin->offset = offset;
+    pin->size   = size;
+    pin->flags  = flags;
+
+    DISK_LOCK(disk);
+    ret = pin_acquire(disk, pin);
+    if (ret == 0) {
+        pin->next = disk->pins;
+        disk->pins = pin;
+    }
+    DISK_UNLOCK(disk);
+    if (flags & DDRIVER_BLK_READ)
+        trace_record(disk, DDRIVER_TRACE_READ, offset, size, ret < 0 ? ret : size, start);
+    if (ret < 0) {
+        user_alert("can't get %d blocks at %ld: %s", blks, offset, strerror(-ret));
+        free(pin);
+        return NULL;
+    }
+    return pin->ptr;
+}
+/**
+ * @brief 归还ddriver_get_range取得的块，dirty时提交修改
+ *
+ * @param fd
+ * @param ptr ddriver_get_range的返回值
+ * @param dirty 须以DDRIVER_BLK_WRITE取得
+ * @return int
+ */
+int ddriver_put_range(int fd, void *ptr, int dirty) {
+    struct ddriver_handle *handle = get_handle(fd);
+    struct ddriver *disk;
+    struct ddriver_pin **link, *pin;
+    unsigned long long start;
+    int ret;
+
+    if (handle == NULL)
+        return -EBADF;
+    disk  = handle->disk;
+    start = TRACE_START(disk);
+
+    DISK_LOCK(disk);
+    for (link = &disk->pins; *link != NULL && (*link)->ptr != ptr; link = &(*link)->next)
+        ;
+    pin = *link;
+    if (pin == NULL || (dirty && !(pin->flags & DDRIVER_BLK_WRITE))) {
+        DISK_UNLOCK(disk);
+        return -EINVAL;
+    }
+    *link = pin->next;
+    ret = pin_release(disk, pin, dirty);
+    DISK_UNLOCK(disk);
+    if (dirty)
+        trace_record(disk, DDRIVER_TRACE_WRITE, pin->offset, pin->size,
+                     ret < 0 ? ret : pin->size, start);
+    free(pin);
+    return ret;
+}
+/**
+ * @brief 取得offset处一个块的指针，见ddriver_get_range
+ *
+ * @param fd
+ * @param offset
+ * @param flags
+ * @return void*
+ */
+void *ddriver_get_block(int fd, off_t offset, int flags) {
+    return ddriver_get_range(fd, offset, 1, flags);
+}
+/**
+ * @brief 归还ddriver_get_block取得的块
+ *
+ * @param fd
+ * @param blk
+ * @param dirty
+ * @return int
+ */
+int ddriver_put_block(int fd, void *blk, int dirty) {
+    return ddriver_put_range(fd, blk, dirty);
+}
@@ -0,0 +1,455 @@
+#include <time.h>
+#include "ddriver_priv.h"
+/******************************************************************************
+* SECTION: Write-back block cache
+*
+* An optional N-way set-associative cache of device blocks in front of the
+* device model (cache_size in ddriver.conf, off by default). Block b lives in
+* set b % nsets and each set picks its victim with CLOCK (second chance).
+* Hits cost no modeled latency; a write only dirties the cached block. Dirty
+* blocks reach the device when they are evicted, when the flusher thread
+* finds the device idle, or at a flush barrier (IOC_REQ_DEVICE_FLUSH or
+* DDRIVER_REQ_FLUSH). With latency = virtual the flusher stays idle: its
+* wall-clock timing would make the modeled clock differ from run to run. Write-back sorts them by address and issues every
+* contiguous run as a single request.
+*
+* ddriver_get_block pins a line and hands out its data in place; a pinned
+* line is never chosen as a victim, and discarding it zeroes it in place.
+*
+* The cache is only touched under disk->lock. The flusher never blocks on it,
+* so cache_destroy can join the flusher while holding the lock.
+*******************************************************************************/
+#define CACHE_FLUSH_INTERVAL_MS 100
+#define CACHE_MAX_RUN           1024                  /* Linux IOV_MAX */
+
+struct cache_line
+{
+    off_t blkno;
+    int   valid;
+    int   dirty;
+    int   ref;                                        /* CLOCK reference bit */
+    int   pin;                                        /* Held by ddriver_get_block, never evicted */
+    char *data;
+};
+
+struct ddriver_cache
+{
+    struct ddriver     *disk;                         /* Device the flusher writes back */
+    int                 block_size;
+    int                 nsets;
+    int                 ways;
+    int                 nlines;
+    int                 dirty_cnt;
+    struct cache_line  *lines;                        /* Set-major, ways lines per set */
+    int                *hands;                        /* CLOCK hand of each set */
+    char               *data;
+    struct cache_line **dirty;                        /* Scratch for write-back */
+    struct iovec       *iov;
+    pthread_t           flusher;
+    pthread_mutex_t     flusher_lock;
+    pthread_cond_t      flusher_cond;
+    int                 stop;
+};
+
+static int cmp_blkno(const void *a, const void *b) {
+    const struct cache_line *la = *(struct cache_line * const *)a;
+    const struct cache_line *lb = *(struct cache_line * const *)b;
+    return la->blkno < lb->blkno ? -1 : la->blkno > lb->blkno;
+}
+/**
+ * @brief 在iov的pos处与buf之间拷贝len字节
+ *
+ * @param to_iov 1: buf -> iov, 0: iov -> buf
+ */
+static void iov_copy(const struct iovec *iov, int iovcnt, size_t pos,
+                     char *buf, size_t len, int to_iov) {
+    size_t n;
+    for (int i = 0; i < iovcnt && len > 0; i++) {
+        if (pos >= iov[i].iov_len) {
+            pos -= iov[i].iov_len;
+            continue;
+        }
+        n = iov[i].iov_len - pos < len ? iov[i].iov_len - pos : len;
+        if (to_iov)
+            memcpy((char *)iov[i].iov_base + pos, buf, n);
+        else
+            memcpy(buf, (char *)iov[i].iov_base + pos, n);
+        buf += n;
+        len -= n;
+        pos  = 0;
+    }
+}
+
+static struct cache_line *cache_lookup(struct ddriver_cache *cache, off_t blkno) {
+    struct cache_line *set = &cache->lines[(blkno % cache->nsets) * cache->ways];
+    for (int i = 0; i < cache->ways; i++) {
+        if (set[i].valid && set[i].blkno == blkno)
+            return &set[i];
+    }
+    return NULL;
+}
+
+static int writeback_line(struct ddriver_cache *cache, struct cache_line *line) {
+    struct iovec iov = { .iov_base = line->data, .iov_len = cache->block_size };
+    int ret = request_at_device(cache->disk, DDRIVER_OP_WRITE, &iov, 1,
+                                line->blkno * cache->block_size);
+    if (ret < 0)
+        return ret;
+    line->dirty = 0;
+    cache->dirty_cnt--;
+    STAT_ADD(cache->disk->stats->cache_writeback, 1);
+    return 0;
+}
+/**
+ * @brief 为blkno分配一行：优先空行，否则按CLOCK淘汰，脏行先写回
+ *
+ * @param cache
+ * @param blkno
+ * @param out
+ * @return int
+ */
+static int cache_alloc(struct ddriver_cache *cache, off_t blkno, struct cache_line **out) {
+    int   index = blkno % cache->nsets;
+    int  *hand  = &cache->hands[index];
+    struct cache_line *set = &cache->lines[index * cache->ways];
+    struct cache_line *victim = NULL;
+    int ret, pinned = 0;
+
+    for (int i = 0; i < cache->ways && victim == NULL; i++) {
+        if (!set[i].valid && !set[i].pin)
+            victim = &set[i];
+        pinned += set[i].pin > 0;
+    }
+    if (pinned == cache->ways)
+        return -EBUSY;
+    while (victim == NULL) {
+        if (set[*hand].ref || set[*hand].pin) {
+            set[*hand].ref = 0;
+        }
+        else {
+            victim = &set[*hand];
+        }
+        *hand = (*hand + 1) % cache->ways;
+    }
+    if (victim->valid && victim->dirty && (ret = writeback_line(cache, victim)) < 0)
+        return ret;
+
+    victim->blkno = blkno;
+    victim->valid = 1;
+    victim->dirty = 0;
+    victim->ref   = 1;
+    *out = victim;
+    return 0;
+}
+
+static void *cache_flusher(void *arg) {
+    struct ddriver_cache *cache = (struct ddriver_cache *)arg;
+    struct timespec ts;
+
+    pthread_mutex_lock(&cache->flusher_lock);
+    while (!cache->stop) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += CACHE_FLUSH_INTERVAL_MS * 1000000L;
+        ts.tv_sec  += ts.tv_nsec / 1000000000L;
+        ts.tv_nsec %= 1000000000L;
+        pthread_cond_timedwait(&cache->flusher_cond, &cache->flusher_lock, &ts);
+        if (cache->stop)
+            break;
+        pthread_mutex_unlock(&cache->flusher_lock);
+        if (!cache->disk->virtual_clock &&               /* Only when the device is idle */
+            pthread_mutex_trylock(&cache->disk->lock) == 0) {
+            if (cache->dirty_cnt > 0)
+                cache_writeback(cache->disk);
+            DISK_UNLOCK(cache->disk);
+        }
+        pthread_mutex_lock(&cache->flusher_lock);
+    }
+    pthread_mutex_unlock(&cache->flusher_lock);
+    return NULL;
+}
+/**
+ * @brief 按当前IO单位建立缓存并启动刷回线程，调用者需持有设备锁
+ *
+ * @param disk
+ * @param size 缓存容量(字节)
+ * @param ways 组相联路数
+ * @return int
+ */
+int cache_init(struct ddriver *disk, off_t size, int ways) {
+    struct ddriver_cache *cache;
+    int nlines = size / disk->iounit_size;
+
+    if (nlines <= 0 || ways <= 0)
+        return -EINVAL;
+    if (ways > nlines)
+        ways = nlines;
+
+    cache = (struct ddriver_cache *)calloc(1, sizeof(struct ddriver_cache));
+    if (cache == NULL)
+        return -ENOMEM;
+    cache->disk       = disk;
+    cache->block_size = disk->iounit_size;
+    cache->ways       = ways;
+    cache->nsets      = nlines / ways;
+    cache->nlines     = cache->nsets * ways;
+    cache->lines      = (struct cache_line *)calloc(cache->nlines, sizeof(struct cache_line));
+    cache->hands      = (int *)calloc(cache->nsets, sizeof(int));
+    cache->data       = (char *)malloc((size_t)cache->nlines * cache->block_size);
+    cache->dirty      = (struct cache_line **)malloc(sizeof(struct cache_line *) * cache->nlines);
+    cache->iov        = (struct iovec *)malloc(sizeof(struct iovec) * CACHE_MAX_RUN);
+    if (cache->lines == NULL || cache->hands == NULL || cache->data == NULL ||
+        cache->dirty == NULL || cache->iov == NULL)
+        goto err_free;
+    for (int i = 0; i < cache->nlines; i++) {
+        cache->lines[i].data = cache->data + (size_t)i * cache->block_size;
+    }
+
+    pthread_mutex_init(&cache->flusher_lock, NULL);
+    pthread_cond_init(&cache->flusher_cond, NULL);
+    if (pthread_create(&cache->flusher, NULL, cache_flusher, cache) != 0) {
+        user_panic("can't start cache flusher");
+        pthread_mutex_destroy(&cache->flusher_lock);
+        pthread_cond_destroy(&cache->flusher_cond);
+        goto err_free;
+    }
+    disk->cache = cache;
+    return 0;
+
+err_free:
+    free(cache->lines);
+    free(cache->hands);
+    free(cache->data);
+    free(cache->dirty);
+    free(cache->iov);
+    free(cache);
+    return -ENOMEM;
+}
+/**
+ * @brief 写回所有脏块，停止刷回线程并释放缓存，调用者需持有设备锁
+ *
+ * @return int 写回的结果，缓存总是被释放
+ */
+int cache_destroy(struct ddriver *disk) {
+    struct ddriver_cache *cache = disk->cache;
+    int ret;
+
+    if (cache == NULL)
+        return 0;
+    ret = cache_writeback(disk);
+
+    pthread_mutex_lock(&cache->flusher_lock);
+    cache->stop = 1;
+    pthread_cond_signal(&cache->flusher_cond);
+    pthread_mutex_unlock(&cache->flusher_lock);
+    pthread_join(cache->flusher, NULL);
+    pthread_mutex_destroy(&cache->flusher_lock);
+    pthread_cond_destroy(&cache->flusher_cond);
+
+    free(cache->lines);
+    free(cache->hands);
+    free(cache->data);
+    free(cache->dirty);
+    free(cache->iov);
+    free(cache);
+    disk->cache = NULL;
+    return ret;
+}
+/**
+ * @brief 经缓存完成一次定位请求，调用者需持有设备锁并已检查参数
+ *   读：全部命中则直接返回；否则整段读设备，再用脏块覆盖并填充缺失块
+ *   写：只写入缓存并置脏
+ * @param op
+ * @param iov
+ * @param iovcnt
+ * @param offset
+ * @return int 传输的字节数
+ */
+int cache_request(struct ddriver *disk, enum ddriver_op op, const struct iovec *iov, int iovcnt,
+                  off_t offset) {
+    struct ddriver_cache *cache = disk->cache;
+    struct cache_line *line;
+    size_t size  = iov_total(iov, iovcnt);
+    size_t bs    = cache->block_size;
+    off_t  first = offset / bs;
+    int    nblks = size / bs;
+    int    hits  = 0;
+    int    ret;
+
+    if (op == DDRIVER_OP_WRITE) {
+        for (int i = 0; i < nblks; i++) {
+            if ((line = cache_lookup(cache, first + i)) != NULL) {
+                hits++;
+            }
+            else if ((ret = cache_alloc(cache, first + i, &line)) < 0) {
+                return ret;
+            }
+            iov_copy(iov, iovcnt, i * bs, line->data, bs, 0);
+            line->ref = 1;
+            if (!line->dirty) {
+                line->dirty = 1;
+                cache->dirty_cnt++;
+            }
+        }
+        goto out;
+    }
+
+    for (int i = 0; i < nblks; i++) {
+        hits += cache_lookup(cache, first + i) != NULL;
+    }
+    if (hits < nblks && (ret = request_at_device(disk, op, iov, iovcnt, offset)) < 0)
+        return ret;
+    /* Overlay cached blocks before any fill below may evict them */
+    for (int i = 0; i < nblks; i++) {
+        if ((line = cache_lookup(cache, first + i)) == NULL)
+            continue;
+        if (hits == nblks || line->dirty)
+            iov_copy(iov, iovcnt, i * bs, line->data, bs, 1);
+        line->ref = 1;
+    }
+    for (int i = 0; i < nblks && hits < nblks; i++) {
+        if (cache_lookup(cache, first + i) == NULL &&
+            cache_alloc(cache, first + i, &line) == 0) {
+            iov_copy(iov, iovcnt, i * bs, line->data, bs, 0);
+        }
+    }
+
+out:
+    STAT_ADD(disk->stats->cache_hit, hits);
+    STAT_ADD(disk->stats->cache_miss, nblks - hits);
+    return size;
+}
+/**
+ * @brief 按地址顺序写回所有脏块，连续的脏块合并为一次请求，调用者需持有设备锁
+ *
+ * @return int 0成功，否则为最后一次失败的错误码，失败的块保持为脏
+ */
+int cache_writeback(struct ddriver *disk) {
+    struct ddriver_cache *cache = disk->cache;
+    int nr = 0, ret = 0, cnt, res;
+
+    if (cache == NULL || cache->dirty_cnt == 0)
+        return 0;
+    for (int i = 0; i < cache->nlines; i++) {
+        if (cache->lines[i].valid && cache->lines[i].dirty)
+            cache->dirty[nr++] = &cache->lines[i];
+    }
+    qsort(cache->dirty, nr, sizeof(struct cache_line *), cmp_blkno);
+
+    for (int i = 0; i < nr; i += cnt) {
+        cnt = 0;
+        do {
+            cache->iov[cnt].iov_base = cache->dirty[i + cnt]->data;
+            cache->iov[cnt].iov_len  = cache->block_size;
+            cnt++;
+        } while (i + cnt < nr && cnt < CACHE_MAX_RUN &&
+                 cache->dirty[i + cnt]->blkno == cache->dirty[i + cnt - 1]->blkno + 1);
+
+        res = request_at_device(disk, DDRIVER_OP_WRITE, cache->iov, cnt,
+                                cache->dirty[i]->blkno * cache->block_size);
+        if (res < 0) {
+            ret = res;
+            continue;
+        }
+        for (int j = 0; j < cnt; j++) {
+            cache->dirty[i + j]->dirty = 0;
+        }
+        cache->dirty_cnt -= cnt;
+        STAT_ADD(disk->stats->cache_writeback, cnt);
+    }
+    return ret;
+}
+/**
+ * @brief 丢弃[offset, offset + size)内的缓存块(包括脏块)，调用者需持有设备锁
+ *
+ * @param offset
+ * @param size
+ */
+void cache_invalidate(struct ddriver *disk, off_t offset, off_t size) {
+    struct ddriver_cache *cache = disk->cache;
+    struct cache_line *line;
+    off_t first, last;
+
+    if (cache == NULL)
+        return;
+    first = offset / cache->block_size;
+    last  = (offset + size + cache->block_size - 1) / cache->block_size;
+    for (int i = 0; i < cache->nlines; i++) {
+        line = &cache->lines[i];
+        if (!line->valid || line->blkno < first || line->blkno >= last)
+            continue;
+        if (line->dirty)
+            cache->dirty_cnt--;
+        line->dirty = 0;
+        if (line->pin)
+            memset(line->data, 0, cache->block_size);   /* Holder sees the zeros */
+        else
+            line->valid = 0;
+    }
+}
+/**
+ * @brief 钉住offset处的块所在的缓存行，钉住期间不会被淘汰，调用者需持有设备锁
+ *
+ * @param offset
+ * @param fill 未命中时是否从设备读入，为0时内容未定义
+ * @param out 缓存行
+ * @param data 行数据
+ * @return int 所在组的行都被钉住时为-EBUSY
+ */
+int cache_pin(struct ddriver *disk, off_t offset, int fill, struct cache_line **out,
+              char **data) {
+    struct ddriver_cache *cache = disk->cache;
+    off_t  blkno = offset / cache->block_size;
+    struct cache_line *line = cache_lookup(cache, blkno);
+    struct iovec iov;
+    int    ret;
+
+    if (line != NULL) {
+        STAT_ADD(disk->stats->cache_hit, 1);
+    }
+    else {
+        if ((ret = cache_alloc(cache, blkno, &line)) < 0)
+            return ret;
+        iov.iov_base = line->data;
+        iov.iov_len  = cache->block_size;
+        if (fill && (ret = request_at_device(disk, DDRIVER_OP_READ, &iov, 1, offset)) < 0) {
+            line->valid = 0;
+            return ret;
+        }
+        if (!fill)
+            line->valid = 0;                          /* Valid once written back by unpin */
+        STAT_ADD(disk->stats->cache_miss, 1);
+    }
+    line->pin++;
+    line->ref = 1;
+    *out  = line;
+    *data = line->data;
+    return 0;
+}
+/**
+ * @brief 解除钉住，dirty时把行置脏，调用者需持有设备锁
+ *
+ * @param line
+ * @param dirty
+ */
+void cache_unpin(struct ddriver *disk, struct cache_line *line, int dirty) {
+    struct ddriver_cache *cache = disk->cache;
+    struct cache_line *other;
+
+    line->pin--;
+    line->ref = 1;
+    if (!dirty)
+        return;
+    if (!line->valid) {                               /* Unfilled line, supersedes any copy */
+        if ((other = cache_lookup(cache, line->blkno)) != NULL) {
+            if (other->dirty)
+                cache->dirty_cnt--;
+            other->valid = 0;
+            other->dirty = 0;
+        }
+        line->valid = 1;
+    }
+    if (!line->dirty) {
+        line->dirty = 1;
+        cache->dirty_cnt++;
+    }
+}
@@ -0,0 +1,259 @@
+#include "ddriver_priv.h"
+/******************************************************************************
+* SECTION: Multi-channel device model (channels = N in ddriver.conf)
+*
+* Channel c serves the device units (channel_unit bytes) u with u % N == c,
+* like the dies of an SSD or the spindles of a RAID-0. Each channel has its
+* own head, its own queue of profile.parallelism service slots and its own
+* virtual clock; a request covering several channels costs each of them its
+* share (seek from that channel's head, fixed cost, transfer of its bytes)
+* and completes when the slowest one does.
+*
+* Costs are only charged to the channels while the device lock is held and
+* committed when it is released (channel_commit):
+*   - virtual time: every thread has an issue clock per device, and every
+*     channel a calendar of busy intervals per service slot (lane). A
+*     request takes the earliest gap at or after its issuer's clock and
+*     moves the clock to its completion, so a single synchronous thread sees
+*     no overlap, while concurrent threads, ring workers and the requests of
+*     one ddriver_submit batch overlap on distinct channels no matter in
+*     which order they reach the lock. A lane remembers CHANNEL_BUSY_SLOTS
+*     intervals; gaps before the oldest are given up. The device clock is
+*     the latest completion over all channels.
+*   - real time: the thread sleeps the longest share after dropping the
+*     device lock, holding a slot of every channel it used.
+*******************************************************************************/
+#define CHANNEL_BUSY_SLOTS      16
+
+struct channel_lane
+{
+    unsigned long long horizon_us;                    /* Nothing fits before */
+    int nr;
+    struct {
+        unsigned long long start_us, end_us;
+    } busy[CHANNEL_BUSY_SLOTS];                       /* Sorted, disjoint */
+};
+
+struct channel_issue
+{
+    unsigned long long epoch;                         /* disk->clock_epoch it belongs to */
+    unsigned long long now_us;                        /* Completion of the last request */
+};
+
+static unsigned long long clock_epochs;
+
+static __thread struct channel_issue issue[DDRIVER_MAX_DEVICES];
+static __thread long owed_us[DDRIVER_MAX_CHANNELS];   /* Charged, not yet committed */
+static __thread unsigned long long owed_mask;
+static __thread int cur_channel;
+/**
+ * @brief 初始化通道，调用者保证设备尚未被其他线程使用
+ *
+ * @param disk
+ * @return int
+ */
+int channel_init(struct ddriver *disk) {
+    int lanes = disk->profile.parallelism;
+    struct channel_lane *lane = NULL;
+
+    if (disk->nr_channels <= 0 || disk->nr_channels > DDRIVER_MAX_CHANNELS ||
+        disk->channel_unit < 512) {
+        user_panic("channels %d should be in [1, %d] and channel_unit %ld at least 512",
+                   disk->nr_channels, DDRIVER_MAX_CHANNELS, disk->channel_unit);
+        return -EINVAL;
+    }
+    if (disk->nr_channels > 1) {                      /* One channel just adds up clock_us */
+        lane = (struct channel_lane *)calloc(disk->nr_channels * lanes,
+                                             sizeof(struct channel_lane));
+        if (lane == NULL)
+            return -ENOMEM;
+    }
+    for (int c = 0; c < disk->nr_channels; c++) {
+        disk->channels[c].head  = 0;
+        disk->channels[c].lanes = lane != NULL ? lane + c * lanes : NULL;
+        sem_init(&disk->channels[c].units, 0, lanes);
+    }
+    disk->clock_epoch = __atomic_add_fetch(&clock_epochs, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+void channel_destroy(struct ddriver *disk) {
+    for (int c = 0; c < disk->nr_channels; c++) {
+        sem_destroy(&disk->channels[c].units);
+    }
+    free(disk->channels[0].lanes);
+}
+/**
+ * @brief 通道的虚拟时钟归零，各线程的发起时钟随之作废，调用者需持有设备锁
+ *
+ * @param disk
+ */
+void channel_reset_clock(struct ddriver *disk) {
+    if (disk->channels[0].lanes != NULL)
+        memset(disk->channels[0].lanes, 0, disk->nr_channels * disk->profile.parallelism *
+                                           sizeof(struct channel_lane));
+    disk->clock_epoch = __atomic_add_fetch(&clock_epochs, 1, __ATOMIC_RELAXED);
+}
+/**
+ * @brief 所有通道的磁盘头回到0，调用者需持有设备锁
+ *
+ * @param disk
+ */
+void channel_rewind(struct ddriver *disk) {
+    for (int c = 0; c < disk->nr_channels; c++) {
+        disk->channels[c].head = 0;
+    }
+}
+/**
+ * @brief 把模型耗时记到当前通道上
+ *
+ * @param disk
+ * @param us
+ * @return long 当前通道本次持锁期间累计的耗时
+ */
+long channel_charge(struct ddriver *disk, long us) {
+    owed_mask |= 1ULL << cur_channel;
+    return owed_us[cur_channel] += us;
+}
+/**
+ * @brief 按通道拆分一次请求并计延迟，调用者需持有设备锁
+ *
+ * @param op
+ * @param offset
+ * @param size
+ */
+void channel_request(struct ddriver *disk, enum ddriver_op op, off_t offset, size_t size) {
+    off_t  unit = disk->channel_unit;
+    int    nr   = disk->nr_channels;
+    off_t  first[DDRIVER_MAX_CHANNELS];               /* Channel-local start */
+    size_t bytes[DDRIVER_MAX_CHANNELS];
+    unsigned long long used = 0;
+    off_t  pos = offset, end = offset + size;
+
+    while (pos < end) {
+        off_t  u   = pos / unit;
+        size_t len = (u + 1) * unit < end ? (u + 1) * unit - pos : end - pos;
+        int    c   = u % nr;
+
+        if (disk->flash != NULL) {                     /* The FTL wants device addresses */
+            cur_channel = c;
+            flash_request(disk, op, pos, len);
+        }
+        else if ((used & (1ULL << c)) == 0) {
+            used    |= 1ULL << c;
+            first[c] = u / nr * unit + pos % unit;
+            bytes[c] = len;
+        }
+        else {
+            bytes[c] += len;                           /* Contiguous within the channel */
+        }
+        pos += len;
+    }
+    for (int c = 0; c < nr; c++) {
+        struct ddriver_channel *channel = &disk->channels[c];
+
+        if ((used & (1ULL << c)) == 0)
+            continue;
+        cur_channel = c;
+        if (channel->head != first[c])
+            emulate_delay(disk, profile_seek_us(disk, channel->head, first[c],
+                                                disk->layout_size / nr));
+        emulate_delay(disk, profile_request_us(disk, op, bytes[c]));
+        channel->head = first[c] + bytes[c];
+    }
+    cur_channel = 0;
+}
+/**
+ * @brief lane上不早于at、长为us的最早空闲时段的起点
+ *
+ * @param lane
+ * @param at
+ * @param us
+ * @return unsigned long long
+ */
+static unsigned long long lane_fit(const struct channel_lane *lane, unsigned long long at,
+                                   long us) {
+    unsigned long long start = at > lane->horizon_us ? at : lane->horizon_us;
+
+    for (int i = 0; i < lane->nr; i++) {
+        if (start + us <= lane->busy[i].start_us)
+            break;
+        if (lane->busy[i].end_us > start)
+            start = lane->busy[i].end_us;
+    }
+    return start;
+}
+
+static void lane_reserve(struct channel_lane *lane, unsigned long long start, long us) {
+    int i = 0;
+
+    while (i < lane->nr && lane->busy[i].start_us < start)
+        i++;
+    if (i > 0 && lane->busy[i - 1].end_us == start) { /* Extend the previous interval */
+        lane->busy[i - 1].end_us += us;
+        if (i < lane->nr && lane->busy[i].start_us == lane->busy[i - 1].end_us) {
+            lane->busy[i - 1].end_us = lane->busy[i].end_us;
+            memmove(&lane->busy[i], &lane->busy[i + 1],
+                    (lane->nr - i - 1) * sizeof(lane->busy[0]));
+            lane->nr--;
+        }
+        return;
+    }
+    if (lane->nr == CHANNEL_BUSY_SLOTS) {             /* Give up the oldest gap */
+        lane->horizon_us = lane->busy[0].end_us;
+        memmove(&lane->busy[0], &lane->busy[1], (lane->nr - 1) * sizeof(lane->busy[0]));
+        lane->nr--;
+        i--;
+        if (i < 0) {                                  /* Fits before the new horizon */
+            i = 0;
+        }
+    }
+    memmove(&lane->busy[i + 1], &lane->busy[i], (lane->nr - i) * sizeof(lane->busy[0]));
+    lane->busy[i].start_us = start;
+    lane->busy[i].end_us   = start + us;
+    lane->nr++;
+}
+/**
+ * @brief 把本线程持锁期间记下的耗时排进各通道，推进虚拟时钟，
+ *        调用者需持有设备锁
+ *
+ * @param disk
+ * @return unsigned long long 用到的通道
+ */
+unsigned long long channel_commit(struct ddriver *disk) {
+    struct channel_issue *me = &issue[disk->slot];
+    unsigned long long mask = owed_mask, start, best, end;
+    struct channel_lane *lane;
+
+    if (mask == 0)
+        return 0;
+    if (me->epoch != disk->clock_epoch) {
+        me->epoch  = disk->clock_epoch;
+        me->now_us = 0;
+    }
+    end = me->now_us;
+    for (int c = 0; c < disk->nr_channels; c++) {
+        struct ddriver_channel *channel = &disk->channels[c];
+
+        if ((mask & (1ULL << c)) == 0)
+            continue;
+        lane = &channel->lanes[0];
+        best = lane_fit(lane, me->now_us, owed_us[c]);
+        for (int l = 1; l < disk->profile.parallelism && best > me->now_us; l++) {
+            start = lane_fit(&channel->lanes[l], me->now_us, owed_us[c]);
+            if (start < best) {
+                best = start;
+                lane = &channel->lanes[l];
+            }
+        }
+        lane_reserve(lane, best, owed_us[c]);
+        if (best + owed_us[c] > end)
+            end = best + owed_us[c];
+        owed_us[c] = 0;
+    }
+    me->now_us = end;
+    if (end > disk->stats->clock_us)
+        STAT_ADD(disk->stats->clock_us, end - disk->stats->clock_us);
+    owed_mask = 0;
+    return mask;
+}
@@ -0,0 +1,377 @@
+#include <ctype.h>
+#include <limits.h>
+#include <pwd.h>
+#include "ddriver_priv.h"
+/******************************************************************************
+* SECTION: Runtime configuration, loaded at ddriver_open
+*
+* ~/ddriver.conf holds "key = value" lines, '#' starts a comment:
+*     disk_size  = 1G
+*     block_size = 4K
+*     backend    = mmap
+*     latency    = virtual     # real / virtual
+*     sched      = clook
+*     cache_size = 1M          # write-back block cache, 0 or off disables
+*     cache_ways = 8
+*     stripes    = 4           # stripe backend: images and stripe unit
+*     stripe_unit = 64K
+*     trace      = ddriver.trace   # binary I/O trace, relative to $HOME
+*     log_level  = info        # off / alert / info
+*     model      = flash       # hdd / flash, flash: page-mapped FTL with GC
+*     flash_page = 4K          # flash model: page, erase block, over-provisioning %
+*     flash_block = 256K
+*     flash_op   = 7
+*     thin_cluster = 64K       # thin backend: allocation unit of a new image
+*     base       = base.img    # thin backend: read-only image under the overlay
+*     profile    = nvme        # latency: hdd / hdd7200 / sata-ssd / nvme / ram
+*     profile_file = ddriver.profiles  # more profiles, relative to $HOME
+*     monitor    = on          # live stats in /dev/shm for bin/ddriver-mon
+*     channels   = 8           # independent channels, units interleaved by LBA
+*     channel_unit = 64K
+*     integrity  = on          # CRC32C per block in <device>.crc, verified on read
+* A device other than ~/ddriver then reads <device>.conf (e.g. ~/journal.conf
+* for ~/journal), so each device can have its own geometry and model.
+* Environment variables DDRIVER_<KEY> (e.g. DDRIVER_DISK_SIZE) override the
+* files, so a single run can be reconfigured without touching them.
+*******************************************************************************/
+#define CONFIG_ENV_PREFIX       "DDRIVER_"
+#define CONFIG_LINE_SZ          256
+
+/**
+ * @brief 解析带K/M/G后缀的大小，只接受十进制正数
+ *
+ * @param str
+ * @param size
+ * @return int 0成功，否则-EINVAL (含溢出)
+ */
+int ddriver_parse_size(const char *str, off_t *size) {
+    char *end;
+    int   shift = 0;
+    long long val;
+
+    errno = 0;
+    val = strtoll(str, &end, 10);                     /* "010" is ten, not octal */
+    if (end == str || errno == ERANGE || val <= 0) {
+        return -EINVAL;
+    }
+    switch (toupper((unsigned char)*end))
+    {
+    case 'G':
+        shift = 30;
+        end++;
+        break;
+    case 'M':
+        shift = 20;
+        end++;
+        break;
+    case 'K':
+        shift = 10;
+        end++;
+        break;
+    default:
+        break;
+    }
+    if (*end != '\0' || val > (LLONG_MAX >> shift)) {
+        return -EINVAL;
+    }
+    *size = val << shift;
+    return 0;
+}
+
+static char *trim(char *str) {
+    char *end;
+    while (isspace((unsigned char)*str)) {
+        str++;
+    }
+    end = str + strlen(str);
+    while (end > str && isspace((unsigned char)end[-1])) {
+        end--;
+    }
+    *end = '\0';
+    return str;
+}
+
+/**
+ * @brief 取当前用户的主目录，使用getpwuid_r，可多线程调用
+ *
+ * @param buf
+ * @param len
+ * @return int
+ */
+int ddriver_home(char *buf, size_t len) {
+    struct passwd pw, *res = NULL;
+    char   tmp[1024];
+
+    if (getpwuid_r(getuid(), &pw, tmp, sizeof(tmp), &res) != 0 || res == NULL)
+        return -ENOENT;
+    if (snprintf(buf, len, "%s", pw.pw_dir) >= (int)len)
+        return -ENAMETOOLONG;
+    return 0;
+}
+/**
+ * @brief 绝对路径原样使用，相对路径基于$HOME
+ *
+ * @return int
+ */
+static int config_home_path(char *buf, size_t len, const char *val) {
+    char home[256];
+
+    if (val[0] == '/')
+        return snprintf(buf, len, "%s", val) >= (int)len ? -ENAMETOOLONG : 0;
+    if (ddriver_home(home, sizeof(home)) < 0)
+        return -ENOENT;
+    return snprintf(buf, len, "%s/%s", home, val) >= (int)len ? -ENAMETOOLONG : 0;
+}
+
+static int config_set(struct ddriver_config *conf, const char *key, const char *val) {
+    off_t size;
+
+    if (strcmp(key, "disk_size") == 0) {
+        if (ddriver_parse_size(val, &size) < 0)
+            return -EINVAL;
+        conf->layout_size = size;
+    }
+    else if (strcmp(key, "block_size") == 0) {
+        if (ddriver_parse_size(val, &size) < 0)
+            return -EINVAL;
+        conf->iounit_size = size;
+    }
+    else if (strcmp(key, "backend") == 0) {
+        snprintf(conf->backend, sizeof(conf->backend), "%s", val);
+    }
+    else if (strcmp(key, "latency") == 0) {
+        if (strcmp(val, "real") != 0 && strcmp(val, "virtual") != 0)
+            return -EINVAL;
+        snprintf(conf->latency, sizeof(conf->latency), "%s", val);
+    }
+    else if (strcmp(key, "sched") == 0) {
+        if (ddriver_sched_parse(val) < 0)
+            return -EINVAL;
+        snprintf(conf->sched, sizeof(conf->sched), "%s", val);
+    }
+    else if (strcmp(key, "cache_size") == 0) {
+        if (strcmp(val, "0") == 0 || strcmp(val, "off") == 0)
+            size = 0;
+        else if (ddriver_parse_size(val, &size) < 0)
+            return -EINVAL;
+        conf->cache_size = size;
+    }
+    else if (strcmp(key, "stripes") == 0) {
+        if (ddriver_parse_size(val, &size) < 0 || size > 64)
+            return -EINVAL;
+        conf->stripes = size;
+    }
+    else if (strcmp(key, "stripe_unit") == 0) {
+        if (ddriver_parse_size(val, &size) < 0)
+            return -EINVAL;
+        conf->stripe_unit = size;
+    }
+    else if (strcmp(key, "monitor") == 0) {
+        if (strcmp(val, "on") == 0)
+            conf->monitor = 1;
+        else if (strcmp(val, "off") == 0)
+            conf->monitor = 0;
+        else
+            return -EINVAL;
+    }
+    else if (strcmp(key, "integrity") == 0) {
+        if (strcmp(val, "on") == 0)
+            conf->integrity = DDRIVER_INTEGRITY_ON;
+        else if (strcmp(val, "slice8") == 0)
+            conf->integrity = DDRIVER_INTEGRITY_SLICE8;
+        else if (strcmp(val, "off") == 0)
+            conf->integrity = DDRIVER_INTEGRITY_OFF;
+        else
+            return -EINVAL;
+    }
+    else if (strcmp(key, "channels") == 0) {
+        if (ddriver_parse_size(val, &size) < 0 || size < 1 || size > DDRIVER_MAX_CHANNELS)
+            return -EINVAL;
+        conf->channels = size;
+    }
+    else if (strcmp(key, "channel_unit") == 0) {
+        if (ddriver_parse_size(val, &size) < 0 || size < 512)
+            return -EINVAL;
+        conf->channel_unit = size;
+    }
+    else if (strcmp(key, "trace") == 0) {
+        if (strcmp(val, "off") == 0)
+            conf->trace[0] = '\0';
+        else if (config_home_path(conf->trace, sizeof(conf->trace), val) < 0)
+            return -EINVAL;
+    }
+    else if (strcmp(key, "base") == 0) {
+        if (strcmp(val, "off") == 0)
+            conf->base[0] = '\0';
+        else if (config_home_path(conf->base, sizeof(conf->base), val) < 0)
+            return -EINVAL;
+    }
+    else if (strcmp(key, "log_level") == 0) {
+        if (strcmp(val, "off") == 0)
+            conf->log_level = LOG_OFF;
+        else if (strcmp(val, "alert") == 0)
+            conf->log_level = LOG_ALERT;
+        else if (strcmp(val, "info") == 0)
+            conf->log_level = LOG_INFO;
+        else
+            return -EINVAL;
+    }
+    else if (strcmp(key, "model") == 0) {
+        if (strcmp(val, "hdd") == 0)
+            conf->flash = 0;
+        else if (strcmp(val, "flash") == 0)
+            conf->flash = 1;
+        else
+            return -EINVAL;
+    }
+    else if (strcmp(key, "flash_page") == 0) {
+        if (ddriver_parse_size(val, &size) < 0)
+            return -EINVAL;
+        conf->flash_page = size;
+    }
+    else if (strcmp(key, "flash_block") == 0) {
+        if (ddriver_parse_size(val, &size) < 0)
+            return -EINVAL;
+        conf->flash_block = size;
+    }
+    else if (strcmp(key, "flash_op") == 0) {
+        if (strcmp(val, "0") == 0)
+            size = 0;
+        else if (ddriver_parse_size(val, &size) < 0 || size > 1000)
+            return -EINVAL;
+        conf->flash_op = size;
+    }
+    else if (strcmp(key, "thin_cluster") == 0) {
+        if (ddriver_parse_size(val, &size) < 0)
+            return -EINVAL;
+        conf->thin_cluster = size;
+    }
+    else if (strcmp(key, "cache_ways") == 0) {
+        if (ddriver_parse_size(val, &size) < 0 || size > 1024)
+            return -EINVAL;
+        conf->cache_ways = size;
+    }
+    else if (strcmp(key, "profile") == 0) {
+        if (strlen(val) >= sizeof(conf->profile))
+            return -EINVAL;
+        strcpy(conf->profile, val);
+    }
+    else if (strcmp(key, "profile_file") == 0) {
+        if (config_home_path(conf->profile_file, sizeof(conf->profile_file), val) < 0)
+            return -EINVAL;
+    }
+    else {
+        return -ENOENT;
+    }
+    return 0;
+}
+
+static void config_load_file(struct ddriver_config *conf, const char *conf_path) {
+    char  line[CONFIG_LINE_SZ];
+    char *key, *val, *sep;
+    int   lineno = 0;
+    FILE *fp = fopen(conf_path, "r");
+
+    if (fp == NULL) {
+        return;
+    }
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        lineno++;
+        if ((sep = strchr(line, '#')) != NULL) {
+            *sep = '\0';
+        }
+        key = trim(line);
+        if (*key == '\0') {
+            continue;
+        }
+        sep = strchr(key, '=');
+        if (sep == NULL) {
+            user_panic("%s:%d: expect key = value", conf_path, lineno);
+            continue;
+        }
+        *sep = '\0';
+        key  = trim(key);
+        val  = trim(sep + 1);
+        if (config_set(conf, key, val) < 0) {
+            user_panic("%s:%d: bad option [%s = %s]", conf_path, lineno, key, val);
+        }
+    }
+    fclose(fp);
+}
+
+static void config_load_env(struct ddriver_config *conf) {
+    static const char *keys[] = { "disk_size", "block_size", "backend", "latency",
+                                  "sched", "cache_size", "cache_ways", "stripes",
+                                  "stripe_unit", "trace", "log_level", "model",
+                                  "flash_page", "flash_block", "flash_op", "thin_cluster", "base",
+                                  "profile", "profile_file", "monitor", "channels",
+                                  "channel_unit", "integrity" };
+    char  env[64];
+    char *val;
+
+    for (int i = 0; i < sizeof(keys) / sizeof(keys[0]); i++) {
+        int j = snprintf(env, sizeof(env), CONFIG_ENV_PREFIX "%s", keys[i]);
+        while (--j >= (int)strlen(CONFIG_ENV_PREFIX)) {
+            env[j] = toupper((unsigned char)env[j]);
+        }
+        val = getenv(env);
+        if (val != NULL && *val != '\0' && config_set(conf, keys[i], val) < 0) {
+            user_panic("bad environment %s=%s", env, val);
+        }
+    }
+}
+/**
+ * @brief 检查几何参数：IO单位为不小于512的2的幂，磁盘大小为IO单位的整数倍
+ *
+ * @param layout_size
+ * @param iounit_size
+ * @return int
+ */
+int ddriver_check_geometry(off_t layout_size, off_t iounit_size) {
+    if (iounit_size < 512 || iounit_size > (1 << 20) ||
+        (iounit_size & (iounit_size - 1)) != 0) {
+        user_panic("block size %ld should be a power of 2 in [512, 1M]", iounit_size);
+        return -EINVAL;
+    }
+    if (layout_size < iounit_size || layout_size % iounit_size != 0) {
+        user_panic("disk size %ld should be a multiple of block size %ld",
+                   layout_size, iounit_size);
+        return -EINVAL;
+    }
+    return 0;
+}
+/**
+ * @brief 依次从缺省值、配置文件、设备自己的配置文件、环境变量加载配置
+ *
+ * @param conf
+ * @param conf_path
+ * @param dev_conf_path 设备自己的配置文件，NULL表示没有
+ * @return int
+ */
+int ddriver_load_config(struct ddriver_config *conf, const char *conf_path,
+                        const char *dev_conf_path) {
+    memset(conf, 0, sizeof(struct ddriver_config));
+    conf->layout_size = CONFIG_DISK_SZ;
+    conf->iounit_size = CONFIG_BLOCK_SZ;
+    strcpy(conf->sched, "clook");
+    conf->cache_ways  = CONFIG_CACHE_WAYS;
+    conf->stripes     = CONFIG_STRIPES;
+    conf->stripe_unit = CONFIG_STRIPE_UNIT;
+    conf->monitor     = 1;
+    conf->channels    = 1;
+    conf->channel_unit = CONFIG_CHANNEL_UNIT;
+    conf->log_level   = LOG_INFO;
+    conf->flash_page  = CONFIG_FLASH_PAGE;
+    conf->flash_block = CONFIG_FLASH_BLOCK;
+    conf->flash_op    = CONFIG_FLASH_OP;
+    conf->thin_cluster = CONFIG_THIN_CLUSTER;
+    strcpy(conf->profile, CONFIG_PROFILE);
+    config_home_path(conf->profile_file, sizeof(conf->profile_file), CONFIG_PROFILE_FILE);
+
+    config_load_file(conf, conf_path);
+    if (dev_conf_path != NULL)
+        config_load_file(conf, dev_conf_path);
+    config_load_env(conf);
+
+    return ddriver_check_geometry(conf->layout_size, conf->iounit_size);
+}
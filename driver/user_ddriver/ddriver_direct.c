@@ -0,0 +1,245 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <linux/falloc.h>
+#include "ddriver_priv.h"
+/******************************************************************************
+* SECTION: Direct backend, O_DIRECT | O_DSYNC I/O that bypasses the page cache
+*
+* Every read hits the image on the host device and every write is durable when
+* it returns, so timings no longer depend on how much of the image the host
+* happens to cache. O_DIRECT needs aligned buffers and offsets: offsets are
+* always whole blocks, and the block size is checked against the filesystem
+* at open by one direct read. A request whose buffers are DIRECT_ALIGN aligned
+* whole blocks goes straight to preadv/pwritev; any other request is copied
+* through a bounce buffer taken from a small pool of aligned buffers, in
+* chunks of DIRECT_BUF_SZ.
+*******************************************************************************/
+#define DIRECT_ALIGN            4096                  /* Covers any dio memory alignment */
+#define DIRECT_BUF_SZ           (1 << 20)             /* Multiple of every block size */
+#define DIRECT_POOL_BUFS        4
+
+struct direct_pool
+{
+    pthread_mutex_t lock;
+    pthread_cond_t  free_cond;
+    int             nr_free;
+    void           *free[DIRECT_POOL_BUFS];
+};
+
+#define DIRECT_POOL(disk)       ((struct direct_pool *)(disk)->priv)
+
+static void *direct_get_buf(struct direct_pool *pool) {
+    void *buf;
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->nr_free == 0) {
+        pthread_cond_wait(&pool->free_cond, &pool->lock);
+    }
+    buf = pool->free[--pool->nr_free];
+    pthread_mutex_unlock(&pool->lock);
+    return buf;
+}
+
+static void direct_put_buf(struct direct_pool *pool, void *buf) {
+    pthread_mutex_lock(&pool->lock);
+    pool->free[pool->nr_free++] = buf;
+    pthread_cond_signal(&pool->free_cond);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static void direct_pool_free(struct direct_pool *pool) {
+    for (int i = 0; i < pool->nr_free; i++) {
+        free(pool->free[i]);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->free_cond);
+    free(pool);
+}
+
+static int direct_aligned(struct ddriver *disk, const struct iovec *iov, int iovcnt) {
+    for (int i = 0; i < iovcnt; i++) {
+        if ((unsigned long)iov[i].iov_base % DIRECT_ALIGN != 0 ||
+            iov[i].iov_len % disk->iounit_size != 0)
+            return 0;
+    }
+    return 1;
+}
+/**
+ * @brief 在Buf与iov之间拷贝len字节，从iov的第*seg段、段内*seg_off处开始
+ *
+ * @param to_iov 1: Buf -> iov, 0: iov -> Buf
+ */
+static void direct_copy(char *buf, size_t len, const struct iovec *iov, int *seg,
+                        size_t *seg_off, int to_iov) {
+    size_t n;
+
+    while (len > 0) {
+        n = iov[*seg].iov_len - *seg_off;
+        if (n > len)
+            n = len;
+        if (to_iov)
+            memcpy((char *)iov[*seg].iov_base + *seg_off, buf, n);
+        else
+            memcpy(buf, (char *)iov[*seg].iov_base + *seg_off, n);
+        buf      += n;
+        len      -= n;
+        *seg_off += n;
+        if (*seg_off == iov[*seg].iov_len) {
+            (*seg)++;
+            *seg_off = 0;
+        }
+    }
+}
+
+static int direct_bounce(struct ddriver *disk, const struct iovec *iov, int iovcnt,
+                         off_t offset, int write) {
+    size_t  size = iov_total(iov, iovcnt), done, len, seg_off = 0;
+    void   *buf  = direct_get_buf(DIRECT_POOL(disk));
+    ssize_t ret  = 0;
+    int     seg  = 0;
+
+    for (done = 0; done < size; done += len) {
+        len = size - done < DIRECT_BUF_SZ ? size - done : DIRECT_BUF_SZ;
+        if (write) {
+            direct_copy(buf, len, iov, &seg, &seg_off, 0);
+            ret = pwrite(disk->ddriver_fd, buf, len, offset + done);
+        } else {
+            ret = pread(disk->ddriver_fd, buf, len, offset + done);
+            if (ret == len)
+                direct_copy(buf, len, iov, &seg, &seg_off, 1);
+        }
+        if (ret != len)
+            break;
+    }
+    direct_put_buf(DIRECT_POOL(disk), buf);
+    if (done < size) {
+        user_alert("%s error: %s", write ? "write" : "read",
+                   ret < 0 ? strerror(errno) : "short transfer");
+        return -EIO;
+    }
+    return size;
+}
+
+static int direct_open(struct ddriver *disk, const char *path) {
+    struct direct_pool *pool;
+    void   *probe;
+    ssize_t ret;
+    int     fd;
+
+    fd = ddriver_open_image(path, disk->layout_size);  /* Create and size it buffered */
+    if (fd < 0)
+        return fd;
+    close(fd);
+    fd = open(path, O_RDWR | O_DIRECT | O_DSYNC);
+    if (fd < 0) {
+        fd = -errno;
+        user_panic("can't open device with O_DIRECT: %s", strerror(-fd));
+        return fd;
+    }
+
+    pool = (struct direct_pool *)calloc(1, sizeof(struct direct_pool));
+    if (pool == NULL) {
+        close(fd);
+        return -ENOMEM;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->free_cond, NULL);
+    for (int i = 0; i < DIRECT_POOL_BUFS; i++) {
+        if (posix_memalign(&pool->free[i], DIRECT_ALIGN, DIRECT_BUF_SZ) != 0) {
+            direct_pool_free(pool);
+            close(fd);
+            return -ENOMEM;
+        }
+        pool->nr_free++;
+    }
+
+    probe = pool->free[0];                            /* Is one block a valid dio unit? */
+    ret   = pread(fd, probe, disk->iounit_size, 0);
+    if (ret != disk->iounit_size) {
+        user_panic("block size %d is not usable with O_DIRECT on this filesystem: %s",
+                   disk->iounit_size, ret < 0 ? strerror(errno) : "short read");
+        direct_pool_free(pool);
+        close(fd);
+        return -EINVAL;
+    }
+    disk->priv = pool;
+    return fd;
+}
+
+static int direct_close(struct ddriver *disk) {
+    direct_pool_free(DIRECT_POOL(disk));
+    disk->priv = NULL;
+    return close(disk->ddriver_fd);
+}
+
+static int direct_readv(struct ddriver *disk, const struct iovec *iov, int iovcnt,
+                        off_t offset) {
+    size_t  size = iov_total(iov, iovcnt);
+    ssize_t ret;
+
+    if (!direct_aligned(disk, iov, iovcnt))
+        return direct_bounce(disk, iov, iovcnt, offset, 0);
+    ret = preadv(disk->ddriver_fd, iov, iovcnt, offset);
+    if (ret != size) {
+        user_alert("read error: %s", ret < 0 ? strerror(errno) : "short read");
+        return -EIO;
+    }
+    return ret;
+}
+
+static int direct_writev(struct ddriver *disk, const struct iovec *iov, int iovcnt,
+                         off_t offset) {
+    size_t  size = iov_total(iov, iovcnt);
+    ssize_t ret;
+
+    if (!direct_aligned(disk, iov, iovcnt))
+        return direct_bounce(disk, iov, iovcnt, offset, 1);
+    ret = pwritev(disk->ddriver_fd, iov, iovcnt, offset);
+    if (ret != size) {
+        user_alert("write error: %s", ret < 0 ? strerror(errno) : "short write");
+        return -EIO;
+    }
+    return ret;
+}
+
+static int direct_flush(struct ddriver *disk) {
+    return fsync(disk->ddriver_fd) < 0 ? -errno : 0;  /* Data is already stable */
+}
+
+static int direct_reset(struct ddriver *disk) {
+    return ddriver_zero_image(disk->ddriver_fd, disk->layout_size);
+}
+
+static int direct_discard(struct ddriver *disk, off_t offset, off_t size) {
+    void   *buf;
+    off_t   len;
+    int     ret = 0;
+
+    if (fallocate(disk->ddriver_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                  offset, size) == 0)
+        return 0;
+    if (errno != EOPNOTSUPP)
+        return -errno;
+    buf = direct_get_buf(DIRECT_POOL(disk));          /* Zero through an aligned buffer */
+    memset(buf, 0, DIRECT_BUF_SZ);
+    for (off_t i = 0; i < size; i += len) {
+        len = size - i < DIRECT_BUF_SZ ? size - i : DIRECT_BUF_SZ;
+        if (pwrite(disk->ddriver_fd, buf, len, offset + i) != len) {
+            ret = -EIO;
+            break;
+        }
+    }
+    direct_put_buf(DIRECT_POOL(disk), buf);
+    return ret;
+}
+
+const struct ddriver_backend ddriver_direct_backend = {
+    .name    = "direct",
+    .open    = direct_open,
+    .close   = direct_close,
+    .readv   = direct_readv,
+    .writev  = direct_writev,
+    .flush   = direct_flush,
+    .reset   = direct_reset,
+    .discard = direct_discard
+};
@@ -0,0 +1,147 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <linux/falloc.h>
+#include <sys/stat.h>
+#include "ddriver_priv.h"
+/******************************************************************************
+* SECTION: File backend, every block I/O is a pread/pwrite on the image
+*******************************************************************************/
+/**
+ * @brief 打开磁盘镜像；新建时预分配空间，已有镜像只在不足时扩展，
+ *        以保留reset/discard打出的洞
+ *
+ * @param path
+ * @param size
+ * @return int 文件描述符
+ */
+int ddriver_open_image(const char *path, off_t size) {
+    int fd, ret;
+    struct stat st;
+
+    if (access(path, F_OK) == 0) {
+        fd = open(path, O_RDWR);
+        if (fd < 0) {
+            user_panic("can't open device: %d", fd);
+            return fd;
+        }
+        if (fstat(fd, &st) == 0 && st.st_size < size && ftruncate(fd, size) < 0) {
+            ret = -errno;
+            user_panic("can't resize device: %s", strerror(-ret));
+            close(fd);
+            return ret;
+        }
+        return fd;
+    }
+
+    fd = open(path, O_CREAT | O_TRUNC | O_RDWR, 0644);
+    if (fd < 0) {
+        user_panic("can't open device: %d", fd);
+        return fd;
+    }
+    ret = posix_fallocate(fd, 0, size);
+    if (ret != 0) {
+        user_panic("low space");
+        close(fd);
+        return -ret;
+    }
+    return fd;
+}
+
+/**
+ * @brief 释放镜像中[offset, offset + size)的空间，之后读出为0；
+ *        文件系统不支持打洞时退化为写0
+ * 
+ * @param fd 
+ * @param offset 
+ * @param size 
+ * @return int 
+ */
+int ddriver_punch_hole(int fd, off_t offset, off_t size) {
+    char buf[4096] = {'\0'};
+    off_t len;
+
+    if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, size) == 0) {
+        return 0;
+    }
+    if (errno != EOPNOTSUPP) {
+        return -errno;
+    }
+    for (off_t i = 0; i < size; i += len)
+    {
+        len = size - i < sizeof(buf) ? size - i : sizeof(buf);
+        if (pwrite(fd, buf, len, offset + i) != len) {
+            return -EIO;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief 清空整个镜像：打洞，不支持时截断后恢复原大小，两种方式都不逐块写0
+ * 
+ * @param fd 
+ * @param size 
+ * @return int 
+ */
+int ddriver_zero_image(int fd, off_t size) {
+    if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 0, size) == 0) {
+        return 0;
+    }
+    if (ftruncate(fd, 0) < 0 || ftruncate(fd, size) < 0) {
+        return -errno;
+    }
+    return 0;
+}
+
+static int file_open(struct ddriver *disk, const char *path) {
+    return ddriver_open_image(path, disk->layout_size);
+}
+
+static int file_close(struct ddriver *disk) {
+    return close(disk->ddriver_fd);
+}
+
+static int file_readv(struct ddriver *disk, const struct iovec *iov, int iovcnt,
+                      off_t offset) {
+    size_t  size = iov_total(iov, iovcnt);
+    ssize_t ret  = preadv(disk->ddriver_fd, iov, iovcnt, offset);
+    if (ret != size) {
+        user_alert("read error: %s", ret < 0 ? strerror(errno) : "short read");
+        return -EIO;
+    }
+    return ret;
+}
+
+static int file_writev(struct ddriver *disk, const struct iovec *iov, int iovcnt,
+                       off_t offset) {
+    size_t  size = iov_total(iov, iovcnt);
+    ssize_t ret  = pwritev(disk->ddriver_fd, iov, iovcnt, offset);
+    if (ret != size) {
+        user_alert("write error: %s", ret < 0 ? strerror(errno) : "short write");
+        return -EIO;
+    }
+    return ret;
+}
+
+static int file_flush(struct ddriver *disk) {
+    return fsync(disk->ddriver_fd) < 0 ? -errno : 0;
+}
+
+static int file_reset(struct ddriver *disk) {
+    return ddriver_zero_image(disk->ddriver_fd, disk->layout_size);
+}
+
+static int file_discard(struct ddriver *disk, off_t offset, off_t size) {
+    return ddriver_punch_hole(disk->ddriver_fd, offset, size);
+}
+
+const struct ddriver_backend ddriver_file_backend = {
+    .name    = "file",
+    .open    = file_open,
+    .close   = file_close,
+    .readv   = file_readv,
+    .writev  = file_writev,
+    .flush   = file_flush,
+    .reset   = file_reset,
+    .discard = file_discard
+};
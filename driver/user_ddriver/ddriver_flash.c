@@ -0,0 +1,232 @@
+#include "ddriver_priv.h"
+/******************************************************************************
+* SECTION: Flash device model, a page-mapped FTL with greedy GC
+*
+* With model = flash the disk is timed as NAND instead of a spinning disk:
+* there is no seek or rotation, a request costs FLASH_READ_US per page read
+* and FLASH_PROG_US per page programmed. Data still lives in the backend;
+* the FTL below only decides what the NAND would have done.
+*
+* Every logical page maps to a physical page. A write programs the next page
+* of the active erase block and invalidates the old copy; a partial page is
+* read first. Physical space is the logical space plus flash_op percent of
+* over-provisioning plus the FLASH_GC_RESERVE blocks GC works in. When taking
+* a new active block would leave no more than FLASH_GC_RESERVE free blocks,
+* GC picks the closed block with the fewest valid pages, moves them to the
+* active block and erases it, charging the moves and the erase to the write
+* that ran out of space. Discard and reset unmap pages, as do a thin rollback
+* or drop of overlays for the clusters they throw away, so trimmed space is
+* free for GC. Host and NAND page writes give the write amplification
+* reported by IOC_REQ_DEVICE_STATS.
+*******************************************************************************/
+#define FLASH_READ_US           50
+#define FLASH_PROG_US           200
+#define FLASH_ERASE_US          2000
+#define FLASH_GC_RESERVE        2
+#define FLASH_UNMAPPED          0xffffffffu
+#define FLASH_ERASED            0xffffffffu           /* valid[] of a free block */
+
+struct ddriver_flash
+{
+    off_t         page_size;
+    unsigned int  pages_per_block;
+    unsigned int  nr_lpages;
+    unsigned int  nr_blocks;
+    unsigned int *l2p;                                /* Logical -> physical page */
+    unsigned int *p2l;                                /* Physical -> logical, UNMAPPED if invalid */
+    unsigned int *valid;                              /* Valid pages of each block, or ERASED */
+    unsigned int *free;                               /* Stack of erased blocks */
+    unsigned int  nr_free;
+    unsigned int  active;                             /* Block being programmed */
+    unsigned int  wp;                                 /* Next page in the active block */
+};
+
+static void flash_invalidate(struct ddriver_flash *flash, unsigned int lpn) {
+    unsigned int ppn = flash->l2p[lpn];
+    if (ppn == FLASH_UNMAPPED)
+        return;
+    flash->p2l[ppn] = FLASH_UNMAPPED;
+    flash->valid[ppn / flash->pages_per_block]--;
+    flash->l2p[lpn] = FLASH_UNMAPPED;
+}
+
+static void flash_program(struct ddriver_flash *flash, unsigned int lpn);
+/**
+ * @brief 贪心回收：反复擦除有效页最少的块，直到空闲块多于保留数
+ *
+ * @return long 搬移与擦除的模型耗时(us)
+ */
+static long flash_gc(struct ddriver *disk, struct ddriver_flash *flash) {
+    unsigned int victim, base, moved;
+    long us = 0;
+
+    while (flash->nr_free <= FLASH_GC_RESERVE) {
+        victim = FLASH_UNMAPPED;
+        for (unsigned int b = 0; b < flash->nr_blocks; b++) {
+            if (b == flash->active || flash->valid[b] == FLASH_ERASED)
+                continue;
+            if (victim == FLASH_UNMAPPED || flash->valid[b] < flash->valid[victim])
+                victim = b;
+        }
+        if (victim == FLASH_UNMAPPED || flash->valid[victim] == flash->pages_per_block)
+            break;
+
+        base  = victim * flash->pages_per_block;
+        moved = 0;
+        for (unsigned int p = 0; p < flash->pages_per_block; p++) {
+            unsigned int lpn = flash->p2l[base + p];
+            if (lpn == FLASH_UNMAPPED)
+                continue;
+            flash_invalidate(flash, lpn);
+            flash_program(flash, lpn);
+            moved++;
+        }
+        flash->valid[victim]          = FLASH_ERASED;
+        flash->free[flash->nr_free++] = victim;
+        us += moved * (FLASH_READ_US + FLASH_PROG_US) + FLASH_ERASE_US;
+        STAT_ADD(disk->stats->flash_nand_pages, moved);
+        STAT_ADD(disk->stats->flash_gc_pages, moved);
+        STAT_ADD(disk->stats->flash_erase_cnt, 1);
+    }
+    return us;
+}
+/**
+ * @brief 把lpn写到活动块的下一页，活动块写满时换一个已擦除的块
+ */
+static void flash_program(struct ddriver_flash *flash, unsigned int lpn) {
+    unsigned int ppn;
+
+    if (flash->wp == flash->pages_per_block) {
+        flash->active = flash->free[--flash->nr_free];
+        flash->valid[flash->active] = 0;
+        flash->wp = 0;
+    }
+    ppn = flash->active * flash->pages_per_block + flash->wp++;
+    flash->l2p[lpn] = ppn;
+    flash->p2l[ppn] = lpn;
+    flash->valid[flash->active]++;
+}
+/**
+ * @brief 按当前几何参数与disk->flash_*建立FTL，调用者需持有设备锁
+ *
+ * @return int
+ */
+int flash_init(struct ddriver *disk) {
+    struct ddriver_flash *flash;
+    unsigned int ppb, lblocks, pblocks;
+
+    if (disk->flash_page <= 0 || (disk->flash_page & (disk->flash_page - 1)) != 0 ||
+        disk->flash_block < disk->flash_page || disk->flash_block % disk->flash_page != 0 ||
+        disk->flash_op < 0) {
+        user_panic("flash page %ld should be a power of 2, erase block %ld a multiple of it",
+                   disk->flash_page, disk->flash_block);
+        return -EINVAL;
+    }
+    ppb     = disk->flash_block / disk->flash_page;
+    lblocks = (disk->layout_size + disk->flash_block - 1) / disk->flash_block;
+    pblocks = lblocks + (unsigned long long)lblocks * disk->flash_op / 100 + FLASH_GC_RESERVE;
+    if (pblocks < lblocks + FLASH_GC_RESERVE + 1)
+        pblocks = lblocks + FLASH_GC_RESERVE + 1;     /* GC always finds a victim */
+
+    flash = (struct ddriver_flash *)calloc(1, sizeof(struct ddriver_flash));
+    if (flash == NULL)
+        return -ENOMEM;
+    flash->page_size       = disk->flash_page;
+    flash->pages_per_block = ppb;
+    flash->nr_lpages       = (disk->layout_size + disk->flash_page - 1) / disk->flash_page;
+    flash->nr_blocks       = pblocks;
+    flash->l2p   = (unsigned int *)malloc(sizeof(unsigned int) * flash->nr_lpages);
+    flash->p2l   = (unsigned int *)malloc(sizeof(unsigned int) * pblocks * ppb);
+    flash->valid = (unsigned int *)malloc(sizeof(unsigned int) * pblocks);
+    flash->free  = (unsigned int *)malloc(sizeof(unsigned int) * pblocks);
+    if (flash->l2p == NULL || flash->p2l == NULL || flash->valid == NULL || flash->free == NULL) {
+        disk->flash = flash;
+        flash_destroy(disk);
+        return -ENOMEM;
+    }
+    disk->flash = flash;
+    flash_reset(disk);
+    return 0;
+}
+/**
+ * @brief 释放FTL，调用者需持有设备锁
+ */
+void flash_destroy(struct ddriver *disk) {
+    struct ddriver_flash *flash = disk->flash;
+
+    if (flash == NULL)
+        return;
+    free(flash->l2p);
+    free(flash->p2l);
+    free(flash->valid);
+    free(flash->free);
+    free(flash);
+    disk->flash = NULL;
+}
+/**
+ * @brief 整个设备回到全部擦除、没有映射的状态，调用者需持有设备锁
+ */
+void flash_reset(struct ddriver *disk) {
+    struct ddriver_flash *flash = disk->flash;
+
+    if (flash == NULL)
+        return;
+    memset(flash->l2p, 0xff, sizeof(unsigned int) * flash->nr_lpages);
+    memset(flash->p2l, 0xff, sizeof(unsigned int) * flash->nr_blocks * flash->pages_per_block);
+    flash->nr_free = 0;
+    for (unsigned int b = flash->nr_blocks; b-- > 0;) {
+        flash->valid[b] = FLASH_ERASED;
+        flash->free[flash->nr_free++] = b;
+    }
+    flash->wp = flash->pages_per_block;               /* First write takes block 0 */
+}
+/**
+ * @brief 按闪存模型计一次请求的延迟并更新映射，调用者需持有设备锁
+ *
+ * @param op
+ * @param offset
+ * @param size
+ */
+void flash_request(struct ddriver *disk, enum ddriver_op op, off_t offset, size_t size) {
+    struct ddriver_flash *flash = disk->flash;
+    unsigned int first = offset / flash->page_size;
+    unsigned int last  = (offset + size - 1) / flash->page_size;
+    long us = 0;
+
+    if (op == DDRIVER_OP_READ) {
+        emulate_delay(disk, (long)(last - first + 1) * FLASH_READ_US);
+        return;
+    }
+    for (unsigned int lpn = first; lpn <= last; lpn++) {
+        if (flash->l2p[lpn] != FLASH_UNMAPPED &&      /* Partial page: read-modify-write */
+            ((lpn == first && offset % flash->page_size != 0) ||
+             (lpn == last && (offset + size) % flash->page_size != 0)))
+            us += FLASH_READ_US;
+        flash_invalidate(flash, lpn);
+        if (flash->wp == flash->pages_per_block && flash->nr_free <= FLASH_GC_RESERVE)
+            us += flash_gc(disk, flash);
+        flash_program(flash, lpn);
+        us += FLASH_PROG_US;
+    }
+    STAT_ADD(disk->stats->flash_host_pages, last - first + 1);
+    STAT_ADD(disk->stats->flash_nand_pages, last - first + 1);
+    emulate_delay(disk, us);
+}
+/**
+ * @brief 取消[offset, offset + size)内整页的映射，调用者需持有设备锁
+ *
+ * @param offset
+ * @param size
+ */
+void flash_trim(struct ddriver *disk, off_t offset, off_t size) {
+    struct ddriver_flash *flash = disk->flash;
+    off_t first, last;
+
+    if (flash == NULL)
+        return;
+    first = (offset + flash->page_size - 1) / flash->page_size;
+    last  = (offset + size) / flash->page_size;
+    for (off_t lpn = first; lpn < last; lpn++) {
+        flash_invalidate(flash, lpn);
+    }
+}
@@ -0,0 +1,111 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pwd.h>
+#include "include/ddriver.h"
+/******************************************************************************
+* SECTION: ddriver-image, dumps or erases a user ddriver device
+*
+* Both go through the driver instead of the image file, so they see the
+* configured geometry and work on every backend: a thin image is dumped as
+* the disk it presents and erased back to an empty image with its header,
+* stripes are read across all their images, and the integrity table is
+* reset together with the blocks. ddriver.sh -d / -r use it for the user
+* ddriver.
+*******************************************************************************/
+#define IMAGE_CHUNK_SZ          (1 << 20)             /* Bytes per read of a dump */
+
+static void usage(const char *prog) {
+    printf("用法: %s dump <文件> [设备]\n", prog);
+    printf("      %s erase [设备]\n", prog);
+    printf("  dump   把设备的全部内容按设备呈现的样子导出到文件\n");
+    printf("  erase  擦除设备，之后读出全为0\n");
+    printf("  设备   相对路径基于$HOME(缺省: ~/ddriver)\n");
+}
+
+static int open_device(const char *name) {
+    char path[256];
+
+    if (name == NULL)
+        name = "ddriver";
+    if (name[0] == '/')
+        snprintf(path, sizeof(path), "%s", name);
+    else
+        snprintf(path, sizeof(path), "%s/%s", getpwuid(getuid())->pw_dir, name);
+    return ddriver_open(path);
+}
+
+static int dump(int fd, const char *out) {
+    struct ddriver_geometry geo;
+    unsigned long long offset;
+    size_t chunk;
+    char  *buf;
+    int    ofd, ret = 0;
+
+    if ((ret = ddriver_ioctl(fd, IOC_REQ_DEVICE_GEOMETRY, &geo)) < 0)
+        return ret;
+    chunk = IMAGE_CHUNK_SZ - IMAGE_CHUNK_SZ % geo.iounit_size;
+    if (chunk == 0)
+        chunk = geo.iounit_size;
+    buf = (char *)malloc(chunk);
+    ofd = open(out, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+    if (buf == NULL || ofd < 0) {
+        ret = buf == NULL ? -ENOMEM : -errno;
+        fprintf(stderr, "can't dump to %s: %s\n", out, strerror(-ret));
+        free(buf);
+        if (ofd >= 0)
+            close(ofd);
+        return ret;
+    }
+    for (offset = 0; offset < geo.layout_size; offset += chunk) {
+        if (chunk > geo.layout_size - offset)
+            chunk = geo.layout_size - offset;
+        ret = ddriver_pread(fd, buf, chunk, offset);
+        if (ret >= 0 && write(ofd, buf, chunk) != (ssize_t)chunk)
+            ret = -errno;
+        if (ret < 0) {
+            fprintf(stderr, "dump failed at %llu: %s\n", offset, strerror(-ret));
+            break;
+        }
+    }
+    free(buf);
+    if (close(ofd) < 0 && ret >= 0)
+        ret = -errno;
+    if (ret >= 0)
+        printf("%llu bytes, block size %u\n", geo.layout_size, geo.iounit_size);
+    return ret < 0 ? ret : 0;
+}
+
+static int erase(int fd) {
+    int ret = ddriver_ioctl(fd, IOC_REQ_DEVICE_RESET, NULL);
+    if (ret == 0)
+        ret = ddriver_ioctl(fd, IOC_REQ_DEVICE_FLUSH, NULL);
+    if (ret < 0)
+        fprintf(stderr, "erase failed: %s\n", strerror(-ret));
+    return ret;
+}
+
+int main(int argc, char **argv) {
+    int fd, ret;
+
+    if (argc >= 3 && argc <= 4 && strcmp(argv[1], "dump") == 0) {
+        fd  = open_device(argc == 4 ? argv[3] : NULL);
+        ret = fd < 0 ? fd : dump(fd, argv[2]);
+    }
+    else if (argc >= 2 && argc <= 3 && strcmp(argv[1], "erase") == 0) {
+        fd  = open_device(argc == 3 ? argv[2] : NULL);
+        ret = fd < 0 ? fd : erase(fd);
+    }
+    else {
+        usage(argv[0]);
+        return argc == 2 && strcmp(argv[1], "-h") == 0 ? 0 : 1;
+    }
+    if (fd < 0)
+        fprintf(stderr, "can't open device: %s\n", strerror(-fd));
+    else
+        ddriver_close(fd);
+    return ret < 0 ? 1 : 0;
+}
@@ -0,0 +1,505 @@
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+#include "ddriver_priv.h"
+/******************************************************************************
+* SECTION: Block integrity metadata (integrity = on in ddriver.conf)
+*
+* Every device block has a CRC32C in a side table <device>.crc, mapped
+* shared: a header followed by one 32-bit checksum per block. The checksum
+* of a block is updated where its data reaches the backend (do_request,
+* including the in-place requests of mapped blocks) and verified where it
+* comes back, so a block that changed behind the driver's back (bit rot, a
+* stray write to the image, a torn copy) fails its read with -EIO and counts
+* in integrity_errors, without a scrub pass over the image. Reads served by
+* the block cache were verified when the line was filled.
+*
+* Discarded and reset blocks read as 0 and take the checksum of a zero
+* block. Anything else that changes the image wholesale (rollback, a new
+* geometry, a table that is missing, foreign or was left open by a process
+* that died, an image that was rewritten or replaced while the device was
+* closed) rebuilds the table from the image, which trusts its current
+* contents. The last case is told by the inode, size and mtime of the image
+* that a clean close records after the backend is closed, compared with the
+* ones taken before the backend opens the image again (thin writes its
+* header at open). integrity = off deletes a leftover table, which would be stale
+* after the first write.
+*
+* CRC32C (Castagnoli) uses the SSE4.2 crc32 instruction when the CPU has
+* it, otherwise slicing-by-8 tables; integrity = slice8 forces the tables.
+* The instruction has a latency of three cycles but issues every cycle, so
+* three blocks that are contiguous in one buffer are checksummed at once.
+* The time spent checksumming is counted in integrity_ns so its cost can be
+* told apart from the rest of a benchmark run.
+*******************************************************************************/
+#define INTEGRITY_MAGIC         0x63726364            /* "dcrc" */
+#define INTEGRITY_VERSION       2
+#define INTEGRITY_HDR_SZ        64                    /* Checksums start here */
+#define INTEGRITY_BUILD_SZ      (1 << 20)             /* Read size of a rebuild */
+#define INTEGRITY_BATCH         64                    /* Blocks verified at once */
+#define CRC32C_POLY             0x82f63b78            /* Reflected Castagnoli */
+
+struct integrity_header
+{
+    unsigned int       magic;
+    unsigned int       version;
+    unsigned int       iounit_size;
+    unsigned int       clean;                         /* Closed since the last change */
+    unsigned long long layout_size;
+    unsigned long long image_ino;                     /* Image as left by the clean close */
+    unsigned long long image_size;
+    unsigned long long image_mtime_ns;
+};
+
+struct ddriver_integrity
+{
+    int                      fd;
+    struct integrity_header *hdr;                     /* Mapped table */
+    unsigned int            *crc;                     /* One per block, after the header */
+    size_t                   map_size;
+    unsigned int             zero_crc;                /* Of a block of zeros */
+    unsigned int           (*update)(unsigned int crc, const void *buf, size_t len);
+    void                   (*blocks)(const char *buf, size_t size, long nr, unsigned int *out);
+    const char              *impl;
+};
+
+struct iov_cursor
+{
+    const struct iovec *iov;
+    int                 seg;
+    size_t              off;
+};
+
+static unsigned int    crc_table[8][256];
+static pthread_once_t  crc_once = PTHREAD_ONCE_INIT;
+
+static void crc_init_tables(void) {
+    unsigned int crc;
+
+    for (int i = 0; i < 256; i++) {
+        crc = i;
+        for (int k = 0; k < 8; k++) {
+            crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        }
+        crc_table[0][i] = crc;
+    }
+    for (int i = 0; i < 256; i++) {
+        for (int s = 1; s < 8; s++) {
+            crc_table[s][i] = (crc_table[s - 1][i] >> 8) ^ crc_table[0][crc_table[s - 1][i] & 0xff];
+        }
+    }
+}
+/**
+ * @brief slicing-by-8：每次查8张表处理8字节
+ *
+ * @param crc 未取反的中间值
+ * @param buf
+ * @param len
+ * @return unsigned int
+ */
+static unsigned int crc_slice8(unsigned int crc, const void *buf, size_t len) {
+    const unsigned char *p = (const unsigned char *)buf;
+    unsigned long long word;
+    unsigned int lo, hi;
+
+    while (len > 0 && ((unsigned long)p & 7) != 0) {
+        crc = crc_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+        len--;
+    }
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    for (; len >= 8; len -= 8, p += 8) {
+        memcpy(&word, p, 8);
+        lo  = crc ^ (unsigned int)word;
+        hi  = (unsigned int)(word >> 32);
+        crc = crc_table[7][lo & 0xff] ^ crc_table[6][(lo >> 8) & 0xff] ^
+              crc_table[5][(lo >> 16) & 0xff] ^ crc_table[4][lo >> 24] ^
+              crc_table[3][hi & 0xff] ^ crc_table[2][(hi >> 8) & 0xff] ^
+              crc_table[1][(hi >> 16) & 0xff] ^ crc_table[0][hi >> 24];
+    }
+#else
+    (void)word; (void)lo; (void)hi;
+#endif
+    while (len-- > 0) {
+        crc = crc_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+/**
+ * @brief 连续nr块各自的校验和
+ *
+ * @param buf
+ * @param size 块大小
+ * @param nr
+ * @param out
+ */
+static void crc_slice8_blocks(const char *buf, size_t size, long nr, unsigned int *out) {
+    for (long i = 0; i < nr; i++) {
+        out[i] = ~crc_slice8(~0U, buf + i * size, size);
+    }
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static unsigned int crc_sse42(unsigned int crc, const void *buf, size_t len) {
+    const unsigned char *p = (const unsigned char *)buf;
+    unsigned long long c = crc, word;
+
+    for (; len >= 8; len -= 8, p += 8) {
+        memcpy(&word, p, 8);
+        c = _mm_crc32_u64(c, word);
+    }
+    crc = (unsigned int)c;
+    while (len-- > 0) {
+        crc = _mm_crc32_u8(crc, *p++);
+    }
+    return crc;
+}
+/**
+ * @brief 同crc_slice8_blocks，三块交错计算以填满crc32指令的流水线；
+ *        块大小为8的倍数
+ */
+__attribute__((target("sse4.2")))
+static void crc_sse42_blocks(const char *buf, size_t size, long nr, unsigned int *out) {
+    unsigned long long a, b, c, word;
+
+    for (; nr >= 3; nr -= 3, buf += 3 * size, out += 3) {
+        a = b = c = ~0U;
+        for (size_t i = 0; i < size; i += 8) {
+            memcpy(&word, buf + i, 8);
+            a = _mm_crc32_u64(a, word);
+            memcpy(&word, buf + size + i, 8);
+            b = _mm_crc32_u64(b, word);
+            memcpy(&word, buf + 2 * size + i, 8);
+            c = _mm_crc32_u64(c, word);
+        }
+        out[0] = ~(unsigned int)a;
+        out[1] = ~(unsigned int)b;
+        out[2] = ~(unsigned int)c;
+    }
+    for (; nr > 0; nr--, buf += size, out++) {
+        *out = ~crc_sse42(~0U, buf, size);
+    }
+}
+#endif
+
+static unsigned long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+/**
+ * @brief 从游标处取出一块数据的校验和，可跨越iov段
+ *
+ * @param ig
+ * @param cur
+ * @param size 块大小
+ * @return unsigned int
+ */
+static unsigned int block_crc(const struct ddriver_integrity *ig, struct iov_cursor *cur,
+                              size_t size) {
+    unsigned int crc = ~0U;
+    size_t len;
+
+    while (size > 0) {
+        len = cur->iov[cur->seg].iov_len - cur->off;
+        if (len > size)
+            len = size;
+        crc = ig->update(crc, (const char *)cur->iov[cur->seg].iov_base + cur->off, len);
+        cur->off += len;
+        size     -= len;
+        if (cur->off == cur->iov[cur->seg].iov_len) {
+            cur->seg++;
+            cur->off = 0;
+        }
+    }
+    return ~crc;
+}
+/**
+ * @brief 从游标处取出连续nr块的校验和，整块落在同一iov段中的成批计算
+ *
+ * @param ig
+ * @param cur
+ * @param size 块大小
+ * @param nr
+ * @param out
+ */
+static void iov_crcs(const struct ddriver_integrity *ig, struct iov_cursor *cur, size_t size,
+                     long nr, unsigned int *out) {
+    long whole;
+
+    while (nr > 0) {
+        whole = (cur->iov[cur->seg].iov_len - cur->off) / size;
+        if (whole == 0) {                             /* Block straddles segments */
+            *out++ = block_crc(ig, cur, size);
+            nr--;
+            continue;
+        }
+        if (whole > nr)
+            whole = nr;
+        ig->blocks((const char *)cur->iov[cur->seg].iov_base + cur->off, size, whole, out);
+        out      += whole;
+        nr       -= whole;
+        cur->off += whole * size;
+        if (cur->off == cur->iov[cur->seg].iov_len) {
+            cur->seg++;
+            cur->off = 0;
+        }
+    }
+}
+/**
+ * @brief 记录镜像文件的inode、大小与修改时间；不是单个文件(如stripe)时为0。
+ *        打开后端前记录一次，供integrity_open与上次正常关闭时的记录比较
+ *
+ * @param disk
+ * @param stamp 依次为inode、大小、修改时间(ns)
+ */
+void integrity_stamp(const struct ddriver *disk, unsigned long long stamp[3]) {
+    struct stat st;
+
+    if (stat(disk->path, &st) < 0 || !S_ISREG(st.st_mode)) {
+        memset(stamp, 0, 3 * sizeof(unsigned long long));
+        return;
+    }
+    stamp[0] = st.st_ino;
+    stamp[1] = st.st_size;
+    stamp[2] = (unsigned long long)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+}
+/**
+ * @brief 从镜像当前内容重建整张校验表，不计延迟与统计，调用者需持有设备锁
+ *
+ * @param disk
+ * @return int
+ */
+int integrity_rebuild(struct ddriver *disk) {
+    struct ddriver_integrity *ig = disk->integrity;
+    struct iovec iov;
+    void  *buf;
+    off_t  offset, len;
+    int    ret = 0;
+
+    if (ig == NULL)
+        return 0;
+    if (posix_memalign(&buf, 4096, INTEGRITY_BUILD_SZ) != 0)
+        return -ENOMEM;
+    for (offset = 0; offset < disk->layout_size; offset += len) {
+        len = disk->layout_size - offset < INTEGRITY_BUILD_SZ ?
+              disk->layout_size - offset : INTEGRITY_BUILD_SZ;
+        iov.iov_base = buf;
+        iov.iov_len  = len;
+        ret = disk->backend->readv(disk, &iov, 1, offset);
+        if (ret < 0)
+            break;
+        ig->blocks((const char *)buf, disk->iounit_size, len / disk->iounit_size,
+                   &ig->crc[offset / disk->iounit_size]);
+        ret = 0;
+    }
+    free(buf);
+    if (ret < 0) {
+        user_alert("can't rebuild the checksums of [%s]: %d", disk->path, ret);
+        return ret;
+    }
+    ig->hdr->magic       = INTEGRITY_MAGIC;
+    ig->hdr->version     = INTEGRITY_VERSION;
+    ig->hdr->iounit_size = disk->iounit_size;
+    ig->hdr->layout_size = disk->layout_size;
+    return 0;
+}
+/**
+ * @brief 打开或建立设备的校验表；mode为off时删除遗留的表，调用者需持有设备锁
+ *
+ * @param disk
+ * @param mode DDRIVER_INTEGRITY_*
+ * @return int
+ */
+int integrity_open(struct ddriver *disk, int mode) {
+    struct ddriver_integrity *ig;
+    char   table_path[256];
+    char   zero[512] = {0};
+    struct stat st;
+    size_t size = INTEGRITY_HDR_SZ +
+                  (size_t)(disk->layout_size / disk->iounit_size) * sizeof(unsigned int);
+    int    ret, reuse;
+
+    snprintf(table_path, sizeof(table_path), "%s.crc", disk->path);
+    if (mode == DDRIVER_INTEGRITY_OFF) {
+        if (unlink(table_path) == 0)
+            user_alert("integrity is off, dropped the checksums of [%s]", disk->path);
+        return 0;
+    }
+
+    pthread_once(&crc_once, crc_init_tables);
+    ig = (struct ddriver_integrity *)calloc(1, sizeof(struct ddriver_integrity));
+    if (ig == NULL)
+        return -ENOMEM;
+    ig->update = crc_slice8;
+    ig->blocks = crc_slice8_blocks;
+    ig->impl   = "slicing-by-8";
+#if defined(__x86_64__)
+    if (mode == DDRIVER_INTEGRITY_ON && __builtin_cpu_supports("sse4.2")) {
+        ig->update = crc_sse42;
+        ig->blocks = crc_sse42_blocks;
+        ig->impl   = "sse4.2";
+    }
+#endif
+    ig->zero_crc = ~0U;
+    for (int i = 0; i < disk->iounit_size / sizeof(zero); i++) {
+        ig->zero_crc = ig->update(ig->zero_crc, zero, sizeof(zero));
+    }
+    ig->zero_crc = ~ig->zero_crc;
+
+    ig->fd = open(table_path, O_RDWR | O_CREAT, 0644);
+    if (ig->fd < 0 || fstat(ig->fd, &st) < 0) {
+        ret = -errno;
+        goto err;
+    }
+    reuse = st.st_size == size;
+    if (!reuse && ftruncate(ig->fd, size) < 0) {
+        ret = -errno;
+        goto err;
+    }
+    ig->hdr = (struct integrity_header *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                                              ig->fd, 0);
+    if (ig->hdr == MAP_FAILED) {
+        ret = -errno;
+        goto err;
+    }
+    ig->map_size = size;
+    ig->crc      = (unsigned int *)((char *)ig->hdr + INTEGRITY_HDR_SZ);
+    disk->integrity = ig;
+
+    reuse = reuse && ig->hdr->magic == INTEGRITY_MAGIC &&
+            ig->hdr->version == INTEGRITY_VERSION &&
+            ig->hdr->iounit_size == disk->iounit_size &&
+            ig->hdr->layout_size == disk->layout_size;
+    if (reuse && !ig->hdr->clean)
+        user_alert("[%s] was not closed cleanly, rebuild its checksums", disk->path);
+    if (reuse && ig->hdr->clean) {
+        if (disk->image_stamp[0] != ig->hdr->image_ino ||
+            disk->image_stamp[1] != ig->hdr->image_size ||
+            disk->image_stamp[2] != ig->hdr->image_mtime_ns) {
+            user_alert("[%s] changed while closed, rebuild its checksums", disk->path);
+            ig->hdr->clean = 0;
+        }
+    }
+    if (!reuse || !ig->hdr->clean) {
+        ret = integrity_rebuild(disk);
+        if (ret < 0) {
+            disk->integrity = NULL;
+            munmap(ig->hdr, size);
+            goto err;
+        }
+    }
+    ig->hdr->clean = 0;
+    user_info("integrity of [%s]: crc32c (%s) in %s", disk->path, ig->impl, table_path);
+    return 0;
+err:
+    if (ig->fd >= 0)
+        close(ig->fd);
+    free(ig);
+    return ret;
+}
+/**
+ * @brief 落盘并关闭校验表，标记为正常关闭，调用者需持有设备锁，且后端已关闭
+ *
+ * @param disk
+ */
+void integrity_close(struct ddriver *disk) {
+    struct ddriver_integrity *ig = disk->integrity;
+    unsigned long long stamp[3];
+
+    if (ig == NULL)
+        return;
+    msync(ig->hdr, ig->map_size, MS_SYNC);
+    integrity_stamp(disk, stamp);
+    ig->hdr->image_ino      = stamp[0];
+    ig->hdr->image_size     = stamp[1];
+    ig->hdr->image_mtime_ns = stamp[2];
+    ig->hdr->clean = 1;
+    msync(ig->hdr, INTEGRITY_HDR_SZ, MS_SYNC);
+    munmap(ig->hdr, ig->map_size);
+    close(ig->fd);
+    free(ig);
+    disk->integrity = NULL;
+}
+/**
+ * @brief 刷回校验表，调用者需持有设备锁
+ *
+ * @param disk
+ * @return int
+ */
+int integrity_flush(struct ddriver *disk) {
+    struct ddriver_integrity *ig = disk->integrity;
+
+    if (ig == NULL)
+        return 0;
+    return msync(ig->hdr, ig->map_size, MS_SYNC) < 0 ? -errno : 0;
+}
+/**
+ * @brief 写后更新、读后校验[offset, offset + size)各块的校验和，调用者需持有设备锁
+ *
+ * @param op
+ * @param iov NULL表示就地请求，数据在后端的映射中
+ * @param iovcnt
+ * @param offset
+ * @param size
+ * @return int 0，读到校验不符的块时-EIO
+ */
+int integrity_request(struct ddriver *disk, enum ddriver_op op, const struct iovec *iov,
+                      int iovcnt, off_t offset, size_t size) {
+    struct ddriver_integrity *ig = disk->integrity;
+    unsigned long long start = now_ns();
+    struct iovec mapped;
+    struct iov_cursor cur;
+    off_t  block = offset / disk->iounit_size;
+    long   nr = size / disk->iounit_size, batch, bad = 0;
+    unsigned int crc[INTEGRITY_BATCH];
+
+    if (iov == NULL) {
+        mapped.iov_base = disk->backend->map(disk, offset);
+        mapped.iov_len  = size;
+        iov = &mapped;
+    }
+    cur.iov = iov;
+    cur.seg = 0;
+    cur.off = 0;
+    if (op == DDRIVER_OP_WRITE) {
+        iov_crcs(ig, &cur, disk->iounit_size, nr, &ig->crc[block]);
+    }
+    for (; op == DDRIVER_OP_READ && nr > 0; nr -= batch, block += batch) {
+        batch = nr < INTEGRITY_BATCH ? nr : INTEGRITY_BATCH;
+        iov_crcs(ig, &cur, disk->iounit_size, batch, crc);
+        for (long i = 0; i < batch; i++) {
+            if (crc[i] == ig->crc[block + i])
+                continue;
+            user_alert("checksum mismatch in block %ld of [%s]: %08x, expect %08x",
+                       block + i, disk->path, crc[i], ig->crc[block + i]);
+            bad++;
+        }
+    }
+    STAT_ADD(disk->stats->integrity_bytes, size);
+    STAT_ADD(disk->stats->integrity_ns, now_ns() - start);
+    if (bad > 0) {
+        STAT_ADD(disk->stats->integrity_errors, bad);
+        return -EIO;
+    }
+    return 0;
+}
+/**
+ * @brief 丢弃后的块读出为0，记为全零块的校验和，调用者需持有设备锁
+ *
+ * @param offset
+ * @param size
+ */
+void integrity_discard(struct ddriver *disk, off_t offset, off_t size) {
+    struct ddriver_integrity *ig = disk->integrity;
+
+    if (ig == NULL)
+        return;
+    for (off_t b = offset / disk->iounit_size; b < (offset + size) / disk->iounit_size; b++) {
+        ig->crc[b] = ig->zero_crc;
+    }
+}
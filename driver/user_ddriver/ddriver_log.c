@@ -0,0 +1,251 @@
+#include <stdarg.h>
+#include <time.h>
+#include "ddriver_priv.h"
+/******************************************************************************
+* SECTION: Asynchronous logging behind user_info/user_alert
+*
+* A message is formatted on the calling thread into that thread's own ring
+* (single producer, the drainer is the only consumer) and the call returns;
+* the drainer thread writes all rings to stdout and ~/ddriver_log in global
+* sequence order, with the same text the synchronous macros used to print.
+* Producers share nothing but the sequence counter. A full ring makes its
+* producer wake the drainer and wait for it rather than lose a message; only
+* this slow path takes a lock. A message longer than an entry's slot is
+* formatted into a heap buffer the entry points to, which the drainer frees.
+*
+* Levels above DDRIVER_LOG_LEVEL are compiled out, levels above the runtime
+* log_level cost one compare. While no device is open there is no drainer
+* and messages go straight to stdout.
+*******************************************************************************/
+#define LOG_RING_ENTRIES        128
+#define LOG_MSG_SZ              240
+#define LOG_BATCH               1024
+#define LOG_DRAIN_US            10000
+
+struct log_entry
+{
+    unsigned long long seq;
+    int                level;
+    char              *spill;                         /* Longer than msg, or NULL */
+    char               msg[LOG_MSG_SZ];
+};
+
+struct log_ring
+{
+    struct log_ring  *next;
+    int               owned;                          /* Held by a live thread */
+    unsigned int      head;                           /* Written by the owner */
+    unsigned int      tail;                           /* Written by the drainer */
+    unsigned int      snap;                           /* Drainer only: entries taken */
+    struct log_entry  entries[LOG_RING_ENTRIES];
+};
+
+int ddriver_log_level = LOG_INFO;
+
+static struct log_ring   *log_rings;                  /* Never shrinks, rings are reused */
+static pthread_key_t      log_key;
+static pthread_once_t     log_once = PTHREAD_ONCE_INIT;
+static unsigned long long log_seq;
+static int                log_running;
+static pthread_t          log_drainer;
+static pthread_mutex_t    log_lock     = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t     log_wake     = PTHREAD_COND_INITIALIZER;  /* Drainer sleeps here */
+static pthread_cond_t     log_space    = PTHREAD_COND_INITIALIZER;  /* Full producers sleep here */
+static int                log_waiters;
+
+static void log_release_ring(void *arg) {
+    __atomic_store_n(&((struct log_ring *)arg)->owned, 0, __ATOMIC_RELEASE);
+}
+
+static void log_init_key(void) {
+    pthread_key_create(&log_key, log_release_ring);
+}
+
+static struct log_ring *log_get_ring(void) {
+    struct log_ring *ring = (struct log_ring *)pthread_getspecific(log_key);
+    int free_ring;
+
+    if (ring != NULL)
+        return ring;
+    for (ring = __atomic_load_n(&log_rings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+        free_ring = 0;
+        if (__atomic_compare_exchange_n(&ring->owned, &free_ring, 1, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            break;
+    }
+    if (ring == NULL) {
+        ring = (struct log_ring *)calloc(1, sizeof(struct log_ring));
+        if (ring == NULL)
+            return NULL;
+        ring->owned = 1;
+        ring->next  = __atomic_load_n(&log_rings, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&log_rings, &ring->next, ring, 1,
+                                            __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            ;
+    }
+    pthread_setspecific(log_key, ring);
+    return ring;
+}
+
+static void log_write(int level, const char *msg) {
+    printf("%s" DEVICE_NAME " %s\n", level == LOG_ALERT ? USER_ALERT : USER_INFO, msg);
+    if (debugf != NULL)
+        fprintf(debugf, USER_PANIC " %s\n", msg);
+}
+
+/**
+ * @brief 格式化消息到buf，放不下时改为格式化到新分配的缓冲区，分配失败时截断
+ *
+ * @return char* buf或需由调用者释放的缓冲区
+ */
+static char *log_format(char *buf, size_t size, const char *fmt, va_list ap) {
+    va_list aq;
+    char   *big;
+    int     len;
+
+    va_copy(aq, ap);
+    len = vsnprintf(buf, size, fmt, aq);
+    va_end(aq);
+    if (len < (int)size || (big = (char *)malloc(len + 1)) == NULL)
+        return buf;
+    vsnprintf(big, len + 1, fmt, ap);
+    return big;
+}
+
+static int cmp_seq(const void *a, const void *b) {
+    const struct log_entry *ea = *(struct log_entry * const *)a;
+    const struct log_entry *eb = *(struct log_entry * const *)b;
+    return ea->seq < eb->seq ? -1 : ea->seq > eb->seq;
+}
+/**
+ * @brief 取出所有环中已发布的消息，按序号写出
+ *
+ * @return int 写出的条数
+ */
+static int log_drain(void) {
+    static struct log_entry *batch[LOG_BATCH];
+    struct log_ring *ring;
+    unsigned int head;
+    int nr = 0;
+
+    for (ring = __atomic_load_n(&log_rings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+        head       = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        ring->snap = 0;
+        while (ring->tail + ring->snap != head && nr < LOG_BATCH) {
+            batch[nr++] = &ring->entries[(ring->tail + ring->snap) % LOG_RING_ENTRIES];
+            ring->snap++;
+        }
+    }
+    if (nr == 0)
+        return 0;
+
+    qsort(batch, nr, sizeof(struct log_entry *), cmp_seq);
+    for (int i = 0; i < nr; i++) {
+        log_write(batch[i]->level, batch[i]->spill != NULL ? batch[i]->spill : batch[i]->msg);
+        free(batch[i]->spill);
+    }
+    fflush(stdout);
+    fflush(debugf);
+    for (ring = __atomic_load_n(&log_rings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+        __atomic_store_n(&ring->tail, ring->tail + ring->snap, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_lock(&log_lock);
+    if (log_waiters > 0)
+        pthread_cond_broadcast(&log_space);
+    pthread_mutex_unlock(&log_lock);
+    return nr;
+}
+
+static void *log_drainer_fn(void *arg) {
+    struct timespec ts;
+
+    while (__atomic_load_n(&log_running, __ATOMIC_ACQUIRE)) {
+        if (log_drain() > 0)
+            continue;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += LOG_DRAIN_US * 1000L;
+        ts.tv_sec  += ts.tv_nsec / 1000000000L;
+        ts.tv_nsec %= 1000000000L;
+        pthread_mutex_lock(&log_lock);
+        if (log_waiters == 0)
+            pthread_cond_timedwait(&log_wake, &log_lock, &ts);
+        pthread_mutex_unlock(&log_lock);
+    }
+    while (log_drain() > 0)
+        ;
+    return NULL;
+}
+/**
+ * @brief 启动写出线程，之后的消息异步写入debugf，调用者需持有设备表锁
+ *
+ * @return int
+ */
+int log_start(void) {
+    pthread_once(&log_once, log_init_key);
+    __atomic_store_n(&log_running, 1, __ATOMIC_RELEASE);
+    if (pthread_create(&log_drainer, NULL, log_drainer_fn, NULL) != 0) {
+        __atomic_store_n(&log_running, 0, __ATOMIC_RELEASE);
+        user_panic("can't start log drainer, log synchronously");
+        return -EAGAIN;
+    }
+    return 0;
+}
+/**
+ * @brief 写出剩余消息并停止写出线程，须在关闭debugf之前调用，调用者需持有设备表锁
+ */
+void log_stop(void) {
+    if (!__atomic_load_n(&log_running, __ATOMIC_ACQUIRE))
+        return;
+    pthread_mutex_lock(&log_lock);
+    __atomic_store_n(&log_running, 0, __ATOMIC_RELEASE);
+    pthread_cond_signal(&log_wake);
+    pthread_mutex_unlock(&log_lock);
+    pthread_join(log_drainer, NULL);
+}
+/**
+ * @brief 记录一条消息，由user_info/user_alert调用
+ *
+ * @param level
+ * @param fmt
+ */
+void log_emit(int level, const char *fmt, ...) {
+    struct log_ring  *ring = NULL;
+    struct log_entry *entry;
+    char    msg[LOG_MSG_SZ], *text;
+    va_list ap;
+
+    if (__atomic_load_n(&log_running, __ATOMIC_ACQUIRE))
+        ring = log_get_ring();
+    if (ring != NULL &&
+        ring->head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == LOG_RING_ENTRIES) {
+        pthread_mutex_lock(&log_lock);                /* Full, wait for the drainer */
+        log_waiters++;
+        pthread_cond_signal(&log_wake);
+        while (ring->head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == LOG_RING_ENTRIES &&
+               __atomic_load_n(&log_running, __ATOMIC_ACQUIRE)) {
+            pthread_cond_wait(&log_space, &log_lock);
+        }
+        log_waiters--;
+        pthread_mutex_unlock(&log_lock);
+        if (ring->head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == LOG_RING_ENTRIES)
+            ring = NULL;                              /* Drainer stopped meanwhile */
+    }
+    if (ring == NULL) {
+        va_start(ap, fmt);
+        text = log_format(msg, sizeof(msg), fmt, ap);
+        va_end(ap);
+        log_write(level, text);
+        if (text != msg)
+            free(text);
+        return;
+    }
+
+    entry        = &ring->entries[ring->head % LOG_RING_ENTRIES];
+    entry->level = level;
+    entry->seq   = __atomic_fetch_add(&log_seq, 1, __ATOMIC_RELAXED);
+    va_start(ap, fmt);
+    text = log_format(entry->msg, sizeof(entry->msg), fmt, ap);
+    va_end(ap);
+    entry->spill = text != entry->msg ? text : NULL;
+    __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,78 @@
+#include <sys/mman.h>
+#include "ddriver_priv.h"
+/******************************************************************************
+* SECTION: mmap backend, the whole image is mapped and block I/O is memcpy
+*******************************************************************************/
+#define MMAP_LAYOUT(disk)       ((char *)(disk)->priv)
+
+static int mmap_open(struct ddriver *disk, const char *path) {
+    void *layout;
+    int fd = ddriver_open_image(path, disk->layout_size);
+    if (fd < 0) {
+        return fd;
+    }
+
+    layout = mmap(NULL, disk->layout_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (layout == MAP_FAILED) {
+        user_panic("can't map device: %s", strerror(errno));
+        close(fd);
+        return -1;
+    }
+    disk->priv = layout;
+    return fd;
+}
+
+static int mmap_close(struct ddriver *disk) {
+    msync(MMAP_LAYOUT(disk), disk->layout_size, MS_SYNC);
+    munmap(MMAP_LAYOUT(disk), disk->layout_size);
+    disk->priv = NULL;
+    return close(disk->ddriver_fd);
+}
+
+static int mmap_readv(struct ddriver *disk, const struct iovec *iov, int iovcnt,
+                      off_t offset) {
+    char *cur = MMAP_LAYOUT(disk) + offset;
+    for (int i = 0; i < iovcnt; i++) {
+        memcpy(iov[i].iov_base, cur, iov[i].iov_len);
+        cur += iov[i].iov_len;
+    }
+    return cur - (MMAP_LAYOUT(disk) + offset);
+}
+
+static int mmap_writev(struct ddriver *disk, const struct iovec *iov, int iovcnt,
+                       off_t offset) {
+    char *cur = MMAP_LAYOUT(disk) + offset;
+    for (int i = 0; i < iovcnt; i++) {
+        memcpy(cur, iov[i].iov_base, iov[i].iov_len);
+        cur += iov[i].iov_len;
+    }
+    return cur - (MMAP_LAYOUT(disk) + offset);
+}
+
+static int mmap_flush(struct ddriver *disk) {
+    return msync(MMAP_LAYOUT(disk), disk->layout_size, MS_SYNC) < 0 ? -errno : 0;
+}
+
+static int mmap_reset(struct ddriver *disk) {
+    return ddriver_zero_image(disk->ddriver_fd, disk->layout_size);   /* Mapping sees zeros */
+}
+
+static int mmap_discard(struct ddriver *disk, off_t offset, off_t size) {
+    return ddriver_punch_hole(disk->ddriver_fd, offset, size);   /* Mapping sees zeros */
+}
+
+static void *mmap_map(struct ddriver *disk, off_t offset) {
+    return MMAP_LAYOUT(disk) + offset;
+}
+
+const struct ddriver_backend ddriver_mmap_backend = {
+    .name    = "mmap",
+    .open    = mmap_open,
+    .close   = mmap_close,
+    .readv   = mmap_readv,
+    .writev  = mmap_writev,
+    .flush   = mmap_flush,
+    .reset   = mmap_reset,
+    .discard = mmap_discard,
+    .map     = mmap_map
+};
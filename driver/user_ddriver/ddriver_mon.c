@@ -0,0 +1,280 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <pwd.h>
+#include <time.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "ddriver_priv.h"
+/******************************************************************************
+* SECTION: ddriver-mon, top-style live view of user ddriver devices
+*
+* Every device a process has open publishes its counters in a struct
+* ddriver_mon page under DDRIVER_MON_DIR (see ddriver_stats.c). The monitor
+* maps the pages read-only and every interval prints per-second rates from
+* the counter deltas, the queue depth averaged over MON_TICKS samples, and
+* percentiles of the wall latency of the requests completed meanwhile. It
+* never takes a lock the driver could wait on, so it can run for the whole
+* of a soak test.
+*******************************************************************************/
+#define MON_MAX_DEVICES         64
+#define MON_TICKS               10                    /* Queue depth samples per interval */
+
+struct mon_device
+{
+    char                 shm_path[256];
+    ino_t                ino;                         /* Detects a re-created page */
+    const struct ddriver_mon *mon;
+    struct ddriver_stats prev;
+    unsigned long long   prev_us;
+    long long            qd_sum;
+    int                  qd_samples;
+    int                  seen;
+};
+
+static struct mon_device devices[MON_MAX_DEVICES];
+static int               nr_devices;
+
+static unsigned long long now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void snapshot(const struct ddriver_mon *mon, struct ddriver_stats *stats) {
+    const unsigned long long *from = &mon->stats.read_cnt;
+    unsigned long long *to = &stats->read_cnt;
+    int words = (sizeof(struct ddriver_stats) - offsetof(struct ddriver_stats, read_cnt)) /
+                sizeof(unsigned long long);
+
+    for (int i = 0; i < words; i++) {
+        to[i] = __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+    }
+}
+
+static void detach(struct mon_device *dev) {
+    munmap((void *)dev->mon, sizeof(struct ddriver_mon));
+    *dev = devices[--nr_devices];
+}
+/**
+ * @brief 映射一个统计页，已映射且未被重建时什么也不做
+ *
+ * @param shm_path
+ * @return int 0成功，否则不是可用的统计页
+ */
+static int attach(const char *shm_path) {
+    struct mon_device *dev = NULL;
+    struct ddriver_mon *mon;
+    struct stat st;
+    int fd;
+
+    if (stat(shm_path, &st) < 0 || st.st_size < sizeof(struct ddriver_mon))
+        return -ENOENT;
+    for (int i = 0; i < nr_devices; i++) {
+        if (strcmp(devices[i].shm_path, shm_path) == 0) {
+            if (devices[i].ino == st.st_ino) {
+                devices[i].seen = 1;
+                return 0;
+            }
+            detach(&devices[i]);                      /* The device was opened again */
+            break;
+        }
+    }
+    if (nr_devices == MON_MAX_DEVICES)
+        return -EMFILE;
+    fd = open(shm_path, O_RDONLY);
+    if (fd < 0)
+        return -errno;
+    mon = mmap(NULL, sizeof(struct ddriver_mon), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mon == MAP_FAILED)
+        return -ENOMEM;
+    if (__atomic_load_n(&mon->magic, __ATOMIC_ACQUIRE) != DDRIVER_MON_MAGIC ||
+        mon->version != DDRIVER_STATS_VERSION) {
+        munmap(mon, sizeof(struct ddriver_mon));
+        return -EINVAL;
+    }
+    dev = &devices[nr_devices++];
+    memset(dev, 0, sizeof(struct mon_device));
+    snprintf(dev->shm_path, sizeof(dev->shm_path), "%s", shm_path);
+    dev->ino     = st.st_ino;
+    dev->mon     = mon;
+    dev->seen    = 1;
+    snapshot(mon, &dev->prev);
+    dev->prev_us = now_us();
+    return 0;
+}
+/**
+ * @brief 重新查找要监控的设备：指定了设备时按名字，否则为DDRIVER_MON_DIR中的全部
+ *
+ * @param names
+ * @param nr_names
+ */
+static void discover(char **names, int nr_names) {
+    char shm_path[256], path[256];
+    struct dirent *ent;
+    DIR *dir;
+
+    for (int i = 0; i < nr_devices; i++) {
+        devices[i].seen = 0;
+    }
+    if (nr_names > 0) {
+        for (int i = 0; i < nr_names; i++) {
+            if (names[i][0] == '/')
+                snprintf(path, sizeof(path), "%s", names[i]);
+            else
+                snprintf(path, sizeof(path), "%s/%s", getpwuid(getuid())->pw_dir, names[i]);
+            if (stats_mon_path(path, shm_path, sizeof(shm_path)) == 0)
+                attach(shm_path);
+        }
+    }
+    else if ((dir = opendir(DDRIVER_MON_DIR)) != NULL) {
+        while ((ent = readdir(dir)) != NULL) {
+            if (strncmp(ent->d_name, DDRIVER_MON_PREFIX ".", strlen(DDRIVER_MON_PREFIX) + 1) != 0)
+                continue;
+            snprintf(shm_path, sizeof(shm_path), DDRIVER_MON_DIR "/%.200s", ent->d_name);
+            attach(shm_path);
+        }
+        closedir(dir);
+    }
+    for (int i = nr_devices - 1; i >= 0; i--) {
+        if (!devices[i].seen)
+            detach(&devices[i]);
+    }
+}
+
+static unsigned long long delta(unsigned long long cur, unsigned long long prev) {
+    return cur >= prev ? cur - prev : cur;            /* Counters were reset */
+}
+/**
+ * @brief 本周期完成的请求的实际延迟的百分位，按对数桶的上界估计
+ *
+ * @return unsigned long long us
+ */
+static unsigned long long percentile(const struct ddriver_stats *cur,
+                                     const struct ddriver_stats *prev, int permille) {
+    unsigned long long cnt[DDRIVER_LAT_BUCKETS], total = 0, seen = 0;
+
+    for (int b = 0; b < DDRIVER_LAT_BUCKETS; b++) {
+        cnt[b] = delta(cur->lat_wall[0][b], prev->lat_wall[0][b]) +
+                 delta(cur->lat_wall[1][b], prev->lat_wall[1][b]);
+        total += cnt[b];
+    }
+    if (total == 0)
+        return 0;
+    for (int b = 0; b < DDRIVER_LAT_BUCKETS; b++) {
+        seen += cnt[b];
+        if (seen * 1000 >= total * permille)
+            return 2ULL << b;
+    }
+    return 2ULL << (DDRIVER_LAT_BUCKETS - 1);
+}
+
+static void report(struct mon_device *dev, unsigned long long now) {
+    const struct ddriver_mon *mon = dev->mon;
+    struct ddriver_stats cur, *prev = &dev->prev;
+    double secs = (now - dev->prev_us) / 1e6;
+    unsigned long long reads, writes, seeks, seq, rand, hit, miss;
+    const char *name = strrchr(mon->path, '/') != NULL ? strrchr(mon->path, '/') + 1 : mon->path;
+
+    if (kill(mon->pid, 0) < 0 && errno == ESRCH) {
+        printf("%-12.12s %7d  (exited)\n", name, mon->pid);
+        return;
+    }
+    snapshot(mon, &cur);
+    reads  = delta(cur.read_cnt, prev->read_cnt);
+    writes = delta(cur.write_cnt, prev->write_cnt);
+    seeks  = delta(cur.seek_cnt, prev->seek_cnt);
+    seq    = delta(cur.seq_cnt, prev->seq_cnt);
+    rand   = delta(cur.rand_cnt, prev->rand_cnt);
+    hit    = delta(cur.cache_hit, prev->cache_hit);
+    miss   = delta(cur.cache_miss, prev->cache_miss);
+    printf("%-12.12s %7d %8.0f %8.0f %8.2f %8.2f %6.2f %8.0f %8.0f %5.0f ",
+           name, mon->pid, reads / secs, writes / secs,
+           delta(cur.read_bytes, prev->read_bytes) / secs / (1 << 20),
+           delta(cur.write_bytes, prev->write_bytes) / secs / (1 << 20),
+           dev->qd_samples > 0 ? (double)dev->qd_sum / dev->qd_samples : 0.0,
+           seeks / secs,
+           seeks > 0 ? delta(cur.seek_dist, prev->seek_dist) / 1024.0 / seeks : 0.0,
+           seq + rand > 0 ? 100.0 * seq / (seq + rand) : 0.0);
+    if (hit + miss > 0)
+        printf("%5.0f ", 100.0 * hit / (hit + miss));
+    else
+        printf("%5s ", "-");
+    printf("%7llu %7llu %6.0f\n", percentile(&cur, prev, 500), percentile(&cur, prev, 990),
+           100.0 * delta(cur.clock_us, prev->clock_us) / (secs * 1e6));
+    dev->prev       = cur;
+    dev->prev_us    = now;
+    dev->qd_sum     = 0;
+    dev->qd_samples = 0;
+}
+
+static void usage(const char *prog) {
+    printf("用法: %s [-i 秒] [-n 次数] [设备 ...]\n", prog);
+    printf("  -i  刷新间隔，可为小数(缺省: 1)\n");
+    printf("  -n  刷新这么多次后退出，逐行输出不清屏(缺省: 一直刷新)\n");
+    printf("  设备  相对路径基于$HOME(缺省: " DDRIVER_MON_DIR "中的所有设备)\n");
+    printf("列: r/s w/s rMB/s wMB/s 读写吞吐，qd 平均队列深度，seek/s 寻道率，seekKB 平均寻道距离，\n"
+           "    seq%% 顺序请求比例，hit%% 缓存命中率，p50/p99 实际延迟(us)，model%% 模型时钟/墙上时钟\n");
+}
+
+int main(int argc, char **argv) {
+    double interval = 1.0;
+    long   count = -1;
+    int    opt, clear;
+
+    while ((opt = getopt(argc, argv, "i:n:h")) != -1) {
+        switch (opt)
+        {
+        case 'i':
+            interval = atof(optarg);
+            break;
+        case 'n':
+            count = atol(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (interval < 0.01 || count == 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    clear = count < 0 && isatty(STDOUT_FILENO);
+
+    discover(argv + optind, argc - optind);
+    for (long round = 0; count < 0 || round < count; round++) {
+        for (int tick = 0; tick < MON_TICKS; tick++) {
+            usleep(interval * 1e6 / MON_TICKS);
+            for (int i = 0; i < nr_devices; i++) {
+                devices[i].qd_sum += __atomic_load_n(&devices[i].mon->inflight, __ATOMIC_RELAXED);
+                devices[i].qd_samples++;
+            }
+        }
+        if (clear)
+            printf("\033[H\033[J");
+        time_t t = time(NULL);
+        char stamp[32];
+        strftime(stamp, sizeof(stamp), "%H:%M:%S", localtime(&t));
+        printf("ddriver-mon %s, %d device(s), every %.2fs\n", stamp, nr_devices, interval);
+        printf("%-12s %7s %8s %8s %8s %8s %6s %8s %8s %5s %5s %7s %7s %6s\n",
+               "DEVICE", "PID", "r/s", "w/s", "rMB/s", "wMB/s", "qd", "seek/s", "seekKB",
+               "seq%", "hit%", "p50", "p99", "model%");
+        unsigned long long now = now_us();
+        for (int i = 0; i < nr_devices; i++) {
+            report(&devices[i], now);
+        }
+        if (!clear)
+            printf("\n");
+        fflush(stdout);
+        discover(argv + optind, argc - optind);
+    }
+    return 0;
+}
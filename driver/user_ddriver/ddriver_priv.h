@@ -0,0 +1,328 @@
+#ifndef _DDRIVER_PRIV_H_
+#define _DDRIVER_PRIV_H_
+
+#include "stdio.h"
+#include "stdlib.h"
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include "string.h"
+#include "errno.h"
+#include "ddriver_ctl.h"
+#include "ddriver_trace.h"
+#include "include/ddriver.h"
+
+#define USER_INFO     "INFO: "
+#define USER_ALERT    "WARNING: "
+
+#define USER_PANIC    "PANIC: "
+/******************************************************************************
+* SECTION: Macro definitions
+*******************************************************************************/
+#define DEVICE_NAME   "ddriver"
+#define DEVICE_LOG    "ddriver_log"
+#define DEVICE_CONF   "ddriver.conf"
+
+#define LOG_OFF       (-1)
+#define LOG_ALERT     1
+#define LOG_INFO      2
+
+#ifndef DDRIVER_LOG_LEVEL                            /* Compile-time ceiling, e.g. -DDDRIVER_LOG_LEVEL=1 */
+#define DDRIVER_LOG_LEVEL   LOG_INFO
+#endif
+
+#define ddriver_log(level, fmt, ...)\
+    do {\
+        if ((level) <= DDRIVER_LOG_LEVEL && (level) <= ddriver_log_level)\
+            log_emit(level, fmt, ##__VA_ARGS__);\
+    } while (0)\
+
+#define user_info(fmt, ...)     ddriver_log(LOG_INFO, fmt, ##__VA_ARGS__)
+
+#define user_alert(fmt, ...)    ddriver_log(LOG_ALERT, fmt, ##__VA_ARGS__)
+
+#define user_panic(fmt, ...)\
+    do {\
+        printf(USER_PANIC  " " fmt "\n", ##__VA_ARGS__);\
+    } while (0)\
+
+#define DISK_LOCK(disk)     pthread_mutex_lock(&(disk)->lock)
+#define DISK_UNLOCK(disk)   ddriver_unlock(disk)
+
+#define STAT_ADD(field, val)    __atomic_add_fetch(&(field), (val), __ATOMIC_RELAXED)
+#define STAT_READ(field)        __atomic_load_n(&(field), __ATOMIC_RELAXED)
+#define STAT_CLEAR(field)       __atomic_store_n(&(field), 0, __ATOMIC_RELAXED)
+
+#define MON_ENTER(disk, nr)     STAT_ADD((disk)->mon->inflight, (nr))
+#define MON_LEAVE(disk, nr)     STAT_ADD((disk)->mon->inflight, -(nr))
+
+#define TRACE_START(disk)       ((disk)->trace != NULL ? ddriver_wall_us() : 0)
+
+#define DDRIVER_MAX_HANDLES     64
+#define DDRIVER_MAX_DEVICES     16
+#define DDRIVER_MAX_CHANNELS    64
+
+#define CONFIG_DISK_SZ  (4 * 1024 * 1024)
+#define CONFIG_BLOCK_SZ (1024)
+#define CONFIG_CACHE_WAYS       8
+#define CONFIG_STRIPES          4
+#define CONFIG_STRIPE_UNIT      (64 * 1024)
+#define CONFIG_CHANNEL_UNIT     (64 * 1024)
+#define CONFIG_FLASH_PAGE       (4 * 1024)
+#define CONFIG_FLASH_BLOCK      (256 * 1024)
+#define CONFIG_FLASH_OP         7
+#define CONFIG_THIN_CLUSTER     (64 * 1024)
+#define CONFIG_PROFILE          "hdd"
+#define CONFIG_PROFILE_FILE     "ddriver.profiles"
+
+#define DDRIVER_INTEGRITY_OFF   0
+#define DDRIVER_INTEGRITY_ON    1                    /* SSE4.2 when available */
+#define DDRIVER_INTEGRITY_SLICE8 2                   /* Always the table-driven CRC */
+/******************************************************************************
+* SECTION: Type definitions
+*******************************************************************************/
+enum ddriver_op
+{
+    DDRIVER_OP_READ,
+    DDRIVER_OP_WRITE
+};
+
+enum profile_seek_curve
+{
+    PROFILE_SEEK_SQRT,
+    PROFILE_SEEK_LINEAR
+};
+
+struct ddriver;
+struct ddriver_cache;
+struct ddriver_trace;
+struct ddriver_pin;
+struct ddriver_flash;
+struct ddriver_integrity;
+struct cache_line;
+
+/**
+ * Storage backend of the emulated disk. All I/O is positional: the disk head
+ * lives in struct ddriver, backends never rely on a file position.
+ * readv/writev return bytes moved or -errno. map is optional: it returns the
+ * address of offset inside a backend that keeps the whole image in memory.
+ * snapshot/rollback/drop_overlay are optional, for backends with overlays.
+ */
+struct ddriver_backend
+{
+    const char *name;
+    int  (*open)(struct ddriver *disk, const char *path);
+    int  (*close)(struct ddriver *disk);
+    int  (*readv)(struct ddriver *disk, const struct iovec *iov, int iovcnt, off_t offset);
+    int  (*writev)(struct ddriver *disk, const struct iovec *iov, int iovcnt, off_t offset);
+    int  (*flush)(struct ddriver *disk);
+    int  (*reset)(struct ddriver *disk);
+    int  (*discard)(struct ddriver *disk, off_t offset, off_t size);
+    void *(*map)(struct ddriver *disk, off_t offset);
+    int  (*snapshot)(struct ddriver *disk);
+    int  (*rollback)(struct ddriver *disk);
+    int  (*drop_overlay)(struct ddriver *disk);
+};
+
+/**
+ * Latency of the HDD model, see ddriver_profile.c. All times are modeled,
+ * per request; transfer costs are per KB, spread over parallelism units.
+ */
+struct ddriver_profile
+{
+    char name[32];
+    long read_us;
+    long write_us;
+    long read_kb_ns;
+    long write_kb_ns;
+    long seek_min_us;                                /* Shortest non-zero seek */
+    long seek_max_us;                                /* Full stroke */
+    int  seek_curve;                                 /* PROFILE_SEEK_* */
+    long rotation_us;                                /* One revolution */
+    int  tracks;
+    int  parallelism;                                /* Internal units, e.g. flash dies */
+};
+
+struct ddriver_config
+{
+    off_t layout_size;
+    off_t iounit_size;
+    char  backend[32];
+    char  latency[16];
+    char  sched[16];
+    off_t cache_size;                                /* 0: no block cache */
+    int   cache_ways;
+    int   stripes;                                   /* stripe backend only */
+    off_t stripe_unit;
+    char  trace[128];                                /* Binary trace file, empty: off */
+    int   log_level;                                 /* LOG_OFF / LOG_ALERT / LOG_INFO */
+    int   flash;                                     /* model = flash */
+    off_t flash_page;
+    off_t flash_block;                               /* Erase block */
+    int   flash_op;                                  /* Over-provisioning, percent */
+    off_t thin_cluster;                              /* thin backend only */
+    char  base[128];                                 /* Backing image of a new thin image */
+    char  profile[32];                               /* Latency profile */
+    char  profile_file[128];                         /* User-defined profiles */
+    int   monitor;                                   /* Publish stats for bin/ddriver-mon */
+    int   channels;                                  /* Independent channels of the model */
+    off_t channel_unit;                              /* Interleave unit of the channels */
+    int   integrity;                                 /* DDRIVER_INTEGRITY_* */
+};
+
+struct ddriver_handle
+{
+    int   in_use;                                    /* Set last (release), get_handle acquires */
+    int   fd;                                        /* dup of the device fd */
+    struct ddriver *disk;                            /* Device the handle was opened on */
+    off_t pos;                                       /* Cursor of ddriver_seek/read/write */
+};
+
+struct ddriver_channel
+{
+    off_t head;                                      /* Channel-local head */
+    struct channel_lane *lanes;                      /* profile.parallelism busy calendars */
+    sem_t units;                                     /* profile.parallelism sleepers */
+};
+
+struct ddriver
+{
+    pthread_mutex_t lock;                            /* Serializes the device model */
+    char path[128];                                  /* Backing image, names the device */
+    int  ddriver_fd;                                 /* Disk ddriver_fd */
+    off_t head;                                      /* Disk Head */
+    const struct ddriver_backend *backend;
+    void *priv;                                      /* Backend private data */
+    struct ddriver_profile profile;                  /* Latency of the HDD model */
+    struct ddriver_channel channels[DDRIVER_MAX_CHANNELS];
+    int  nr_channels;
+    off_t channel_unit;
+    unsigned long long clock_epoch;                  /* Changes when clock_us restarts */
+    off_t layout_size;
+    int  iounit_size;
+    int  virtual_clock;                              /* Never sleep, only advance clock_us */
+    int  sched;                                      /* DDRIVER_SCHED_* */
+    int  sched_dir;                                  /* SCAN sweep direction, 1 or -1 */
+    struct ddriver_stats *stats;                     /* In mon, updated with STAT_ADD */
+    struct ddriver_mon *mon;                         /* Stats page, see ddriver_stats.c */
+    int  mon_shared;                                 /* mon is mapped from DDRIVER_MON_DIR */
+    off_t last_end;                                  /* End of the previous request */
+    unsigned long long pending_model_us;             /* Seek time charged to the next request */
+    unsigned long long pending_wall_us;
+    struct ddriver_cache *cache;                     /* Write-back cache, NULL if disabled */
+    off_t cache_size;
+    int  cache_ways;
+    int  stripes;                                    /* Images of the stripe backend */
+    off_t stripe_unit;
+    struct ddriver_trace *trace;                     /* NULL unless tracing */
+    struct ddriver_pin *pins;                        /* Blocks out via ddriver_get_range */
+    struct ddriver_flash *flash;                     /* FTL, NULL for the HDD model */
+    struct ddriver_integrity *integrity;             /* Block checksums, NULL if disabled */
+    int  integrity_mode;
+    unsigned long long image_stamp[3];               /* Image before the backend opened it */
+    int  flash_mode;
+    off_t flash_page;
+    off_t flash_block;
+    int  flash_op;
+    off_t thin_cluster;                              /* Allocation unit of a new thin image */
+    char base[128];                                  /* Backing image of a new thin image */
+    int  open_cnt;                                   /* Handles and rings, the device goes away at 0 */
+    int  slot;                                       /* Index in the device table */
+};
+/******************************************************************************
+* SECTION: Shared Variable and Functions
+*******************************************************************************/
+extern FILE *debugf;
+extern int   ddriver_log_level;
+
+extern const struct ddriver_backend ddriver_file_backend;
+extern const struct ddriver_backend ddriver_mmap_backend;
+extern const struct ddriver_backend ddriver_stripe_backend;
+extern const struct ddriver_backend ddriver_direct_backend;
+extern const struct ddriver_backend ddriver_thin_backend;
+
+int    ddriver_open_image(const char *path, off_t size);
+int    ddriver_punch_hole(int fd, off_t offset, off_t size);
+int    ddriver_zero_image(int fd, off_t size);
+int    ddriver_parse_size(const char *str, off_t *size);
+int    ddriver_home(char *buf, size_t len);
+int    ddriver_check_geometry(off_t layout_size, off_t iounit_size);
+int    ddriver_load_config(struct ddriver_config *conf, const char *conf_path,
+                           const char *dev_conf_path);
+size_t iov_total(const struct iovec *iov, int iovcnt);
+int    check_valid_range(struct ddriver *disk, off_t offset, size_t size);
+struct ddriver_handle *get_handle(int fd);
+struct ddriver *device_hold(int fd);
+int    device_release(struct ddriver *disk);
+unsigned long long ddriver_wall_us(void);
+void   stats_account(struct ddriver *disk, enum ddriver_op op, size_t size, int seq,
+                     unsigned long long model_us, unsigned long long wall_us);
+void   stats_fill(struct ddriver *disk, struct ddriver_stats *stats);
+void   stats_reset(struct ddriver *disk);
+int    stats_mon_path(const char *path, char *buf, size_t len);
+int    stats_publish(struct ddriver *disk, int shared);
+void   stats_withdraw(struct ddriver *disk);
+void   stats_unpublish(struct ddriver *disk);
+void   stats_geometry(struct ddriver *disk);
+void   emulate_delay(struct ddriver *disk, long us);
+void   ddriver_unlock(struct ddriver *disk);
+void   move_head(struct ddriver *disk, off_t to);
+int    do_request(struct ddriver *disk, enum ddriver_op op, const struct iovec *iov, int iovcnt,
+                  size_t size);
+int    request_in_place(struct ddriver *disk, enum ddriver_op op, off_t offset, size_t size);
+int    request_at_device(struct ddriver *disk, enum ddriver_op op, const struct iovec *iov,
+                         int iovcnt, off_t offset);
+int    request_at(struct ddriver *disk, enum ddriver_op op, const struct iovec *iov, int iovcnt,
+                  off_t offset);
+int    do_request_at(struct ddriver *disk, enum ddriver_op op, const struct iovec *iov, int iovcnt,
+                     off_t offset);
+int    discard_range(struct ddriver *disk, off_t offset, off_t size);
+int    do_discard(struct ddriver *disk, off_t offset, off_t size);
+int    flush_device(struct ddriver *disk);
+int    do_flush(struct ddriver *disk);
+int    cache_init(struct ddriver *disk, off_t size, int ways);
+int    cache_destroy(struct ddriver *disk);
+int    cache_request(struct ddriver *disk, enum ddriver_op op, const struct iovec *iov, int iovcnt,
+                     off_t offset);
+int    cache_writeback(struct ddriver *disk);
+void   cache_invalidate(struct ddriver *disk, off_t offset, off_t size);
+int    cache_pin(struct ddriver *disk, off_t offset, int fill, struct cache_line **out,
+                 char **data);
+void   cache_unpin(struct ddriver *disk, struct cache_line *line, int dirty);
+void   block_release_all(struct ddriver *disk);
+int    flash_init(struct ddriver *disk);
+void   flash_destroy(struct ddriver *disk);
+void   flash_reset(struct ddriver *disk);
+void   flash_request(struct ddriver *disk, enum ddriver_op op, off_t offset, size_t size);
+void   flash_trim(struct ddriver *disk, off_t offset, off_t size);
+int    integrity_open(struct ddriver *disk, int mode);
+void   integrity_close(struct ddriver *disk);
+void   integrity_stamp(const struct ddriver *disk, unsigned long long stamp[3]);
+int    integrity_rebuild(struct ddriver *disk);
+int    integrity_flush(struct ddriver *disk);
+int    integrity_request(struct ddriver *disk, enum ddriver_op op, const struct iovec *iov,
+                         int iovcnt, off_t offset, size_t size);
+void   integrity_discard(struct ddriver *disk, off_t offset, off_t size);
+int    log_start(void);
+void   log_stop(void);
+void   log_emit(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+int    trace_open(struct ddriver *disk, const char *path);
+void   trace_close(struct ddriver *disk);
+void   trace_record(struct ddriver *disk, enum ddriver_trace_op op, off_t offset,
+                    unsigned long long arg, int result, unsigned long long start);
+int    profile_load(struct ddriver_profile *profile, const char *name, const char *path);
+long   profile_request_us(struct ddriver *disk, enum ddriver_op op, size_t size);
+long   profile_seek_us(struct ddriver *disk, off_t from, off_t to, off_t span);
+int    channel_init(struct ddriver *disk);
+void   channel_destroy(struct ddriver *disk);
+void   channel_reset_clock(struct ddriver *disk);
+void   channel_rewind(struct ddriver *disk);
+long   channel_charge(struct ddriver *disk, long us);
+void   channel_request(struct ddriver *disk, enum ddriver_op op, off_t offset, size_t size);
+unsigned long long channel_commit(struct ddriver *disk);
+int    ddriver_sched_parse(const char *name);
+int    ddriver_sched_dispatch(struct ddriver *disk, struct ddriver_req *reqs, int nr);
+
+#endif /* _DDRIVER_PRIV_H_ */
@@ -0,0 +1,227 @@
+#include <ctype.h>
+#include "ddriver_priv.h"
+/******************************************************************************
+* SECTION: Device latency profiles (profile = <name> in ddriver.conf)
+*
+* A profile prices every request of the HDD model:
+*     request = <op>_us + <op>_kb_ns * KB
+*     seek    = seek_min_us + (seek_max_us - seek_min_us) * curve(distance / size)
+*             + rotation_us * (distance % track) / track
+* where curve is sqrt (a real head accelerates, then coasts) or linear and a
+* track is size / tracks bytes; size is that of one channel, see
+* ddriver_channel.c. Seeks are only charged when a request does
+* not start where the head is. parallelism is how many requests the device
+* serves at once: with latency = real, up to that many threads sleep out
+* their modeled latency concurrently (see emulate_delay), while the virtual
+* clock still adds up every request.
+*
+* Besides the built-in profiles below, ~/ddriver.profiles (profile_file) can
+* define new ones or override built-in ones, in sections of "key = value":
+*     [hdd5400]
+*     read_us     = 100
+*     read_kb_ns  = 10000
+*     seek_min_us = 2000
+*     seek_max_us = 22000
+*     rotation_us = 11111
+*     tracks      = 1000
+* Keys a section leaves out are 0, except tracks and parallelism (1) and
+* seek_curve (sqrt). model = flash keeps its own NAND timing.
+*******************************************************************************/
+#define PROFILE_LINE_SZ         256
+
+static const struct ddriver_profile builtin_profiles[] = {
+    /* The original model: 2ms read, 1ms write, 4ms rotation, no transfer cost */
+    { .name = "hdd",      .read_us = 2000, .write_us = 1000, .rotation_us = 4000,
+      .tracks = 100, .parallelism = 1 },
+    /* 7200rpm: 8.3ms revolution, 1-15ms sqrt seek, ~150MB/s */
+    { .name = "hdd7200",  .read_us = 100, .write_us = 100,
+      .read_kb_ns = 6500, .write_kb_ns = 6500,
+      .seek_min_us = 1000, .seek_max_us = 15000, .seek_curve = PROFILE_SEEK_SQRT,
+      .rotation_us = 8333, .tracks = 1000, .parallelism = 1 },
+    /* SATA SSD: ~90us read, ~40us cached write, 550MB/s link, NCQ of 8 in flight */
+    { .name = "sata-ssd", .read_us = 90, .write_us = 40,
+      .read_kb_ns = 1800, .write_kb_ns = 1900, .tracks = 1, .parallelism = 8 },
+    /* NVMe: ~20us read, ~10us write, ~3.3GB/s, 32 in flight */
+    { .name = "nvme",     .read_us = 20, .write_us = 10,
+      .read_kb_ns = 300, .write_kb_ns = 350, .tracks = 1, .parallelism = 32 },
+    /* RAM disk: memory bandwidth only */
+    { .name = "ram",      .read_kb_ns = 100, .write_kb_ns = 100, .tracks = 1,
+      .parallelism = 1 }
+};
+
+static int profile_set(struct ddriver_profile *profile, const char *key, const char *val) {
+    char *end;
+    long  num;
+
+    if (strcmp(key, "seek_curve") == 0) {
+        if (strcmp(val, "sqrt") == 0)
+            profile->seek_curve = PROFILE_SEEK_SQRT;
+        else if (strcmp(val, "linear") == 0)
+            profile->seek_curve = PROFILE_SEEK_LINEAR;
+        else
+            return -EINVAL;
+        return 0;
+    }
+    num = strtol(val, &end, 10);
+    if (end == val || *end != '\0' || num < 0)
+        return -EINVAL;
+    if (strcmp(key, "read_us") == 0)
+        profile->read_us = num;
+    else if (strcmp(key, "write_us") == 0)
+        profile->write_us = num;
+    else if (strcmp(key, "read_kb_ns") == 0)
+        profile->read_kb_ns = num;
+    else if (strcmp(key, "write_kb_ns") == 0)
+        profile->write_kb_ns = num;
+    else if (strcmp(key, "seek_min_us") == 0)
+        profile->seek_min_us = num;
+    else if (strcmp(key, "seek_max_us") == 0)
+        profile->seek_max_us = num;
+    else if (strcmp(key, "rotation_us") == 0)
+        profile->rotation_us = num;
+    else if (strcmp(key, "tracks") == 0 && num > 0)
+        profile->tracks = num;
+    else if (strcmp(key, "parallelism") == 0 && num > 0)
+        profile->parallelism = num;
+    else
+        return -EINVAL;
+    return 0;
+}
+/**
+ * @brief 在path中查找名为name的段
+ *
+ * @return int 1找到，0没有该段或没有该文件，-EINVAL格式错误
+ */
+static int profile_load_file(struct ddriver_profile *profile, const char *name,
+                             const char *path) {
+    char  line[PROFILE_LINE_SZ];
+    char *key, *val, *sep, *end;
+    int   lineno = 0, found = 0, in_section = 0;
+    FILE *fp = fopen(path, "r");
+
+    if (fp == NULL)
+        return 0;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        lineno++;
+        if ((sep = strchr(line, '#')) != NULL)
+            *sep = '\0';
+        for (key = line; isspace((unsigned char)*key); key++)
+            ;
+        for (end = key + strlen(key); end > key && isspace((unsigned char)end[-1]); end--)
+            ;
+        *end = '\0';
+        if (*key == '\0')
+            continue;
+        if (*key == '[') {
+            if (end[-1] != ']')
+                goto bad;
+            end[-1] = '\0';
+            in_section = strcmp(key + 1, name) == 0;
+            if (in_section) {                         /* Last definition wins */
+                memset(profile, 0, sizeof(struct ddriver_profile));
+                snprintf(profile->name, sizeof(profile->name), "%s", name);
+                profile->tracks      = 1;
+                profile->parallelism = 1;
+                profile->seek_curve  = PROFILE_SEEK_SQRT;
+                found = 1;
+            }
+            continue;
+        }
+        if (!in_section)
+            continue;
+        if ((sep = strchr(key, '=')) == NULL)
+            goto bad;
+        for (val = sep + 1; isspace((unsigned char)*val); val++)
+            ;
+        for (end = sep; end > key && isspace((unsigned char)end[-1]); end--)
+            ;
+        *end = '\0';
+        if (profile_set(profile, key, val) < 0)
+            goto bad;
+    }
+    fclose(fp);
+    if (found && profile->seek_max_us < profile->seek_min_us) {
+        user_panic("profile [%s]: seek_max_us below seek_min_us", name);
+        return -EINVAL;
+    }
+    return found;
+
+bad:
+    user_panic("bad profile %s:%d", path, lineno);
+    fclose(fp);
+    return -EINVAL;
+}
+/**
+ * @brief 按名字加载设备时延配置：先查path，再查内置配置
+ *
+ * @param profile
+ * @param name
+ * @param path 配置文件，不存在时只用内置配置
+ * @return int 未知名字返回-EINVAL
+ */
+int profile_load(struct ddriver_profile *profile, const char *name, const char *path) {
+    int ret = profile_load_file(profile, name, path);
+
+    if (ret != 0)
+        return ret < 0 ? ret : 0;
+    for (int i = 0; i < sizeof(builtin_profiles) / sizeof(builtin_profiles[0]); i++) {
+        if (strcmp(builtin_profiles[i].name, name) == 0) {
+            *profile = builtin_profiles[i];
+            return 0;
+        }
+    }
+    user_panic("unknown profile [%s], see %s", name, path);
+    return -EINVAL;
+}
+
+static unsigned long long isqrt(unsigned long long n) {
+    unsigned long long x = n, y = (x + 1) / 2;
+    while (y < x) {
+        x = y;
+        y = (x + n / x) / 2;
+    }
+    return x;
+}
+/**
+ * @brief 一次请求的服务时间(不含寻道)
+ *
+ * @param disk
+ * @param op
+ * @param size
+ * @return long us
+ */
+long profile_request_us(struct ddriver *disk, enum ddriver_op op, size_t size) {
+    const struct ddriver_profile *profile = &disk->profile;
+    long long ns = (long long)(op == DDRIVER_OP_READ ? profile->read_kb_ns : profile->write_kb_ns) *
+                   (long long)size / 1024;
+    return (op == DDRIVER_OP_READ ? profile->read_us : profile->write_us) + (ns + 500) / 1000;
+}
+/**
+ * @brief 磁盘头从from移到to的寻道与旋转时间
+ *
+ * @param disk
+ * @param from
+ * @param to
+ * @param span 磁盘头覆盖的字节数
+ * @return long us
+ */
+long profile_seek_us(struct ddriver *disk, off_t from, off_t to, off_t span) {
+    const struct ddriver_profile *profile = &disk->profile;
+    off_t distance = llabs(to - from);
+    off_t bytes_per_track = span / profile->tracks;
+    unsigned long long ppm;                           /* distance / size, parts per million */
+    long us = 0;
+
+    if (distance == 0)
+        return 0;
+    if (profile->seek_max_us > 0) {
+        ppm = (double)distance / span * 1000000;
+        if (profile->seek_curve == PROFILE_SEEK_SQRT)
+            ppm = isqrt(ppm * 1000000);
+        us += profile->seek_min_us +
+              (long)((profile->seek_max_us - profile->seek_min_us) * ppm / 1000000);
+    }
+    if (bytes_per_track > 0)
+        us += (distance % bytes_per_track) * profile->rotation_us / bytes_per_track;
+    return us;
+}
@@ -0,0 +1,311 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pwd.h>
+#include <time.h>
+#include <pthread.h>
+#include "include/ddriver.h"
+#include "ddriver_trace.h"
+/******************************************************************************
+* SECTION: ddriver-replay, re-runs a binary trace against the configured device
+*
+* Reads and writes are replayed at their traced offsets with a fill pattern,
+* seeks, discards, flushes and resets are replayed as such, other ioctls and
+* calls that failed when traced are skipped. The trace doesn't name its
+* device: -d picks one, ~/ddriver by default. Backend, cache, scheduler etc.
+* come from its configuration and DDRIVER_* as usual.
+*******************************************************************************/
+#define REPLAY_MAX_THREADS      64
+
+struct replay_thread
+{
+    unsigned int               tid;
+    int                        nr;
+    struct ddriver_trace_rec **recs;
+    unsigned int              *lat[DDRIVER_TRACE_OPS];
+    int                        cnt[DDRIVER_TRACE_OPS];
+    unsigned long long         bytes[DDRIVER_TRACE_OPS];
+    int                        errors;
+    int                        skipped;
+    pthread_t                  thread;
+};
+
+static const char *op_names[DDRIVER_TRACE_OPS] = {
+    [DDRIVER_TRACE_SEEK]    = "seek",
+    [DDRIVER_TRACE_READ]    = "read",
+    [DDRIVER_TRACE_WRITE]   = "write",
+    [DDRIVER_TRACE_DISCARD] = "discard",
+    [DDRIVER_TRACE_FLUSH]   = "flush",
+    [DDRIVER_TRACE_IOCTL]   = "ioctl"
+};
+
+static char               device_path[256];
+static int                honor_time;
+static unsigned long long replay_start;
+
+static unsigned long long now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int cmp_uint(const void *a, const void *b) {
+    unsigned int ua = *(const unsigned int *)a, ub = *(const unsigned int *)b;
+    return ua < ub ? -1 : ua > ub;
+}
+
+static int replay_one(int fd, struct ddriver_trace_rec *rec, char **buf, size_t *buf_sz) {
+    struct ddriver_range range = { .offset = rec->offset, .size = rec->arg };
+
+    if ((rec->op == DDRIVER_TRACE_READ || rec->op == DDRIVER_TRACE_WRITE) && rec->arg > *buf_sz) {
+        free(*buf);
+        *buf_sz = rec->arg;
+        *buf    = (char *)malloc(*buf_sz);
+        if (*buf == NULL)
+            return -ENOMEM;
+        memset(*buf, 0x5a, *buf_sz);
+    }
+    switch (rec->op)
+    {
+    case DDRIVER_TRACE_SEEK:
+        return ddriver_seek(fd, rec->offset, SEEK_SET) < 0 ? -EIO : 0;
+    case DDRIVER_TRACE_READ:
+        return ddriver_pread(fd, *buf, rec->arg, rec->offset);
+    case DDRIVER_TRACE_WRITE:
+        return ddriver_pwrite(fd, *buf, rec->arg, rec->offset);
+    case DDRIVER_TRACE_DISCARD:
+        return ddriver_ioctl(fd, IOC_REQ_DEVICE_DISCARD, &range);
+    case DDRIVER_TRACE_FLUSH:
+        return ddriver_ioctl(fd, IOC_REQ_DEVICE_FLUSH, NULL);
+    case DDRIVER_TRACE_IOCTL:
+        return ddriver_ioctl(fd, rec->arg, NULL);
+    default:
+        return -EINVAL;
+    }
+}
+
+static int replayable(struct ddriver_trace_rec *rec) {
+    if (rec->result < 0 || rec->op >= DDRIVER_TRACE_OPS)
+        return 0;
+    if (rec->op == DDRIVER_TRACE_SEEK)
+        return rec->arg == SEEK_SET || rec->arg == SEEK_CUR || rec->arg == SEEK_END;
+    if (rec->op == DDRIVER_TRACE_IOCTL)
+        return rec->arg == IOC_REQ_DEVICE_RESET || rec->arg == IOC_REQ_DEVICE_RESET_STATS;
+    return 1;
+}
+
+static void *replay_thread_fn(void *arg) {
+    struct replay_thread *rt = (struct replay_thread *)arg;
+    struct ddriver_trace_rec *rec;
+    unsigned long long t0;
+    size_t buf_sz = 0;
+    char  *buf = NULL;
+    int    fd, ret;
+
+    fd = ddriver_open(device_path);
+    if (fd < 0) {
+        fprintf(stderr, "can't open %s: %d\n", device_path, fd);
+        rt->errors = rt->nr;
+        return NULL;
+    }
+    for (int i = 0; i < rt->nr; i++) {
+        rec = rt->recs[i];
+        if (!replayable(rec)) {
+            rt->skipped++;
+            continue;
+        }
+        if (honor_time && (t0 = now_us() - replay_start) < rec->ts_us) {
+            usleep(rec->ts_us - t0);
+        }
+        t0  = now_us();
+        ret = replay_one(fd, rec, &buf, &buf_sz);
+        rt->lat[rec->op][rt->cnt[rec->op]++] = now_us() - t0;
+        if (ret < 0)
+            rt->errors++;
+        else if (rec->op == DDRIVER_TRACE_READ || rec->op == DDRIVER_TRACE_WRITE)
+            rt->bytes[rec->op] += rec->arg;
+    }
+    free(buf);
+    ddriver_close(fd);
+    return NULL;
+}
+
+static void usage(const char *prog) {
+    printf("用法: %s [-p] [-r] [-d 设备] <trace>\n", prog);
+    printf("  -p  每个被跟踪的线程在各自的线程中重放(缺省: 单线程按记录顺序)\n");
+    printf("  -r  按记录的时间戳重放(缺省: 尽快重放)\n");
+    printf("  -d  重放到的设备，相对路径基于$HOME(缺省: ~/ddriver)\n");
+}
+
+int main(int argc, char **argv) {
+    struct ddriver_trace_header header;
+    struct ddriver_trace_rec *recs;
+    struct replay_thread *threads;
+    unsigned long long clock0 = 0, clock1 = 0, elapsed, traced_lat[DDRIVER_TRACE_OPS] = {0};
+    struct ddriver_stats stats0 = { .size = sizeof(struct ddriver_stats) };
+    struct ddriver_stats stats1 = { .size = sizeof(struct ddriver_stats) };
+    unsigned long long host, nand;
+    unsigned int *lat;
+    long nr, total;
+    const char *device = "ddriver";
+    int  parallel = 0, nthreads = 0, iounit = 0, errors = 0, skipped = 0, fd, opt, j;
+    FILE *fp;
+
+    while ((opt = getopt(argc, argv, "prd:h")) != -1) {
+        switch (opt)
+        {
+        case 'p':
+            parallel = 1;
+            break;
+        case 'r':
+            honor_time = 1;
+            break;
+        case 'd':
+            device = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (optind != argc - 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    fp = fopen(argv[optind], "r");
+    if (fp == NULL || fread(&header, sizeof(header), 1, fp) != 1 ||
+        header.magic != DDRIVER_TRACE_MAGIC || header.version != DDRIVER_TRACE_VERSION ||
+        header.record_size != sizeof(struct ddriver_trace_rec)) {
+        fprintf(stderr, "%s: not a ddriver trace (version %d)\n", argv[optind],
+                DDRIVER_TRACE_VERSION);
+        return 1;
+    }
+    fseek(fp, 0, SEEK_END);
+    nr = (ftell(fp) - (long)sizeof(header)) / sizeof(struct ddriver_trace_rec);
+    fseek(fp, sizeof(header), SEEK_SET);
+    recs = (struct ddriver_trace_rec *)malloc(sizeof(struct ddriver_trace_rec) * (nr + 1));
+    if (recs == NULL || fread(recs, sizeof(struct ddriver_trace_rec), nr, fp) != nr) {
+        fprintf(stderr, "%s: short trace\n", argv[optind]);
+        return 1;
+    }
+    fclose(fp);
+    printf("trace: %ld records, device %llu bytes / %u byte blocks, %llu dropped\n",
+           nr, header.layout_size, header.iounit_size, header.dropped);
+
+    /* Group records by traced thread: count, then fill */
+    threads = (struct replay_thread *)calloc(REPLAY_MAX_THREADS, sizeof(struct replay_thread));
+    for (long i = 0; i < nr; i++) {
+        unsigned int tid = parallel ? recs[i].tid : 0;
+        for (j = 0; j < nthreads && threads[j].tid != tid; j++)
+            ;
+        if (j == nthreads) {
+            if (nthreads == REPLAY_MAX_THREADS) {
+                fprintf(stderr, "more than %d traced threads\n", REPLAY_MAX_THREADS);
+                return 1;
+            }
+            threads[nthreads++].tid = tid;
+        }
+        threads[j].nr++;
+        if (recs[i].op < DDRIVER_TRACE_OPS)
+            traced_lat[recs[i].op] += recs[i].lat_us;
+    }
+    for (j = 0; j < nthreads; j++) {
+        threads[j].recs = (struct ddriver_trace_rec **)
+                          malloc(sizeof(struct ddriver_trace_rec *) * threads[j].nr);
+        for (int op = 0; op < DDRIVER_TRACE_OPS; op++) {
+            threads[j].lat[op] = (unsigned int *)malloc(sizeof(unsigned int) * threads[j].nr);
+        }
+        threads[j].nr = 0;
+    }
+    for (long i = 0; i < nr; i++) {
+        unsigned int tid = parallel ? recs[i].tid : 0;
+        for (j = 0; threads[j].tid != tid; j++)
+            ;
+        threads[j].recs[threads[j].nr++] = &recs[i];
+    }
+
+    unsetenv("DDRIVER_TRACE");                        /* Never overwrite our input */
+    if (device[0] == '/')
+        snprintf(device_path, sizeof(device_path), "%s", device);
+    else
+        snprintf(device_path, sizeof(device_path), "%s/%s", getpwuid(getuid())->pw_dir, device);
+    fd = ddriver_open(device_path);                   /* Keeps the device up between threads */
+    if (fd < 0) {
+        fprintf(stderr, "can't open %s: %d\n", device_path, fd);
+        return 1;
+    }
+    ddriver_ioctl(fd, IOC_REQ_DEVICE_IO_SZ, &iounit);
+    if (iounit != header.iounit_size) {
+        fprintf(stderr, "device block size %d, trace needs %u\n", iounit, header.iounit_size);
+        ddriver_close(fd);
+        return 1;
+    }
+    ddriver_ioctl(fd, IOC_REQ_DEVICE_CLOCK, &clock0);
+    ddriver_ioctl(fd, IOC_REQ_DEVICE_STATS, &stats0);
+
+    replay_start = now_us();
+    for (int i = 0; i < nthreads; i++) {
+        pthread_create(&threads[i].thread, NULL, replay_thread_fn, &threads[i]);
+    }
+    for (int i = 0; i < nthreads; i++) {
+        pthread_join(threads[i].thread, NULL);
+    }
+    elapsed = now_us() - replay_start;
+    ddriver_ioctl(fd, IOC_REQ_DEVICE_CLOCK, &clock1);
+    ddriver_ioctl(fd, IOC_REQ_DEVICE_STATS, &stats1);
+    ddriver_close(fd);
+
+    /* Report */
+    total = 0;
+    for (int i = 0; i < nthreads; i++) {
+        for (int op = 0; op < DDRIVER_TRACE_OPS; op++)
+            total += threads[i].cnt[op];
+    }
+    printf("replay: %ld ops in %.3f s (%.0f ops/s) by %d thread(s), modeled device time %.3f s\n",
+           total, elapsed / 1e6, elapsed ? total * 1e6 / elapsed : 0.0, nthreads,
+           (clock1 - clock0) / 1e6);
+    printf("%-8s %8s %10s %10s %10s %10s %10s %12s\n",
+           "op", "count", "MiB/s", "mean(us)", "p50(us)", "p99(us)", "max(us)", "traced(us)");
+    for (int op = 0; op < DDRIVER_TRACE_OPS; op++) {
+        unsigned long long sum = 0, bytes = 0;
+        long cnt = 0, traced = 0;
+        for (int i = 0; i < nthreads; i++) {
+            cnt   += threads[i].cnt[op];
+            bytes += threads[i].bytes[op];
+        }
+        if (cnt == 0)
+            continue;
+        lat = (unsigned int *)malloc(sizeof(unsigned int) * cnt);
+        cnt = 0;
+        for (int i = 0; i < nthreads; i++) {
+            memcpy(lat + cnt, threads[i].lat[op], sizeof(unsigned int) * threads[i].cnt[op]);
+            cnt += threads[i].cnt[op];
+        }
+        for (long i = 0; i < nr; i++) {
+            traced += recs[i].op == op;
+        }
+        qsort(lat, cnt, sizeof(unsigned int), cmp_uint);
+        for (long i = 0; i < cnt; i++) {
+            sum += lat[i];
+        }
+        printf("%-8s %8ld %10.2f %10.1f %10u %10u %10u %12.1f\n", op_names[op], cnt,
+               elapsed ? bytes / 1048576.0 * 1e6 / elapsed : 0.0, (double)sum / cnt,
+               lat[cnt / 2], lat[cnt * 99 / 100], lat[cnt - 1],
+               traced ? (double)traced_lat[op] / traced : 0.0);
+        free(lat);
+    }
+    host = stats1.flash_host_pages - stats0.flash_host_pages;
+    nand = stats1.flash_nand_pages - stats0.flash_nand_pages;
+    if (stats1.version >= 4 && host > 0)
+        printf("flash: %llu host pages, %llu NAND pages, %llu erases, write amplification %.2f\n",
+               host, nand, stats1.flash_erase_cnt - stats0.flash_erase_cnt, (double)nand / host);
+    for (int i = 0; i < nthreads; i++) {
+        errors  += threads[i].errors;
+        skipped += threads[i].skipped;
+    }
+    printf("%d failed, %d skipped\n", errors, skipped);
+    return errors ? 1 : 0;
+}
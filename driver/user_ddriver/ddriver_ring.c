@@ -0,0 +1,259 @@
+#include "ddriver_priv.h"
+/******************************************************************************
+* SECTION: Asynchronous submission/completion rings
+*
+* The caller fills SQEs (ddriver_ring_get_sqe), publishes them with
+* ddriver_ring_submit and reaps CQEs with ddriver_ring_reap. Worker threads
+* pop SQEs in order and run them against the device. The device model stays
+* serialized by disk->lock, but the workers' modeled latencies overlap with
+* the caller's own work and, on a profile with parallelism > 1 or a device
+* with several channels (ddriver_channel.c), with each other. A flush waits
+* for every request popped before it.
+*
+* Every SQE handed out holds a slot until its CQE is reaped, so neither ring
+* can overflow. A ring holds a reference on its device like a handle does,
+* so closing fd before ddriver_ring_exit leaves the device open until then.
+*******************************************************************************/
+struct ddriver_ring
+{
+    int                 fd;
+    struct ddriver     *disk;                         /* Device of fd, held until exit */
+    unsigned int        entries;
+    unsigned int        mask;
+    struct ddriver_sqe *sq;
+    unsigned int        sq_head;                      /* Next SQE for the workers */
+    unsigned int        sq_tail;                      /* End of published SQEs */
+    unsigned int        sq_local;                     /* End of SQEs handed to the caller */
+    struct ddriver_cqe *cq;
+    unsigned int        cq_head;
+    unsigned int        cq_tail;
+    unsigned int        inflight;                     /* Handed out and not yet reaped */
+    int                 active;                       /* Requests being served */
+    int                 draining;                     /* A flush waits for active == 0 */
+    int                 stop;
+    pthread_mutex_t     lock;
+    pthread_cond_t      sq_cond;
+    pthread_cond_t      cq_cond;
+    pthread_cond_t      idle_cond;
+    int                 nr_workers;
+    pthread_t          *workers;
+};
+
+static int ring_execute(struct ddriver *disk, struct ddriver_sqe *sqe) {
+    struct iovec iov = { .iov_base = sqe->buf, .iov_len = sqe->size };
+
+    switch (sqe->op)
+    {
+    case DDRIVER_REQ_READ:
+        return do_request_at(disk, DDRIVER_OP_READ, &iov, 1, sqe->offset);
+    case DDRIVER_REQ_WRITE:
+        return do_request_at(disk, DDRIVER_OP_WRITE, &iov, 1, sqe->offset);
+    case DDRIVER_REQ_FLUSH:
+        return do_flush(disk);
+    case DDRIVER_REQ_DISCARD:
+        return do_discard(disk, sqe->offset, sqe->size);
+    default:
+        return -EINVAL;
+    }
+}
+
+static void *ring_worker(void *arg) {
+    struct ddriver_ring *ring = (struct ddriver_ring *)arg;
+    struct ddriver_sqe   sqe;
+    struct ddriver_cqe  *cqe;
+    int res;
+
+    pthread_mutex_lock(&ring->lock);
+    for (;;) {
+        while (!ring->stop && (ring->sq_head == ring->sq_tail || ring->draining)) {
+            pthread_cond_wait(&ring->sq_cond, &ring->lock);
+        }
+        if (ring->sq_head == ring->sq_tail) {
+            break;                                    /* Stopped and drained */
+        }
+        sqe = ring->sq[ring->sq_head++ & ring->mask];
+        if (sqe.op == DDRIVER_REQ_FLUSH) {
+            ring->draining = 1;
+            while (ring->active > 0) {
+                pthread_cond_wait(&ring->idle_cond, &ring->lock);
+            }
+        }
+        ring->active++;
+        pthread_mutex_unlock(&ring->lock);
+
+        res = ring_execute(ring->disk, &sqe);
+
+        pthread_mutex_lock(&ring->lock);
+        ring->active--;
+        if (sqe.op == DDRIVER_REQ_FLUSH) {
+            ring->draining = 0;
+            pthread_cond_broadcast(&ring->sq_cond);
+        }
+        if (ring->active == 0) {
+            pthread_cond_broadcast(&ring->idle_cond);
+        }
+        cqe = &ring->cq[ring->cq_tail++ & ring->mask];
+        cqe->user_data = sqe.user_data;
+        cqe->result    = res;
+        pthread_cond_broadcast(&ring->cq_cond);
+    }
+    pthread_mutex_unlock(&ring->lock);
+    return NULL;
+}
+/**
+ * @brief 创建一对提交/完成队列及其工作线程
+ *
+ * @param fd
+ * @param entries 队列深度，向上取整为2的幂
+ * @param nr_workers
+ * @return struct ddriver_ring* 失败返回NULL
+ */
+struct ddriver_ring *ddriver_ring_setup(int fd, unsigned int entries, int nr_workers) {
+    struct ddriver_ring *ring;
+    unsigned int size = 1;
+
+    if (entries == 0 || entries > (1U << 16) || nr_workers <= 0 || get_handle(fd) == NULL) {
+        return NULL;
+    }
+    while (size < entries) {
+        size <<= 1;
+    }
+
+    ring = (struct ddriver_ring *)calloc(1, sizeof(struct ddriver_ring));
+    if (ring == NULL) {
+        return NULL;
+    }
+    ring->fd         = fd;
+    ring->disk       = device_hold(fd);               /* Outlives a close of fd */
+    if (ring->disk == NULL) {
+        free(ring);
+        return NULL;
+    }
+    ring->entries    = size;
+    ring->mask       = size - 1;
+    ring->sq         = (struct ddriver_sqe *)calloc(size, sizeof(struct ddriver_sqe));
+    ring->cq         = (struct ddriver_cqe *)calloc(size, sizeof(struct ddriver_cqe));
+    ring->workers    = (pthread_t *)calloc(nr_workers, sizeof(pthread_t));
+    if (ring->sq == NULL || ring->cq == NULL || ring->workers == NULL) {
+        goto err_free;
+    }
+    pthread_mutex_init(&ring->lock, NULL);
+    pthread_cond_init(&ring->sq_cond, NULL);
+    pthread_cond_init(&ring->cq_cond, NULL);
+    pthread_cond_init(&ring->idle_cond, NULL);
+
+    for (; ring->nr_workers < nr_workers; ring->nr_workers++) {
+        if (pthread_create(&ring->workers[ring->nr_workers], NULL, ring_worker, ring) != 0) {
+            user_panic("can't start ring worker %d", ring->nr_workers);
+            ddriver_ring_exit(ring);
+            return NULL;
+        }
+    }
+    return ring;
+
+err_free:
+    device_release(ring->disk);
+    free(ring->sq);
+    free(ring->cq);
+    free(ring->workers);
+    free(ring);
+    return NULL;
+}
+/**
+ * @brief 取一个空闲的SQE，由调用者填写后经ddriver_ring_submit提交
+ *
+ * @param ring
+ * @return struct ddriver_sqe* 队列已满(未收割的请求达到队列深度)时返回NULL
+ */
+struct ddriver_sqe *ddriver_ring_get_sqe(struct ddriver_ring *ring) {
+    struct ddriver_sqe *sqe = NULL;
+
+    pthread_mutex_lock(&ring->lock);
+    if (ring->inflight < ring->entries) {
+        sqe = &ring->sq[ring->sq_local++ & ring->mask];
+        memset(sqe, 0, sizeof(struct ddriver_sqe));
+        ring->inflight++;
+    }
+    pthread_mutex_unlock(&ring->lock);
+    return sqe;
+}
+/**
+ * @brief 提交所有已取出的SQE
+ *
+ * @param ring
+ * @return int 本次提交的请求数
+ */
+int ddriver_ring_submit(struct ddriver_ring *ring) {
+    int nr;
+
+    pthread_mutex_lock(&ring->lock);
+    nr = ring->sq_local - ring->sq_tail;
+    ring->sq_tail = ring->sq_local;
+    if (nr > 0) {
+        pthread_cond_broadcast(&ring->sq_cond);
+    }
+    pthread_mutex_unlock(&ring->lock);
+    return nr;
+}
+/**
+ * @brief 收割完成事件，至少等到min_complete个(不超过已提交未收割的请求数)
+ *
+ * @param ring
+ * @param cqes
+ * @param nr cqes容量
+ * @param min_complete 0为不等待
+ * @return int 收割的个数
+ */
+int ddriver_ring_reap(struct ddriver_ring *ring, struct ddriver_cqe *cqes, int nr,
+                      int min_complete) {
+    unsigned int submitted;
+    int ready, cnt = 0;
+
+    pthread_mutex_lock(&ring->lock);
+    submitted = ring->inflight - (ring->sq_local - ring->sq_tail);
+    if (min_complete > nr) {
+        min_complete = nr;
+    }
+    if (min_complete > (int)submitted) {
+        min_complete = submitted;
+    }
+    while ((int)(ring->cq_tail - ring->cq_head) < min_complete) {
+        pthread_cond_wait(&ring->cq_cond, &ring->lock);
+    }
+    ready = ring->cq_tail - ring->cq_head;
+    while (cnt < nr && cnt < ready) {
+        cqes[cnt++] = ring->cq[ring->cq_head++ & ring->mask];
+    }
+    ring->inflight -= cnt;
+    pthread_mutex_unlock(&ring->lock);
+    return cnt;
+}
+/**
+ * @brief 完成所有已提交的请求后停止工作线程并释放队列
+ *   未提交的SQE被丢弃，未收割的CQE一并释放；fd已关闭时设备在此关闭
+ * @param ring
+ * @return int
+ */
+int ddriver_ring_exit(struct ddriver_ring *ring) {
+    if (ring == NULL) {
+        return -EINVAL;
+    }
+    pthread_mutex_lock(&ring->lock);
+    ring->stop = 1;
+    pthread_cond_broadcast(&ring->sq_cond);
+    pthread_mutex_unlock(&ring->lock);
+
+    for (int i = 0; i < ring->nr_workers; i++) {
+        pthread_join(ring->workers[i], NULL);
+    }
+    pthread_mutex_destroy(&ring->lock);
+    pthread_cond_destroy(&ring->sq_cond);
+    pthread_cond_destroy(&ring->cq_cond);
+    pthread_cond_destroy(&ring->idle_cond);
+    device_release(ring->disk);
+    free(ring->sq);
+    free(ring->cq);
+    free(ring->workers);
+    free(ring);
+    return 0;
+}
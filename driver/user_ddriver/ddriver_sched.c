@@ -0,0 +1,199 @@
+#include <limits.h>
+#include "ddriver_priv.h"
+/******************************************************************************
+* SECTION: Request queue, orders a batch of block requests before dispatch
+*
+* The whole batch is known up front, so every policy is expressed as "pick
+* the next request given the current head". Requests that continue the
+* picked one on disk (same op, offset == end of the previous) are merged
+* into a single device request.
+*******************************************************************************/
+#define SCHED_READ_EXPIRE_US    (50 * 1000)           /* deadline: modeled time */
+#define SCHED_WRITE_EXPIRE_US   (500 * 1000)
+#define SCHED_MAX_MERGE         1024                  /* Linux IOV_MAX */
+
+struct sched_entry
+{
+    struct ddriver_req *req;
+    unsigned long long  deadline;
+    int                 arrival;
+    int                 done;
+};
+
+static int cmp_offset(const void *a, const void *b) {
+    const struct sched_entry *ea = a, *eb = b;
+    if (ea->req->offset != eb->req->offset)
+        return ea->req->offset < eb->req->offset ? -1 : 1;
+    return ea->arrival - eb->arrival;
+}
+/**
+ * @brief 在按offset排序的队列中找到offset>=pos的第一个未派发请求
+ */
+static int first_at_or_after(struct sched_entry *q, int nr, off_t pos) {
+    for (int i = 0; i < nr; i++) {
+        if (!q[i].done && q[i].req->offset >= pos)
+            return i;
+    }
+    return -1;
+}
+
+static int last_at_or_before(struct sched_entry *q, int nr, off_t pos) {
+    for (int i = nr - 1; i >= 0; i--) {
+        if (!q[i].done && q[i].req->offset <= pos)
+            return i;
+    }
+    return -1;
+}
+
+static int oldest(struct sched_entry *q, int nr) {
+    int pick = -1;
+    for (int i = 0; i < nr; i++) {
+        if (!q[i].done && (pick < 0 || q[i].arrival < q[pick].arrival))
+            pick = i;
+    }
+    return pick;
+}
+/**
+ * @brief 按调度策略选出下一个请求
+ */
+static int pick_next(struct ddriver *disk, struct sched_entry *q, int nr) {
+    int pick;
+
+    switch (disk->sched)
+    {
+    case DDRIVER_SCHED_FIFO:
+        return oldest(q, nr);
+    case DDRIVER_SCHED_SCAN:                          /* Elevator, sweeps to the edge */
+        if (disk->sched_dir > 0) {
+            pick = first_at_or_after(q, nr, disk->head);
+            if (pick < 0 && (pick = last_at_or_before(q, nr, disk->head)) >= 0) {
+                move_head(disk, disk->layout_size - disk->iounit_size);
+                disk->sched_dir = -1;
+            }
+        }
+        else {
+            pick = last_at_or_before(q, nr, disk->head);
+            if (pick < 0 && (pick = first_at_or_after(q, nr, disk->head)) >= 0) {
+                move_head(disk, 0);
+                disk->sched_dir = 1;
+            }
+        }
+        return pick;
+    case DDRIVER_SCHED_DEADLINE:                      /* C-LOOK unless someone expired */
+        pick = oldest(q, nr);
+        if (pick >= 0 && q[pick].deadline <= disk->stats->clock_us)
+            return pick;
+        /* fall through */
+    case DDRIVER_SCHED_CLOOK:
+    default:
+        pick = first_at_or_after(q, nr, disk->head);
+        return pick >= 0 ? pick : first_at_or_after(q, nr, 0);
+    }
+}
+/**
+ * @brief 以q[first]为首向后合并磁盘上连续的同类请求并派发
+ *
+ * @return int 本次派发中成功的请求数
+ */
+static int dispatch(struct ddriver *disk, struct sched_entry *q, int nr, int first,
+                    struct iovec *iov) {
+    struct sched_entry *merged[SCHED_MAX_MERGE];
+    struct ddriver_req *req = q[first].req;
+    off_t  end  = req->offset + req->size;
+    size_t size = req->size;
+    int    cnt  = 1;
+    int    next, ret;
+
+    merged[0]        = &q[first];
+    iov[0].iov_base  = req->buf;
+    iov[0].iov_len   = req->size;
+    q[first].done    = 1;
+
+    while (cnt < SCHED_MAX_MERGE) {
+        next = disk->sched == DDRIVER_SCHED_FIFO ? oldest(q, nr)
+                                                : first_at_or_after(q, nr, end);
+        if (next < 0 || q[next].req->offset != end || q[next].req->op != req->op ||
+            size + q[next].req->size > INT_MAX)
+            break;
+        merged[cnt]           = &q[next];
+        iov[cnt].iov_base     = q[next].req->buf;
+        iov[cnt].iov_len      = q[next].req->size;
+        q[next].done          = 1;
+        end                  += q[next].req->size;
+        size                 += q[next].req->size;
+        cnt++;
+    }
+
+    ret = request_at(disk, req->op, iov, cnt, req->offset);
+    STAT_ADD(disk->stats->merge_cnt, cnt - 1);
+
+    for (int i = 0; i < cnt; i++) {
+        merged[i]->req->result = ret < 0 ? ret : merged[i]->req->size;
+    }
+    return ret < 0 ? 0 : cnt;
+}
+/**
+ * @brief 检查、排序、合并并派发一批请求
+ *
+ * @param reqs
+ * @param nr
+ * @return int 成功完成的请求数
+ */
+int ddriver_sched_dispatch(struct ddriver *disk, struct ddriver_req *reqs, int nr) {
+    struct sched_entry *q;
+    struct iovec       *iov;
+    int valid = 0, completed = 0, next;
+
+    q   = (struct sched_entry *)malloc(sizeof(struct sched_entry) * nr);
+    iov = (struct iovec *)malloc(sizeof(struct iovec) * SCHED_MAX_MERGE);
+    if (q == NULL || iov == NULL) {
+        free(q);
+        free(iov);
+        return -ENOMEM;
+    }
+
+    for (int i = 0; i < nr; i++) {
+        struct ddriver_req *req = &reqs[i];
+        if ((req->op != DDRIVER_REQ_READ && req->op != DDRIVER_REQ_WRITE) ||
+            req->size == 0 || req->size % disk->iounit_size != 0 || req->size > INT_MAX ||
+            req->offset % disk->iounit_size != 0 ||
+            check_valid_range(disk, req->offset, req->size) < 0) {
+            req->result = -EINVAL;
+            continue;
+        }
+        q[valid].req      = req;
+        q[valid].arrival  = i;
+        q[valid].done     = 0;
+        q[valid].deadline = disk->stats->clock_us + (req->op == DDRIVER_REQ_READ ?
+                                             SCHED_READ_EXPIRE_US : SCHED_WRITE_EXPIRE_US);
+        valid++;
+    }
+    qsort(q, valid, sizeof(struct sched_entry), cmp_offset);
+
+    while ((next = pick_next(disk, q, valid)) >= 0) {
+        completed += dispatch(disk, q, valid, next, iov);
+    }
+
+    free(iov);
+    free(q);
+    return completed;
+}
+/**
+ * @brief 调度策略名 -> DDRIVER_SCHED_*
+ *
+ * @param name
+ * @return int 未知名字返回-EINVAL
+ */
+int ddriver_sched_parse(const char *name) {
+    static const char *names[] = {
+        [DDRIVER_SCHED_FIFO]     = "fifo",
+        [DDRIVER_SCHED_SCAN]     = "scan",
+        [DDRIVER_SCHED_CLOOK]    = "clook",
+        [DDRIVER_SCHED_DEADLINE] = "deadline"
+    };
+    for (int i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (strcmp(names[i], name) == 0)
+            return i;
+    }
+    return -EINVAL;
+}
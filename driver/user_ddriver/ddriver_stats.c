@@ -0,0 +1,191 @@
+#include <time.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "ddriver_priv.h"
+/******************************************************************************
+* SECTION: Device statistics
+*
+* All counters live in disk->stats as 64-bit words that are only touched with
+* relaxed atomics, so IOC_REQ_DEVICE_STATS never needs the device lock. A
+* request is sequential when it starts where the previous one ended; its
+* modeled latency includes the seeks charged since that previous request.
+*
+* disk->stats is part of a struct ddriver_mon page mapped from
+* /dev/shm/ddriver.<device path, '/' -> '.'>, so other processes
+* (bin/ddriver-mon) can watch the live counters without any cost on the I/O
+* path. With monitor = off, or when the page can't be created, the page is
+* plain process memory instead.
+*******************************************************************************/
+#define STATS_FIRST             offsetof(struct ddriver_stats, read_cnt)
+#define STATS_WORDS             ((sizeof(struct ddriver_stats) - STATS_FIRST) / \
+                                 sizeof(unsigned long long))
+#define STATS_WORD(disk, i)     (((unsigned long long *)&(disk)->stats->read_cnt)[i])
+
+unsigned long long ddriver_wall_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int lat_bucket(unsigned long long us) {
+    int bucket = us == 0 ? 0 : 63 - __builtin_clzll(us);
+    return bucket < DDRIVER_LAT_BUCKETS ? bucket : DDRIVER_LAT_BUCKETS - 1;
+}
+/**
+ * @brief 记录一次完成的请求
+ *
+ * @param op
+ * @param size
+ * @param seq 是否紧接上一个请求
+ * @param model_us 模型延迟
+ * @param wall_us 实际耗时
+ */
+void stats_account(struct ddriver *disk, enum ddriver_op op, size_t size, int seq,
+                   unsigned long long model_us, unsigned long long wall_us) {
+    if (op == DDRIVER_OP_READ) {
+        STAT_ADD(disk->stats->read_cnt, 1);
+        STAT_ADD(disk->stats->read_bytes, size);
+    }
+    else {
+        STAT_ADD(disk->stats->write_cnt, 1);
+        STAT_ADD(disk->stats->write_bytes, size);
+    }
+    if (seq)
+        STAT_ADD(disk->stats->seq_cnt, 1);
+    else
+        STAT_ADD(disk->stats->rand_cnt, 1);
+    STAT_ADD(disk->stats->lat_model[op][lat_bucket(model_us)], 1);
+    STAT_ADD(disk->stats->lat_wall[op][lat_bucket(wall_us)], 1);
+}
+/**
+ * @brief 拷贝一份统计快照，各字段单独原子读取
+ *
+ * @param stats
+ */
+void stats_fill(struct ddriver *disk, struct ddriver_stats *stats) {
+    unsigned long long *words = &stats->read_cnt;
+    for (int i = 0; i < STATS_WORDS; i++) {
+        words[i] = STAT_READ(STATS_WORD(disk, i));
+    }
+    stats->version  = DDRIVER_STATS_VERSION;
+    stats->size     = sizeof(struct ddriver_stats);
+    if (stats->flash_host_pages > 0)
+        stats->flash_waf_milli = stats->flash_nand_pages * 1000 / stats->flash_host_pages;
+}
+/**
+ * @brief 清零统计与模型时钟，不影响磁盘内容
+ */
+void stats_reset(struct ddriver *disk) {
+    for (int i = 0; i < STATS_WORDS; i++) {
+        STAT_CLEAR(STATS_WORD(disk, i));
+    }
+    channel_reset_clock(disk);
+    disk->pending_model_us = 0;
+    disk->pending_wall_us  = 0;
+}
+/**
+ * @brief 设备的共享统计页路径
+ *
+ * @param path 设备路径
+ * @param buf
+ * @param len
+ * @return int 0成功，路径过长时-ENAMETOOLONG
+ */
+int stats_mon_path(const char *path, char *buf, size_t len) {
+    int n = snprintf(buf, len, DDRIVER_MON_DIR "/" DDRIVER_MON_PREFIX "%s", path);
+    if (n < 0 || n >= len)
+        return -ENAMETOOLONG;
+    for (char *p = buf + strlen(DDRIVER_MON_DIR) + 1; *p != '\0'; p++) {
+        if (*p == '/')
+            *p = '.';
+    }
+    return 0;
+}
+/**
+ * @brief 建立统计页，失败时退回进程内存，调用者保证设备尚未被其他线程使用
+ *
+ * @param disk
+ * @param shared 是否发布到共享内存
+ * @return int
+ */
+int stats_publish(struct ddriver *disk, int shared) {
+    char mon_path[256];
+    struct ddriver_mon *mon = MAP_FAILED;
+    struct stat st;
+    int fd = -1;
+
+    if (shared && stats_mon_path(disk->path, mon_path, sizeof(mon_path)) == 0)
+        fd = open(mon_path, O_RDWR | O_CREAT, 0600);  /* No O_TRUNC, ddriver-mon may map it */
+    if (fd >= 0) {
+        if (fstat(fd, &st) == 0 &&
+            (st.st_size == sizeof(struct ddriver_mon) ||
+             ftruncate(fd, sizeof(struct ddriver_mon)) == 0))
+            mon = mmap(NULL, sizeof(struct ddriver_mon), PROT_READ | PROT_WRITE, MAP_SHARED,
+                       fd, 0);
+        close(fd);
+        if (mon == MAP_FAILED)
+            unlink(mon_path);
+    }
+    if (mon != MAP_FAILED) {                          /* A page left by an earlier process */
+        __atomic_store_n(&mon->magic, 0, __ATOMIC_RELEASE);
+        memset((char *)mon + sizeof(mon->magic), 0,
+               sizeof(struct ddriver_mon) - sizeof(mon->magic));
+    }
+    if (mon == MAP_FAILED) {
+        if (shared)
+            user_alert("can't publish stats of [%s] in " DDRIVER_MON_DIR, disk->path);
+        mon = (struct ddriver_mon *)calloc(1, sizeof(struct ddriver_mon));
+        if (mon == NULL)
+            return -ENOMEM;
+        shared = 0;
+    }
+    mon->version     = DDRIVER_STATS_VERSION;
+    mon->pid         = getpid();
+    mon->layout_size = disk->layout_size;
+    mon->iounit_size = disk->iounit_size;
+    snprintf(mon->path, sizeof(mon->path), "%s", disk->path);
+    mon->stats.version = DDRIVER_STATS_VERSION;
+    mon->stats.size    = sizeof(struct ddriver_stats);
+    __atomic_store_n(&mon->magic, DDRIVER_MON_MAGIC, __ATOMIC_RELEASE);
+    disk->mon        = mon;
+    disk->mon_shared = shared;
+    disk->stats      = &mon->stats;
+    return 0;
+}
+/**
+ * @brief 删除共享统计页的文件，已映射的页仍可使用；
+ *        页已被同一设备的其他进程接管时不删除
+ *
+ * @param disk
+ */
+void stats_withdraw(struct ddriver *disk) {
+    char mon_path[256];
+
+    if (disk->mon_shared && disk->mon->pid == getpid() &&
+        stats_mon_path(disk->path, mon_path, sizeof(mon_path)) == 0)
+        unlink(mon_path);
+}
+/**
+ * @brief 撤下统计页
+ *
+ * @param disk
+ */
+void stats_unpublish(struct ddriver *disk) {
+    if (!disk->mon_shared) {
+        free(disk->mon);
+        return;
+    }
+    stats_withdraw(disk);
+    munmap(disk->mon, sizeof(struct ddriver_mon));
+}
+/**
+ * @brief 几何参数变化后更新统计页
+ *
+ * @param disk
+ */
+void stats_geometry(struct ddriver *disk) {
+    disk->mon->layout_size = disk->layout_size;
+    disk->mon->iounit_size = disk->iounit_size;
+}
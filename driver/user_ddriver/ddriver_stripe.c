@@ -0,0 +1,351 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <limits.h>
+#include "ddriver_priv.h"
+/******************************************************************************
+* SECTION: Striped backend, RAID-0 over several image files
+*
+* Logical unit u (stripe_unit bytes) lives in image u % stripes at offset
+* (u / stripes) * stripe_unit; image i is <path>.<i>, <path> itself is only
+* kept open as the device fd. A contiguous logical range is contiguous within
+* every image, so a request becomes at most one preadv/pwritev per image.
+* Every image has its own I/O thread; a request touching several images runs
+* them in parallel and completes when the last one is done, a request on a
+* single image runs in the caller.
+*
+* Requests are serialized by disk->lock, so there is at most one request in
+* flight and the per-image work slots need no queue.
+*******************************************************************************/
+#define STRIPE_MAX              64
+
+enum stripe_op
+{
+    STRIPE_READ,
+    STRIPE_WRITE,
+    STRIPE_FLUSH,
+    STRIPE_DISCARD,
+    STRIPE_RESET
+};
+
+struct stripe_set;
+
+struct stripe
+{
+    struct stripe_set *set;
+    int           fd;
+    pthread_t     thread;
+    int           busy;                               /* Work posted, not finished */
+    enum stripe_op op;
+    off_t         offset;                             /* In this image */
+    off_t         size;
+    struct iovec *iov;
+    int           iovcnt;
+    int           iovcap;
+    int           result;
+};
+
+struct stripe_set
+{
+    int             nr;
+    off_t           unit;
+    off_t           image_size;
+    pthread_mutex_t lock;
+    pthread_cond_t  work_cond;
+    pthread_cond_t  done_cond;
+    int             pending;
+    int             stop;
+    struct stripe   stripes[STRIPE_MAX];
+};
+
+#define STRIPE_SET(disk)        ((struct stripe_set *)(disk)->priv)
+
+static int stripe_rw(struct stripe *stripe) {
+    off_t   offset = stripe->offset;
+    ssize_t ret;
+    int     cnt;
+
+    for (int i = 0; i < stripe->iovcnt; i += cnt) {
+        cnt = stripe->iovcnt - i < IOV_MAX ? stripe->iovcnt - i : IOV_MAX;
+        if (stripe->op == STRIPE_READ)
+            ret = preadv(stripe->fd, stripe->iov + i, cnt, offset);
+        else
+            ret = pwritev(stripe->fd, stripe->iov + i, cnt, offset);
+        if (ret != iov_total(stripe->iov + i, cnt))
+            return -EIO;
+        offset += ret;
+    }
+    return 0;
+}
+
+static int stripe_execute(struct stripe_set *set, struct stripe *stripe) {
+    switch (stripe->op)
+    {
+    case STRIPE_READ:
+    case STRIPE_WRITE:
+        return stripe_rw(stripe);
+    case STRIPE_FLUSH:
+        return fsync(stripe->fd) < 0 ? -errno : 0;
+    case STRIPE_DISCARD:
+        return ddriver_punch_hole(stripe->fd, stripe->offset, stripe->size);
+    case STRIPE_RESET:
+        return ddriver_zero_image(stripe->fd, set->image_size);
+    default:
+        return -EINVAL;
+    }
+}
+
+static void *stripe_worker(void *arg) {
+    struct stripe     *stripe = (struct stripe *)arg;
+    struct stripe_set *set    = stripe->set;
+    int res;
+
+    pthread_mutex_lock(&set->lock);
+    for (;;) {
+        while (!set->stop && !stripe->busy) {
+            pthread_cond_wait(&set->work_cond, &set->lock);
+        }
+        if (!stripe->busy) {
+            break;                                    /* Stopped */
+        }
+        pthread_mutex_unlock(&set->lock);
+        res = stripe_execute(set, stripe);
+        pthread_mutex_lock(&set->lock);
+        stripe->result = res;
+        stripe->busy   = 0;
+        if (--set->pending == 0) {
+            pthread_cond_signal(&set->done_cond);
+        }
+    }
+    pthread_mutex_unlock(&set->lock);
+    return NULL;
+}
+/**
+ * @brief 执行各镜像上已准备好的工作(size > 0或op为FLUSH/RESET)，等待全部完成
+ *
+ * @param set
+ * @param op
+ * @return int 0成功，否则为某个镜像的错误码
+ */
+static int stripe_run(struct stripe_set *set, enum stripe_op op) {
+    struct stripe *only = NULL;
+    int active = 0, ret = 0;
+
+    for (int i = 0; i < set->nr; i++) {
+        struct stripe *stripe = &set->stripes[i];
+        stripe->op     = op;
+        stripe->result = 0;
+        if (stripe->size > 0 || op == STRIPE_FLUSH || op == STRIPE_RESET) {
+            only = stripe;
+            active++;
+        }
+    }
+    if (active == 1) {
+        return stripe_execute(set, only);
+    }
+
+    pthread_mutex_lock(&set->lock);
+    for (int i = 0; i < set->nr; i++) {
+        struct stripe *stripe = &set->stripes[i];
+        if (stripe->size > 0 || op == STRIPE_FLUSH || op == STRIPE_RESET) {
+            stripe->busy = 1;
+        }
+    }
+    set->pending = active;
+    pthread_cond_broadcast(&set->work_cond);
+    while (set->pending > 0) {
+        pthread_cond_wait(&set->done_cond, &set->lock);
+    }
+    pthread_mutex_unlock(&set->lock);
+
+    for (int i = 0; i < set->nr; i++) {
+        if (set->stripes[i].result < 0)
+            ret = set->stripes[i].result;
+    }
+    return ret;
+}
+
+static int stripe_push_iov(struct stripe *stripe, void *base, size_t len) {
+    struct iovec *iov;
+    if (stripe->iovcnt == stripe->iovcap) {
+        iov = (struct iovec *)realloc(stripe->iov,
+                                      sizeof(struct iovec) * (stripe->iovcap * 2 + 8));
+        if (iov == NULL)
+            return -ENOMEM;
+        stripe->iov    = iov;
+        stripe->iovcap = stripe->iovcap * 2 + 8;
+    }
+    stripe->iov[stripe->iovcnt].iov_base = base;
+    stripe->iov[stripe->iovcnt].iov_len  = len;
+    stripe->iovcnt++;
+    return 0;
+}
+/**
+ * @brief 把逻辑区间[offset, offset + size)拆到各镜像上，iov非空时同时拆分数据Buf
+ *
+ * @return int
+ */
+static int stripe_map(struct stripe_set *set, off_t offset, off_t size,
+                      const struct iovec *iov, int iovcnt) {
+    struct stripe *stripe;
+    size_t seg_off = 0;
+    off_t  unit, len;
+    int    seg = 0, ret;
+
+    for (int i = 0; i < set->nr; i++) {
+        set->stripes[i].size   = 0;
+        set->stripes[i].iovcnt = 0;
+    }
+    while (size > 0) {
+        unit   = offset / set->unit;
+        stripe = &set->stripes[unit % set->nr];
+        len    = set->unit - offset % set->unit;
+        if (len > size)
+            len = size;
+        if (iov != NULL) {
+            while (seg_off == iov[seg].iov_len) {
+                seg++;
+                seg_off = 0;
+            }
+            if (len > iov[seg].iov_len - seg_off)
+                len = iov[seg].iov_len - seg_off;
+            ret = stripe_push_iov(stripe, (char *)iov[seg].iov_base + seg_off, len);
+            if (ret < 0)
+                return ret;
+            seg_off += len;
+        }
+        if (stripe->size == 0)
+            stripe->offset = (unit / set->nr) * set->unit + offset % set->unit;
+        stripe->size += len;
+        offset       += len;
+        size         -= len;
+    }
+    return 0;
+}
+
+static void stripe_free(struct stripe_set *set) {
+    pthread_mutex_lock(&set->lock);
+    set->stop = 1;
+    pthread_cond_broadcast(&set->work_cond);
+    pthread_mutex_unlock(&set->lock);
+    for (int i = 0; i < set->nr; i++) {
+        struct stripe *stripe = &set->stripes[i];
+        if (stripe->thread)
+            pthread_join(stripe->thread, NULL);
+        if (stripe->fd >= 0)
+            close(stripe->fd);
+        free(stripe->iov);
+    }
+    pthread_mutex_destroy(&set->lock);
+    pthread_cond_destroy(&set->work_cond);
+    pthread_cond_destroy(&set->done_cond);
+    free(set);
+}
+
+static int stripe_open(struct ddriver *disk, const char *path) {
+    struct stripe_set *set;
+    char image[sizeof(disk->path) + 8];
+    off_t rows;
+    int fd;
+
+    if (disk->stripes <= 0 || disk->stripes > STRIPE_MAX ||
+        disk->stripe_unit <= 0 || disk->stripe_unit % disk->iounit_size != 0) {
+        user_panic("stripes %d should be in [1, %d], stripe unit %ld a multiple of %d",
+                   disk->stripes, STRIPE_MAX, disk->stripe_unit, disk->iounit_size);
+        return -EINVAL;
+    }
+    set = (struct stripe_set *)calloc(1, sizeof(struct stripe_set));
+    if (set == NULL)
+        return -ENOMEM;
+    rows            = (disk->layout_size + disk->stripe_unit * disk->stripes - 1) /
+                      (disk->stripe_unit * disk->stripes);
+    set->nr         = disk->stripes;
+    set->unit       = disk->stripe_unit;
+    set->image_size = rows * disk->stripe_unit;
+    pthread_mutex_init(&set->lock, NULL);
+    pthread_cond_init(&set->work_cond, NULL);
+    pthread_cond_init(&set->done_cond, NULL);
+    for (int i = 0; i < set->nr; i++) {
+        set->stripes[i].set = set;
+        set->stripes[i].fd  = -1;
+    }
+
+    for (int i = 0; i < set->nr; i++) {
+        struct stripe *stripe = &set->stripes[i];
+        snprintf(image, sizeof(image), "%s.%d", path, i);
+        fd = ddriver_open_image(image, set->image_size);
+        if (fd < 0) {
+            stripe_free(set);
+            return fd;
+        }
+        stripe->fd = fd;
+        if (pthread_create(&stripe->thread, NULL, stripe_worker, stripe) != 0) {
+            user_panic("can't start stripe worker %d", i);
+            stripe_free(set);
+            return -ENOMEM;
+        }
+    }
+
+    fd = open(path, O_CREAT | O_RDWR, 0644);          /* Device fd, holds no data */
+    if (fd < 0) {
+        fd = -errno;
+        stripe_free(set);
+        return fd;
+    }
+    disk->priv = set;
+    return fd;
+}
+
+static int stripe_close(struct ddriver *disk) {
+    stripe_free(STRIPE_SET(disk));
+    disk->priv = NULL;
+    return close(disk->ddriver_fd);
+}
+
+static int stripe_io(struct ddriver *disk, enum stripe_op op, const struct iovec *iov,
+                     int iovcnt, off_t offset) {
+    size_t size = iov_total(iov, iovcnt);
+    int ret = stripe_map(STRIPE_SET(disk), offset, size, iov, iovcnt);
+    if (ret == 0)
+        ret = stripe_run(STRIPE_SET(disk), op);
+    if (ret < 0) {
+        user_alert("%s error: %s", op == STRIPE_READ ? "read" : "write", strerror(-ret));
+        return -EIO;
+    }
+    return size;
+}
+
+static int stripe_readv(struct ddriver *disk, const struct iovec *iov, int iovcnt,
+                        off_t offset) {
+    return stripe_io(disk, STRIPE_READ, iov, iovcnt, offset);
+}
+
+static int stripe_writev(struct ddriver *disk, const struct iovec *iov, int iovcnt,
+                         off_t offset) {
+    return stripe_io(disk, STRIPE_WRITE, iov, iovcnt, offset);
+}
+
+static int stripe_flush(struct ddriver *disk) {
+    return stripe_run(STRIPE_SET(disk), STRIPE_FLUSH);
+}
+
+static int stripe_reset(struct ddriver *disk) {
+    return stripe_run(STRIPE_SET(disk), STRIPE_RESET);
+}
+
+static int stripe_discard(struct ddriver *disk, off_t offset, off_t size) {
+    int ret = stripe_map(STRIPE_SET(disk), offset, size, NULL, 0);
+    if (ret < 0)
+        return ret;
+    return stripe_run(STRIPE_SET(disk), STRIPE_DISCARD);
+}
+
+const struct ddriver_backend ddriver_stripe_backend = {
+    .name    = "stripe",
+    .open    = stripe_open,
+    .close   = stripe_close,
+    .readv   = stripe_readv,
+    .writev  = stripe_writev,
+    .flush   = stripe_flush,
+    .reset   = stripe_reset,
+    .discard = stripe_discard
+};
@@ -0,0 +1,812 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include "ddriver_priv.h"
+/******************************************************************************
+* SECTION: Thin backend, a sparse image that only stores written clusters
+*
+* Image layout:
+*   0                  struct thin_header, padded to THIN_HEADER_SZ
+*   THIN_HEADER_SZ     block allocation table (BAT), one 32-bit entry per
+*                      thin_cluster bytes of the device: the file cluster
+*                      holding it, 0 if it was never written
+*   data_offset        data clusters, in allocation order
+* A cluster is allocated on its first write, reusing a discarded cluster if
+* there is one and appending to the file otherwise; unallocated clusters read
+* as zero. Data is written before the BAT entries that point to it, so a
+* crash leaves at most an unreferenced cluster, which the next open punches
+* out and reclaims, so a partial write to it later can't expose the data.
+* Discarding a whole cluster frees it and punches it out of the file, reset
+* truncates the image back to its BAT. The image therefore costs what was
+* written, not the device size, and copies as a small file.
+*
+* Growing the device grows the BAT in place: data clusters in its way are
+* moved to the end of the file first. Shrinking keeps the larger BAT.
+*******************************************************************************/
+/******************************************************************************
+* SECTION: Overlays
+*
+* An image whose header names a backing image is an overlay: a cluster that
+* is not in its BAT reads from the backing image, THIN_ZERO marks a cluster
+* discarded on top of it. The backing image is a raw image (base = ... in
+* ddriver.conf, e.g. a populated image of the file backend) or another thin
+* image, and is never written: a partial write to a cluster of the backing
+* image first copies the cluster up.
+*
+* IOC_REQ_DEVICE_SNAPSHOT renames the image to <path>.snap<N>, marks it
+* THIN_SNAPSHOT and starts a new empty overlay on it; IOC_REQ_DEVICE_ROLLBACK
+* empties the top overlay, returning to the last snapshot;
+* IOC_REQ_DEVICE_DROP_OVERLAY also deletes the snapshots, returning to the
+* base image. Each is a rename, a truncate or an unlink, whatever the size of
+* the device or of the changes.
+*******************************************************************************/
+#define THIN_MAGIC              0x4e485444            /* "DTHN" */
+#define THIN_VERSION            1
+#define THIN_HEADER_SZ          4096
+#define THIN_ZERO               0xffffffffu           /* Discarded over a backing image */
+#define THIN_SNAPSHOT           0x1                   /* Frozen by IOC_REQ_DEVICE_SNAPSHOT */
+#define THIN_MAX_DEPTH          32
+
+struct thin_header
+{
+    unsigned int       magic;
+    unsigned int       version;
+    unsigned int       cluster_size;
+    unsigned int       flags;                         /* THIN_SNAPSHOT */
+    unsigned long long layout_size;                   /* Device size the BAT covers */
+    unsigned long long data_offset;
+    char               backing[256];                  /* Image below, empty if none */
+};
+
+struct thin_image
+{
+    int                fd;
+    int                raw;                           /* Backing image without header */
+    off_t              raw_size;
+    struct thin_header header;
+    off_t              cluster;
+    unsigned int       nr_clusters;                   /* Entries in the BAT */
+    unsigned int      *bat;
+    unsigned int      *free;                          /* Discarded file clusters, top only */
+    unsigned int       nr_free;
+    unsigned int       end;                           /* First file cluster past the data */
+    struct thin_image *backing;
+    struct iovec      *iov;                           /* Run of file-contiguous clusters */
+    int                iovcnt;
+    int                iovcap;
+};
+
+#define THIN_IMAGE(disk)        ((struct thin_image *)(disk)->priv)
+#define THIN_BAT_AT(index)      (THIN_HEADER_SZ + (off_t)(index) * sizeof(unsigned int))
+#define THIN_MAPPED(entry)      ((entry) != 0 && (entry) != THIN_ZERO)
+
+static int thin_write_header(struct thin_image *thin) {
+    if (pwrite(thin->fd, &thin->header, sizeof(thin->header), 0) != sizeof(thin->header))
+        return -EIO;
+    return 0;
+}
+
+static int thin_write_bat(struct thin_image *thin, unsigned int first, unsigned int last) {
+    size_t size = sizeof(unsigned int) * (last - first + 1);
+    if (pwrite(thin->fd, thin->bat + first, size, THIN_BAT_AT(first)) != size)
+        return -EIO;
+    return 0;
+}
+/**
+ * @brief 自上而下查找保存第index个簇的镜像
+ *
+ * @param thin
+ * @param index
+ * @param fcluster 返回thin镜像中的文件簇号
+ * @return struct thin_image* 读出为0时返回NULL
+ */
+static struct thin_image *thin_lookup(struct thin_image *thin, unsigned int index,
+                                      unsigned int *fcluster) {
+    for (; thin != NULL; thin = thin->backing) {
+        if (thin->raw)
+            return thin;
+        if (index < thin->nr_clusters && thin->bat[index] != 0) {
+            *fcluster = thin->bat[index];
+            return thin->bat[index] == THIN_ZERO ? NULL : thin;
+        }
+    }
+    return NULL;
+}
+/**
+ * @brief 分配一个文件簇：优先复用被丢弃的簇，否则追加到文件末尾
+ *
+ * @return unsigned int 文件簇号，失败返回0
+ */
+static unsigned int thin_alloc(struct thin_image *thin) {
+    if (thin->nr_free > 0)
+        return thin->free[--thin->nr_free];
+    if (ftruncate(thin->fd, (off_t)(thin->end + 1) * thin->cluster) < 0)
+        return 0;                                     /* The new cluster reads as 0 */
+    return thin->end++;
+}
+/**
+ * @brief 把后备镜像中的第index个簇复制到顶层的fcluster，用于部分写与部分丢弃
+ *
+ * @return int
+ */
+static int thin_copy_up(struct thin_image *thin, unsigned int index, unsigned int fcluster) {
+    struct thin_image *layer;
+    unsigned int from = 0;
+    off_t   at = (off_t)index * thin->cluster;
+    ssize_t ret;
+    char   *buf;
+
+    layer = thin_lookup(thin->backing, index, &from);
+    if (layer == NULL)
+        return 0;                                     /* Zero below, the new cluster is too */
+    buf = (char *)calloc(1, thin->cluster);
+    if (buf == NULL)
+        return -ENOMEM;
+    ret = pread(layer->fd, buf, thin->cluster, layer->raw ? at : (off_t)from * thin->cluster);
+    if (ret < 0 || (!layer->raw && ret != thin->cluster) ||
+        pwrite(thin->fd, buf, thin->cluster, (off_t)fcluster * thin->cluster) != thin->cluster)
+        ret = -EIO;
+    free(buf);
+    return ret < 0 ? ret : 0;
+}
+/**
+ * @brief 为新镜像或扩大后的设备扩展BAT，占据新BAT位置的数据簇先搬到文件末尾
+ *
+ * @param thin
+ * @param nr_clusters 新的BAT项数
+ * @return int
+ */
+static int thin_grow(struct thin_image *thin, unsigned int nr_clusters) {
+    off_t bat_end = THIN_BAT_AT(thin->nr_clusters);
+    off_t data_offset = (THIN_BAT_AT(nr_clusters) + thin->cluster - 1) / thin->cluster *
+                        thin->cluster;
+    unsigned int first = data_offset / thin->cluster, nr_free = 0;
+    unsigned int *bat;
+    char *buf;
+    int ret = 0;
+
+    bat = (unsigned int *)realloc(thin->bat, sizeof(unsigned int) * nr_clusters);
+    if (bat == NULL)
+        return -ENOMEM;
+    memset(bat + thin->nr_clusters, 0,
+           sizeof(unsigned int) * (nr_clusters - thin->nr_clusters));
+    thin->bat = bat;
+
+    buf = (char *)malloc(thin->cluster);
+    if (buf == NULL)
+        return -ENOMEM;
+    if (thin->end < first)
+        thin->end = first;
+    for (unsigned int i = 0; i < thin->nr_clusters && ret == 0; i++) {
+        unsigned int from = thin->bat[i];
+        if (!THIN_MAPPED(from) || from >= first)
+            continue;
+        if (pread(thin->fd, buf, thin->cluster, (off_t)from * thin->cluster) != thin->cluster ||
+            pwrite(thin->fd, buf, thin->cluster, (off_t)thin->end * thin->cluster) != thin->cluster)
+            ret = -EIO;
+        else {
+            thin->bat[i] = thin->end++;
+            ret = thin_write_bat(thin, i, i);
+        }
+    }
+    free(buf);
+    for (unsigned int i = 0; i < thin->nr_free; i++) {
+        if (thin->free[i] >= first)                   /* The rest is BAT now */
+            thin->free[nr_free++] = thin->free[i];
+    }
+    thin->nr_free = nr_free;
+    if (ret == 0 && ftruncate(thin->fd, (off_t)thin->end * thin->cluster) < 0)
+        ret = -errno;
+    if (ret == 0)                                     /* New BAT entries read as 0 */
+        ret = ddriver_punch_hole(thin->fd, bat_end, data_offset - bat_end);
+    if (ret < 0)
+        return ret;
+
+    thin->nr_clusters        = nr_clusters;
+    thin->header.layout_size = (off_t)nr_clusters * thin->cluster;
+    thin->header.data_offset = data_offset;
+    return thin_write_header(thin);
+}
+/**
+ * @brief 读入BAT；顶层镜像还把数据区中没有被引用的簇打洞后作为空闲簇
+ *
+ * @param thin
+ * @param file_size
+ * @return int
+ */
+static int thin_load(struct thin_image *thin, off_t file_size) {
+    size_t bat_size = sizeof(unsigned int) * thin->nr_clusters;
+    unsigned int first = thin->header.data_offset / thin->cluster;
+    unsigned char *used;
+    int ret = 0;
+
+    thin->bat = (unsigned int *)malloc(bat_size);
+    if (thin->bat == NULL)
+        return -ENOMEM;
+    if (pread(thin->fd, thin->bat, bat_size, THIN_HEADER_SZ) != bat_size)
+        return -EIO;
+    thin->end = (file_size + thin->cluster - 1) / thin->cluster;
+    if (thin->end < first)
+        thin->end = first;
+
+    used = (unsigned char *)calloc(thin->end, 1);
+    if (used == NULL)
+        return -ENOMEM;
+    for (unsigned int i = 0; i < thin->nr_clusters; i++) {
+        if (!THIN_MAPPED(thin->bat[i]))
+            continue;
+        if (thin->bat[i] >= thin->end || thin->bat[i] < first) {
+            user_panic("corrupt thin image: cluster %u maps to %u", i, thin->bat[i]);
+            free(used);
+            return -EINVAL;
+        }
+        used[thin->bat[i]] = 1;
+    }
+    for (unsigned int c = first; c < thin->end && thin->free != NULL && ret == 0; c++) {
+        if (used[c])
+            continue;                                 /* Left by a crash, may hold old data */
+        ret = ddriver_punch_hole(thin->fd, (off_t)c * thin->cluster, thin->cluster);
+        if (ret == 0)
+            thin->free[thin->nr_free++] = c;
+    }
+    free(used);
+    return ret;
+}
+
+static void thin_free(struct thin_image *thin) {
+    struct thin_image *backing;
+
+    for (; thin != NULL; thin = backing) {
+        backing = thin->backing;
+        if (thin->fd >= 0)
+            close(thin->fd);
+        free(thin->bat);
+        free(thin->free);
+        free(thin->iov);
+        free(thin);
+    }
+}
+/**
+ * @brief 只读打开一层后备镜像及其下的各层，没有thin文件头的作为原始镜像
+ *
+ * @param path
+ * @param depth
+ * @param out
+ * @return int
+ */
+static int thin_open_backing(const char *path, int depth, struct thin_image **out) {
+    struct thin_image *thin;
+    struct stat st;
+    int ret = 0;
+
+    if (depth > THIN_MAX_DEPTH) {
+        user_panic("more than %d backing images below %s", THIN_MAX_DEPTH, path);
+        return -ELOOP;
+    }
+    thin = (struct thin_image *)calloc(1, sizeof(struct thin_image));
+    if (thin == NULL)
+        return -ENOMEM;
+    thin->fd = open(path, O_RDONLY);
+    if (thin->fd < 0 || fstat(thin->fd, &st) < 0) {
+        ret = -errno;
+        user_panic("can't open backing image %s: %s", path, strerror(-ret));
+        thin_free(thin);
+        return ret;
+    }
+
+    if (pread(thin->fd, &thin->header, sizeof(thin->header), 0) != sizeof(thin->header) ||
+        thin->header.magic != THIN_MAGIC || thin->header.version != THIN_VERSION) {
+        thin->raw      = 1;                           /* Read past its end as 0 */
+        thin->raw_size = st.st_size;
+        *out = thin;
+        return 0;
+    }
+    thin->cluster     = thin->header.cluster_size;
+    thin->nr_clusters = thin->header.layout_size / thin->cluster;
+    ret = thin_load(thin, st.st_size);
+    if (ret == 0 && thin->header.backing[0] != '\0') {
+        ret = thin_open_backing(thin->header.backing, depth + 1, &thin->backing);
+        if (ret == 0 && !thin->backing->raw && thin->backing->cluster != thin->cluster) {
+            user_panic("%s and its backing image differ in cluster size", path);
+            ret = -EINVAL;
+        }
+    }
+    if (ret < 0) {
+        thin_free(thin);
+        return ret;
+    }
+    *out = thin;
+    return 0;
+}
+/**
+ * @brief 在fd上建立一个空的thin镜像，backing非空时作为它的覆盖层
+ *
+ * @return int
+ */
+static int thin_create(struct thin_image *thin, off_t cluster, unsigned int nr_clusters,
+                       const char *backing) {
+    memset(&thin->header, 0, sizeof(thin->header));
+    thin->header.magic        = THIN_MAGIC;
+    thin->header.version      = THIN_VERSION;
+    thin->header.cluster_size = cluster;
+    snprintf(thin->header.backing, sizeof(thin->header.backing), "%s", backing);
+    thin->cluster     = cluster;
+    thin->nr_clusters = 0;
+    thin->nr_free     = 0;
+    thin->end         = 0;
+    return thin_grow(thin, nr_clusters);
+}
+
+static int thin_open(struct ddriver *disk, const char *path) {
+    struct thin_image *thin;
+    struct stat st;
+    unsigned long long nr_clusters;
+    off_t cluster = disk->thin_cluster;
+    int ret = 0, fd;
+
+    if (cluster < 4096 || cluster > (1 << 30) || (cluster & (cluster - 1)) != 0) {
+        user_panic("thin cluster %ld should be a power of 2 in [4K, 1G]", cluster);
+        return -EINVAL;
+    }
+    if (strcmp(disk->base, path) == 0) {
+        user_panic("base image can't be the device image %s", path);
+        return -EINVAL;
+    }
+    thin = (struct thin_image *)calloc(1, sizeof(struct thin_image));
+    if (thin == NULL)
+        return -ENOMEM;
+    thin->fd = open(path, O_CREAT | O_RDWR, 0644);
+    if (thin->fd < 0 || fstat(thin->fd, &st) < 0) {
+        ret = -errno;
+        user_panic("can't open device: %s", strerror(-ret));
+        thin_free(thin);
+        return ret;
+    }
+
+    if (st.st_size == 0) {                            /* New image, on base if configured */
+        snprintf(thin->header.backing, sizeof(thin->header.backing), "%s", disk->base);
+    }
+    else if (pread(thin->fd, &thin->header, sizeof(thin->header), 0) != sizeof(thin->header) ||
+             thin->header.magic != THIN_MAGIC || thin->header.version != THIN_VERSION) {
+        user_panic("%s is not a thin image, remove it or use another backend", path);
+        thin_free(thin);
+        return -EINVAL;
+    }
+    else if (disk->base[0] != '\0' && strcmp(disk->base, thin->header.backing) != 0 &&
+             (thin->header.backing[0] != '\0' || st.st_size > thin->header.data_offset)) {
+        user_alert("%s already has data or overlays %s, base %s ignored", path,
+                   thin->header.backing[0] ? thin->header.backing : "nothing", disk->base);
+    }
+    else if (disk->base[0] != '\0') {
+        snprintf(thin->header.backing, sizeof(thin->header.backing), "%s", disk->base);
+    }
+    if (thin->header.backing[0] != '\0')
+        ret = thin_open_backing(thin->header.backing, 1, &thin->backing);
+    if (ret < 0) {
+        thin_free(thin);
+        return ret;
+    }
+    if (st.st_size == 0 && thin->backing != NULL && !thin->backing->raw)
+        cluster = thin->backing->cluster;             /* Overlay clusters match the thin image below */
+    if (st.st_size != 0)
+        cluster = thin->header.cluster_size;          /* An existing image keeps its own */
+
+    nr_clusters = (disk->layout_size + cluster - 1) / cluster;
+    if (st.st_size != 0 && nr_clusters < thin->header.layout_size / cluster)
+        nr_clusters = thin->header.layout_size / cluster;
+    if (nr_clusters > UINT_MAX / 4) {
+        user_panic("disk size %ld needs a larger thin cluster", disk->layout_size);
+        thin_free(thin);
+        return -EFBIG;
+    }
+    /* Free clusters never outnumber the data clusters present at open or in use later */
+    thin->free = (unsigned int *)malloc(sizeof(unsigned int) *
+                                        (nr_clusters + st.st_size / cluster + 1));
+    if (thin->free == NULL) {
+        thin_free(thin);
+        return -ENOMEM;
+    }
+
+    if (st.st_size == 0) {
+        ret = thin_create(thin, cluster, nr_clusters, disk->base);
+    }
+    else {
+        thin->cluster     = cluster;
+        thin->nr_clusters = thin->header.layout_size / cluster;
+        ret = thin_load(thin, st.st_size);
+        if (ret == 0 && thin->backing != NULL && !thin->backing->raw &&
+            thin->backing->cluster != cluster) {
+            user_panic("%s and its backing image differ in cluster size", path);
+            ret = -EINVAL;
+        }
+        if (ret == 0 && nr_clusters > thin->nr_clusters)
+            ret = thin_grow(thin, nr_clusters);
+        else if (ret == 0)
+            ret = thin_write_header(thin);            /* Records an adopted base */
+    }
+    if (ret < 0) {
+        thin_free(thin);
+        return ret;
+    }
+
+    fd = dup(thin->fd);                               /* Device fd */
+    if (fd < 0) {
+        ret = -errno;
+        thin_free(thin);
+        return ret;
+    }
+    disk->priv = thin;
+    return fd;
+}
+
+static int thin_close(struct ddriver *disk) {
+    thin_free(THIN_IMAGE(disk));
+    disk->priv = NULL;
+    return close(disk->ddriver_fd);
+}
+
+static int thin_push_iov(struct thin_image *thin, void *base, size_t len) {
+    struct iovec *iov;
+    if (thin->iovcnt == thin->iovcap) {
+        iov = (struct iovec *)realloc(thin->iov,
+                                      sizeof(struct iovec) * (thin->iovcap * 2 + 8));
+        if (iov == NULL)
+            return -ENOMEM;
+        thin->iov    = iov;
+        thin->iovcap = thin->iovcap * 2 + 8;
+    }
+    thin->iov[thin->iovcnt].iov_base = base;
+    thin->iov[thin->iovcnt].iov_len  = len;
+    thin->iovcnt++;
+    return 0;
+}
+/**
+ * @brief 把收集到的、在layer文件中连续的一段iov读写完并清空；
+ *        原始后备镜像末尾之后的部分读出为0
+ *
+ * @return int
+ */
+static int thin_run(struct thin_image *thin, enum ddriver_op op, struct thin_image *layer,
+                    off_t offset) {
+    size_t  want, got;
+    ssize_t ret;
+    int     cnt;
+
+    for (int i = 0; i < thin->iovcnt; i += cnt) {
+        cnt  = thin->iovcnt - i < IOV_MAX ? thin->iovcnt - i : IOV_MAX;
+        want = iov_total(thin->iov + i, cnt);
+        if (op == DDRIVER_OP_READ)
+            ret = preadv(layer->fd, thin->iov + i, cnt, offset);
+        else
+            ret = pwritev(layer->fd, thin->iov + i, cnt, offset);
+        if (ret >= 0 && ret < want && layer->raw && op == DDRIVER_OP_READ) {
+            got = ret;                                /* Past the end of a raw image */
+            for (int j = i; j < i + cnt; j++) {
+                size_t n = got < thin->iov[j].iov_len ? got : thin->iov[j].iov_len;
+                memset((char *)thin->iov[j].iov_base + n, 0, thin->iov[j].iov_len - n);
+                got -= n;
+            }
+            ret = want;
+        }
+        if (ret != want) {
+            user_alert("%s error: %s", op == DDRIVER_OP_READ ? "read" : "write",
+                       ret < 0 ? strerror(errno) : "short transfer");
+            return -EIO;
+        }
+        offset += ret;
+    }
+    thin->iovcnt = 0;
+    return 0;
+}
+/**
+ * @brief 写入前保证顶层有第index个簇：新分配的簇若没有被[start, end)整个覆盖，
+ *        先复制后备镜像中的内容
+ *
+ * @return int 新分配返回1
+ */
+static int thin_prepare(struct thin_image *thin, unsigned int index, off_t start, off_t end) {
+    off_t first = (off_t)index * thin->cluster;
+    unsigned int fcluster;
+    int ret;
+
+    if (THIN_MAPPED(thin->bat[index]))
+        return 0;
+    fcluster = thin_alloc(thin);
+    if (fcluster == 0) {
+        user_alert("thin image can't grow: %s", strerror(errno));
+        return -EIO;
+    }
+    if (thin->bat[index] == 0 && (start > first || end < first + thin->cluster) &&
+        (ret = thin_copy_up(thin, index, fcluster)) < 0) {
+        if (ddriver_punch_hole(thin->fd, (off_t)fcluster * thin->cluster, thin->cluster) == 0)
+            thin->free[thin->nr_free++] = fcluster;   /* Else leave it to the next open */
+        return ret;
+    }
+    thin->bat[index] = fcluster;
+    return 1;
+}
+/**
+ * @brief 按簇拆分请求，同一镜像文件中连续的簇合并为一次preadv/pwritev；
+ *        读逐层向下查找，写只写顶层，新的BAT项在数据写完后一次写入
+ *
+ * @return int 传输的字节数
+ */
+static int thin_io(struct ddriver *disk, enum ddriver_op op, const struct iovec *iov,
+                   int iovcnt, off_t offset) {
+    struct thin_image *thin = THIN_IMAGE(disk), *layer, *run = NULL;
+    size_t size = iov_total(iov, iovcnt), seg_off = 0, len;
+    off_t  start = offset, run_at = 0, run_end = -1, at;
+    unsigned int index, fcluster = 0, alloc_first = UINT_MAX, alloc_last = 0;
+    int    seg = 0, ret = 0;
+
+    thin->iovcnt = 0;
+    while (size > 0 && ret >= 0) {
+        index = offset / thin->cluster;
+        len   = thin->cluster - offset % thin->cluster;
+        while (seg_off == iov[seg].iov_len) {
+            seg++;
+            seg_off = 0;
+        }
+        if (len > iov[seg].iov_len - seg_off)
+            len = iov[seg].iov_len - seg_off;
+
+        if (op == DDRIVER_OP_WRITE) {
+            ret = thin_prepare(thin, index, start, start + iov_total(iov, iovcnt));
+            if (ret < 0)
+                break;
+            if (ret > 0) {
+                if (alloc_first == UINT_MAX)
+                    alloc_first = index;
+                alloc_last = index;
+            }
+            layer    = thin;
+            fcluster = thin->bat[index];
+        }
+        else {
+            layer = thin_lookup(thin, index, &fcluster);
+        }
+
+        if (layer == NULL) {                          /* Reads as 0 */
+            memset((char *)iov[seg].iov_base + seg_off, 0, len);
+        }
+        else {
+            at = layer->raw ? offset : (off_t)fcluster * thin->cluster + offset % thin->cluster;
+            if ((layer != run || at != run_end) && thin->iovcnt > 0)
+                ret = thin_run(thin, op, run, run_at);
+            if (thin->iovcnt == 0) {
+                run    = layer;
+                run_at = at;
+            }
+            if (ret >= 0)
+                ret = thin_push_iov(thin, (char *)iov[seg].iov_base + seg_off, len);
+            run_end = at + len;
+        }
+        seg_off += len;
+        offset  += len;
+        size    -= len;
+    }
+    if (ret >= 0 && thin->iovcnt > 0)
+        ret = thin_run(thin, op, run, run_at);
+    if (ret >= 0 && alloc_first != UINT_MAX)
+        ret = thin_write_bat(thin, alloc_first, alloc_last);
+    return ret < 0 ? ret : (int)iov_total(iov, iovcnt);
+}
+
+static int thin_readv(struct ddriver *disk, const struct iovec *iov, int iovcnt,
+                      off_t offset) {
+    return thin_io(disk, DDRIVER_OP_READ, iov, iovcnt, offset);
+}
+
+static int thin_writev(struct ddriver *disk, const struct iovec *iov, int iovcnt,
+                       off_t offset) {
+    return thin_io(disk, DDRIVER_OP_WRITE, iov, iovcnt, offset);
+}
+
+static int thin_flush(struct ddriver *disk) {
+    return fsync(THIN_IMAGE(disk)->fd) < 0 ? -errno : 0;
+}
+/**
+ * @brief 截断到BAT之前再恢复到数据区起点，释放所有数据簇，每个BAT项置为entry
+ *
+ * @param thin
+ * @param entry 0: 露出后备镜像, THIN_ZERO: 读出为0
+ * @return int
+ */
+static int thin_truncate(struct thin_image *thin, unsigned int entry) {
+    off_t data_offset = thin->header.data_offset;
+
+    memset(thin->bat, entry == 0 ? 0 : 0xff, sizeof(unsigned int) * thin->nr_clusters);
+    thin->nr_free = 0;
+    thin->end     = data_offset / thin->cluster;
+    if (ftruncate(thin->fd, THIN_HEADER_SZ) < 0 || ftruncate(thin->fd, data_offset) < 0)
+        return -errno;
+    if (entry != 0 && thin->nr_clusters > 0)
+        return thin_write_bat(thin, 0, thin->nr_clusters - 1);
+    return 0;
+}
+
+static int thin_reset(struct ddriver *disk) {
+    struct thin_image *thin = THIN_IMAGE(disk);
+    return thin_truncate(thin, thin->backing != NULL ? THIN_ZERO : 0);
+}
+/**
+ * @brief 整簇丢弃时释放该簇，有后备镜像时标记为THIN_ZERO；
+ *        部分丢弃时在簇内打洞，簇只在后备镜像中时先复制上来
+ *
+ * @param disk
+ * @param offset
+ * @param size
+ * @return int
+ */
+static int thin_discard(struct ddriver *disk, off_t offset, off_t size) {
+    struct thin_image *thin = THIN_IMAGE(disk);
+    off_t end = offset + size, len;
+    unsigned int index, fcluster, below;
+    int ret;
+
+    for (; offset < end; offset += len) {
+        index = offset / thin->cluster;
+        len   = thin->cluster - offset % thin->cluster;
+        if (len > end - offset)
+            len = end - offset;
+        if (!THIN_MAPPED(thin->bat[index]) &&
+            (thin->bat[index] == THIN_ZERO || thin_lookup(thin->backing, index, &below) == NULL))
+            continue;                                 /* Already reads as 0 */
+
+        if (len < thin->cluster) {
+            ret = thin_prepare(thin, index, offset, offset + len);
+            if (ret < 0 || (ret > 0 && (ret = thin_write_bat(thin, index, index)) < 0))
+                return ret;
+            ret = ddriver_punch_hole(thin->fd, (off_t)thin->bat[index] * thin->cluster +
+                                     offset % thin->cluster, len);
+            if (ret < 0)
+                return ret;
+            continue;
+        }
+        fcluster = thin->bat[index];
+        thin->bat[index] = thin->backing != NULL &&
+                           thin_lookup(thin->backing, index, &below) != NULL ? THIN_ZERO : 0;
+        if ((ret = thin_write_bat(thin, index, index)) < 0)
+            return ret;
+        if (THIN_MAPPED(fcluster)) {
+            ret = ddriver_punch_hole(thin->fd, (off_t)fcluster * thin->cluster, thin->cluster);
+            if (ret < 0)
+                return ret;
+            thin->free[thin->nr_free++] = fcluster;
+        }
+    }
+    return 0;
+}
+/**
+ * @brief 冻结当前镜像：改名为<path>.snap<N>并在其上建立新的空覆盖层
+ *
+ * @param disk
+ * @return int
+ */
+static int thin_snapshot(struct ddriver *disk) {
+    struct thin_image *thin = THIN_IMAGE(disk), *top;
+    char name[sizeof(thin->header.backing)];
+    int  nr = 0, ret;
+
+    for (struct thin_image *layer = thin; layer != NULL; layer = layer->backing) {
+        if (!layer->raw && (layer->header.flags & THIN_SNAPSHOT))
+            nr++;
+    }
+    if (nr + 1 >= THIN_MAX_DEPTH)
+        return -EMLINK;
+    snprintf(name, sizeof(name), "%s.snap%d", disk->path, nr);
+
+    top = (struct thin_image *)calloc(1, sizeof(struct thin_image));
+    if (top == NULL)
+        return -ENOMEM;
+    top->free = (unsigned int *)malloc(sizeof(unsigned int) * (thin->nr_clusters + 1));
+    if (top->free == NULL) {
+        free(top);
+        return -ENOMEM;
+    }
+    thin->header.flags |= THIN_SNAPSHOT;
+    if ((ret = thin_write_header(thin)) < 0 || rename(disk->path, name) < 0) {
+        thin->header.flags &= ~THIN_SNAPSHOT;
+        thin_write_header(thin);
+        free(top->free);
+        free(top);
+        return ret < 0 ? ret : -errno;
+    }
+    top->fd = open(disk->path, O_CREAT | O_TRUNC | O_RDWR, 0644);
+    ret = top->fd < 0 ? -errno : thin_create(top, thin->cluster, thin->nr_clusters, name);
+    if (ret < 0) {
+        if (top->fd >= 0)
+            close(top->fd);
+        rename(name, disk->path);
+        thin->header.flags &= ~THIN_SNAPSHOT;
+        thin_write_header(thin);
+        free(top->bat);
+        free(top->free);
+        free(top);
+        return ret;
+    }
+    free(thin->free);                                 /* Frozen from now on */
+    thin->free    = NULL;
+    thin->nr_free = 0;
+    top->backing  = thin;
+    disk->priv    = top;
+    return 0;
+}
+/**
+ * @brief 闪存模型中取消layer里已分配簇的映射，用于回滚与丢弃覆盖层，调用者需持有设备锁
+ *
+ * @param disk
+ * @param layer
+ */
+static void thin_trim_layer(struct ddriver *disk, struct thin_image *layer) {
+    unsigned int nr = disk->layout_size / layer->cluster, run = 0;
+
+    if (nr > layer->nr_clusters)
+        nr = layer->nr_clusters;
+    for (unsigned int i = 0; i <= nr; i++) {
+        if (i < nr && THIN_MAPPED(layer->bat[i])) {
+            run++;
+            continue;
+        }
+        if (run > 0)                                  /* Contiguous clusters in one call */
+            flash_trim(disk, (off_t)(i - run) * layer->cluster, (off_t)run * layer->cluster);
+        run = 0;
+    }
+}
+/**
+ * @brief 丢弃最近一次快照以来的写入：清空顶层覆盖层
+ *
+ * @param disk
+ * @return int
+ */
+static int thin_rollback(struct ddriver *disk) {
+    thin_trim_layer(disk, THIN_IMAGE(disk));
+    return thin_truncate(THIN_IMAGE(disk), 0);
+}
+/**
+ * @brief 删除所有快照并清空顶层，设备回到base镜像
+ *
+ * @param disk
+ * @return int
+ */
+static int thin_drop_overlay(struct ddriver *disk) {
+    struct thin_image *thin = THIN_IMAGE(disk), *drop = thin->backing, *layer, *next;
+    char name[sizeof(thin->header.backing)];
+    int  ret;
+
+    memcpy(name, thin->header.backing, sizeof(name));
+    thin_trim_layer(disk, thin);
+    for (layer = drop; layer != NULL && !layer->raw && (layer->header.flags & THIN_SNAPSHOT);
+         layer = layer->backing) {
+        memcpy(thin->header.backing, layer->header.backing, sizeof(name));
+        thin_trim_layer(disk, layer);
+    }
+    thin->backing = layer;
+    if ((ret = thin_truncate(thin, 0)) < 0 || (ret = thin_write_header(thin)) < 0)
+        return ret;
+
+    for (; drop != layer; drop = next) {              /* Nothing refers to them any more */
+        if (unlink(name) < 0)
+            user_alert("can't remove snapshot %s: %s", name, strerror(errno));
+        memcpy(name, drop->header.backing, sizeof(name));
+        next = drop->backing;
+        drop->backing = NULL;
+        thin_free(drop);
+    }
+    return 0;
+}
+
+const struct ddriver_backend ddriver_thin_backend = {
+    .name         = "thin",
+    .open         = thin_open,
+    .close        = thin_close,
+    .readv        = thin_readv,
+    .writev       = thin_writev,
+    .flush        = thin_flush,
+    .reset        = thin_reset,
+    .discard      = thin_discard,
+    .snapshot     = thin_snapshot,
+    .rollback     = thin_rollback,
+    .drop_overlay = thin_drop_overlay
+};
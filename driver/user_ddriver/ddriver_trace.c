@@ -0,0 +1,167 @@
+#include <fcntl.h>
+#include <stddef.h>
+#include <sys/syscall.h>
+#include "ddriver_priv.h"
+/******************************************************************************
+* SECTION: Binary I/O trace (trace = <file> in ddriver.conf, off by default)
+*
+* Callers reserve a slot of a power-of-two ring with one atomic
+* compare-and-swap, fill it and publish it by storing its sequence number;
+* nothing on the I/O path takes a lock or touches the file. A writer thread
+* appends published records to the trace file in order. When the ring is
+* full a record is dropped and counted in the header instead of stalling I/O.
+*******************************************************************************/
+#define TRACE_RING_ENTRIES      (1 << 16)
+#define TRACE_DRAIN_US          10000
+
+struct trace_slot
+{
+    struct ddriver_trace_rec rec;
+    unsigned long long       seq;                     /* index + 1 once published */
+};
+
+struct ddriver_trace
+{
+    int                 fd;
+    struct trace_slot  *ring;
+    unsigned long long  head;                         /* Next slot to reserve */
+    unsigned long long  tail;                         /* Next slot to write out */
+    unsigned long long  dropped;
+    unsigned long long  start_us;
+    int                 stop;
+    pthread_t           writer;
+};
+
+static __thread unsigned int trace_tid;
+
+static int trace_drain(struct ddriver_trace *trace) {
+    struct ddriver_trace_rec batch[256];
+    unsigned long long tail = trace->tail;
+    int nr = 0;
+
+    while (nr < 256) {
+        struct trace_slot *slot = &trace->ring[tail & (TRACE_RING_ENTRIES - 1)];
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != tail + 1)
+            break;
+        batch[nr++] = slot->rec;
+        tail++;
+    }
+    if (nr > 0) {
+        if (write(trace->fd, batch, sizeof(struct ddriver_trace_rec) * nr) < 0)
+            STAT_ADD(trace->dropped, nr);
+        __atomic_store_n(&trace->tail, tail, __ATOMIC_RELEASE);
+    }
+    return nr;
+}
+
+static void *trace_writer(void *arg) {
+    struct ddriver_trace *trace = (struct ddriver_trace *)arg;
+
+    while (!__atomic_load_n(&trace->stop, __ATOMIC_ACQUIRE)) {
+        if (trace_drain(trace) == 0)
+            usleep(TRACE_DRAIN_US);
+    }
+    while (trace_drain(trace) > 0)
+        ;
+    return NULL;
+}
+/**
+ * @brief 打开跟踪文件并启动写出线程，调用者需持有设备锁
+ *
+ * @param path
+ * @return int
+ */
+int trace_open(struct ddriver *disk, const char *path) {
+    struct ddriver_trace *trace;
+    struct ddriver_trace_header header = {
+        .magic       = DDRIVER_TRACE_MAGIC,
+        .version     = DDRIVER_TRACE_VERSION,
+        .record_size = sizeof(struct ddriver_trace_rec),
+        .iounit_size = disk->iounit_size,
+        .layout_size = disk->layout_size
+    };
+
+    trace = (struct ddriver_trace *)calloc(1, sizeof(struct ddriver_trace));
+    if (trace == NULL)
+        return -ENOMEM;
+    trace->ring = (struct trace_slot *)calloc(TRACE_RING_ENTRIES, sizeof(struct trace_slot));
+    trace->fd   = open(path, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+    if (trace->ring == NULL || trace->fd < 0 ||
+        write(trace->fd, &header, sizeof(header)) != sizeof(header))
+        goto err_free;
+    trace->start_us = ddriver_wall_us();
+    if (pthread_create(&trace->writer, NULL, trace_writer, trace) != 0)
+        goto err_free;
+    disk->trace = trace;
+    return 0;
+
+err_free:
+    user_panic("can't open trace: %s", path);
+    if (trace->fd >= 0)
+        close(trace->fd);
+    free(trace->ring);
+    free(trace);
+    return -EIO;
+}
+/**
+ * @brief 写出剩余记录，回填丢失数后关闭跟踪文件，调用者需持有设备锁
+ */
+void trace_close(struct ddriver *disk) {
+    struct ddriver_trace *trace = disk->trace;
+    unsigned long long dropped;
+
+    if (trace == NULL)
+        return;
+    disk->trace = NULL;
+    __atomic_store_n(&trace->stop, 1, __ATOMIC_RELEASE);
+    pthread_join(trace->writer, NULL);
+
+    dropped = STAT_READ(trace->dropped);
+    if (pwrite(trace->fd, &dropped, sizeof(dropped),
+               offsetof(struct ddriver_trace_header, dropped)) != sizeof(dropped))
+        user_panic("can't finish trace header");
+    close(trace->fd);
+    free(trace->ring);
+    free(trace);
+}
+/**
+ * @brief 记录一次调用，start为TRACE_START(disk)的返回值，未开启跟踪时为0
+ *
+ * @param disk
+ * @param op
+ * @param offset
+ * @param arg
+ * @param result
+ * @param start
+ */
+void trace_record(struct ddriver *disk, enum ddriver_trace_op op, off_t offset,
+                  unsigned long long arg, int result, unsigned long long start) {
+    struct ddriver_trace *trace = disk->trace;
+    struct trace_slot *slot;
+    unsigned long long idx, now;
+
+    if (trace == NULL || start == 0)
+        return;
+    idx = __atomic_load_n(&trace->head, __ATOMIC_RELAXED);
+    do {
+        if (idx - __atomic_load_n(&trace->tail, __ATOMIC_ACQUIRE) >= TRACE_RING_ENTRIES) {
+            STAT_ADD(trace->dropped, 1);
+            return;
+        }
+    } while (!__atomic_compare_exchange_n(&trace->head, &idx, idx + 1, 1,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    if (trace_tid == 0)
+        trace_tid = syscall(SYS_gettid);
+    now  = ddriver_wall_us();
+    slot = &trace->ring[idx & (TRACE_RING_ENTRIES - 1)];
+    slot->rec.ts_us  = start - trace->start_us;
+    slot->rec.offset = offset;
+    slot->rec.arg    = arg;
+    slot->rec.tid    = trace_tid;
+    slot->rec.lat_us = now - start;
+    slot->rec.op     = op;
+    slot->rec.pad    = 0;
+    slot->rec.result = result;
+    __atomic_store_n(&slot->seq, idx + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,45 @@
+#ifndef _DDRIVER_TRACE_H_
+#define _DDRIVER_TRACE_H_
+/******************************************************************************
+* SECTION: Binary trace format, written by the driver and read by ddriver-replay
+*
+* A trace file is one struct ddriver_trace_header followed by records in
+* completion order. All fields are little-endian as written by the host.
+*******************************************************************************/
+#define DDRIVER_TRACE_MAGIC     0x43525444            /* "DTRC" */
+#define DDRIVER_TRACE_VERSION   1
+
+enum ddriver_trace_op
+{
+    DDRIVER_TRACE_SEEK,                               /* offset: new position */
+    DDRIVER_TRACE_READ,                               /* offset, arg: bytes */
+    DDRIVER_TRACE_WRITE,
+    DDRIVER_TRACE_DISCARD,
+    DDRIVER_TRACE_FLUSH,
+    DDRIVER_TRACE_IOCTL,                              /* arg: ioctl command */
+    DDRIVER_TRACE_OPS
+};
+
+struct ddriver_trace_header
+{
+    unsigned int       magic;
+    unsigned int       version;
+    unsigned int       record_size;                   /* sizeof(struct ddriver_trace_rec) */
+    unsigned int       iounit_size;
+    unsigned long long layout_size;
+    unsigned long long dropped;                       /* Records lost to a full ring */
+};
+
+struct ddriver_trace_rec
+{
+    unsigned long long ts_us;                         /* Call start, us since the trace began */
+    unsigned long long offset;
+    unsigned long long arg;
+    unsigned int       tid;
+    unsigned int       lat_us;                        /* Wall time of the call */
+    unsigned short     op;                            /* enum ddriver_trace_op */
+    unsigned short     pad;
+    int                result;
+};
+
+#endif /* _DDRIVER_TRACE_H_ */
@@ -3,6 +3,50 @@
 
 #include "ddriver_ctl_user.h"
 #include "stdio.h"
+#include <sys/uio.h>
+
+#define DDRIVER_REQ_READ        0                     /* 读请求 */
+#define DDRIVER_REQ_WRITE       1                     /* 写请求 */
+#define DDRIVER_REQ_FLUSH       2                     /* 刷回持久存储(仅异步队列) */
+#define DDRIVER_REQ_DISCARD     3                     /* 丢弃一段内容，之后读出为0(仅异步队列) */
+
+#define DDRIVER_BLK_READ        0x1                   /* ddriver_get_block：内容须为设备上的数据 */
+#define DDRIVER_BLK_WRITE       0x2                   /* ddriver_get_block：将修改内容并以dirty归还 */
+
+/**
+ * @brief 批量提交的块请求，见ddriver_submit
+ */
+struct ddriver_req
+{
+    int    op;                                        /* DDRIVER_REQ_READ / DDRIVER_REQ_WRITE */
+    off_t  offset;                                    /* 起始位置，须与设备IO单位对齐 */
+    char  *buf;                                       /* 数据Buf */
+    size_t size;                                      /* 大小，须为设备IO单位的整数倍 */
+    int    result;                                    /* 完成后回填：传输字节数，小于0失败 */
+};
+
+/**
+ * @brief 异步提交队列项，见ddriver_ring_get_sqe
+ */
+struct ddriver_sqe
+{
+    int    op;                                        /* DDRIVER_REQ_* */
+    off_t  offset;                                    /* 起始位置，须与设备IO单位对齐 */
+    char  *buf;                                       /* 数据Buf，FLUSH/DISCARD不使用 */
+    size_t size;                                      /* 大小，须为设备IO单位的整数倍；FLUSH不使用 */
+    void  *user_data;                                 /* 原样带回完成事件 */
+};
+
+/**
+ * @brief 异步完成事件，见ddriver_ring_reap
+ */
+struct ddriver_cqe
+{
+    void  *user_data;                                 /* 对应SQE的user_data */
+    int    result;                                    /* 传输字节数或0，小于0失败 */
+};
+
+struct ddriver_ring;                                  /* 提交/完成队列，对调用者不透明 */
 
 /**
  * @brief 打开ddriver设备
@@ -18,9 +62,9 @@ int ddriver_open(char *path);
  * @param fd ddriver设备handler
  * @param offset 移动到的位置，注意要和设备IO单位对齐
  * @param whence SEEK_SET即可
- * @return int 0成功，否则失败
+ * @return off_t 移动后的位置(64位)，小于0失败
  */
-int ddriver_seek(int fd, off_t offset, int whence);
+off_t ddriver_seek(int fd, off_t offset, int whence);
 
 /**
  * @brief 写入数据
@@ -42,6 +86,171 @@ int ddriver_write(int fd, char *buf, size_t size);
  */
 int ddriver_read(int fd, char *buf, size_t size);
 
+/**
+ * @brief 从当前磁盘头位置连续读出多块，整个请求只计一次IO延迟
+ * 
+ * @param fd ddriver设备handler
+ * @param iov 分散的读出Buf，每段长度须为设备IO单位的整数倍
+ * @param iovcnt iov段数
+ * @return int 读出的字节数，小于0失败
+ */
+int ddriver_readv(int fd, const struct iovec *iov, int iovcnt);
+
+/**
+ * @brief 从当前磁盘头位置连续写入多块，整个请求只计一次IO延迟
+ * 
+ * @param fd ddriver设备handler
+ * @param iov 分散的写入Buf，每段长度须为设备IO单位的整数倍
+ * @param iovcnt iov段数
+ * @return int 写入的字节数，小于0失败
+ */
+int ddriver_writev(int fd, const struct iovec *iov, int iovcnt);
+
+/**
+ * @brief 从offset处定位读出，不使用也不改变句柄的读写位置，可多线程并发调用
+ * 
+ * @param fd ddriver设备handler
+ * @param buf 要读出的数据Buf
+ * @param size 要读出的数据大小，须为设备IO单位的整数倍
+ * @param offset 起始位置，注意要和设备IO单位对齐
+ * @return int 读出的字节数，小于0失败
+ */
+int ddriver_pread(int fd, char *buf, size_t size, off_t offset);
+
+/**
+ * @brief 从offset处定位写入，不使用也不改变句柄的读写位置，可多线程并发调用
+ * 
+ * @param fd ddriver设备handler
+ * @param buf 要写入的数据Buf
+ * @param size 要写入的数据大小，须为设备IO单位的整数倍
+ * @param offset 起始位置，注意要和设备IO单位对齐
+ * @return int 写入的字节数，小于0失败
+ */
+int ddriver_pwrite(int fd, char *buf, size_t size, off_t offset);
+
+/**
+ * @brief 从offset处连续读出blks个IO单位
+ * 
+ * @param fd ddriver设备handler
+ * @param buf 要读出的数据Buf，大小至少为blks * IO单位
+ * @param blks 块数
+ * @param offset 起始位置，注意要和设备IO单位对齐
+ * @return int 读出的字节数，小于0失败
+ */
+int ddriver_pread_blocks(int fd, char *buf, int blks, off_t offset);
+
+/**
+ * @brief 从offset处连续写入blks个IO单位
+ * 
+ * @param fd ddriver设备handler
+ * @param buf 要写入的数据Buf，大小至少为blks * IO单位
+ * @param blks 块数
+ * @param offset 起始位置，注意要和设备IO单位对齐
+ * @return int 写入的字节数，小于0失败
+ */
+int ddriver_pwrite_blocks(int fd, char *buf, int blks, off_t offset);
+
+/**
+ * @brief 批量提交请求，由设备按调度策略(见IOC_REQ_DEVICE_SCHED)排序、合并后派发，
+ *        相邻的同类请求合并为一次IO，适合一次性刷写大量块
+ * 
+ * @param fd ddriver设备handler
+ * @param reqs 请求数组，完成后每个请求的result被回填
+ * @param nr 请求个数
+ * @return int 成功完成的请求数，小于0失败
+ */
+int ddriver_submit(int fd, struct ddriver_req *reqs, int nr);
+
+/**
+ * @brief 零拷贝访问一个块：返回直接指向设备数据(缓存行或mmap映射)的指针，
+ *        在ddriver_put_block之前一直有效，可就地解析、修改inode/dentry等元数据；
+ *        没有可直接指向的数据时退化为一块对齐的临时Buf
+ * 
+ * @param fd ddriver设备handler
+ * @param offset 块的位置，注意要和设备IO单位对齐
+ * @param flags DDRIVER_BLK_READ读取现有内容(计一次读请求)，DDRIVER_BLK_WRITE将修改内容；
+ *              不带DDRIVER_BLK_READ时内容未定义，适合整块覆盖
+ * @return void* 块指针，失败返回NULL
+ */
+void *ddriver_get_block(int fd, off_t offset, int flags);
+
+/**
+ * @brief 归还ddriver_get_block取得的块，之后不得再访问该指针
+ * 
+ * @param fd ddriver设备handler
+ * @param blk ddriver_get_block的返回值
+ * @param dirty 非0表示内容已被修改，须以DDRIVER_BLK_WRITE取得，计一次写请求
+ * @return int 0成功，否则失败
+ */
+int ddriver_put_block(int fd, void *blk, int dirty);
+
+/**
+ * @brief 零拷贝访问从offset开始的blks个连续块，见ddriver_get_block
+ * 
+ * @param fd ddriver设备handler
+ * @param offset 起始位置，注意要和设备IO单位对齐
+ * @param blks 块数
+ * @param flags DDRIVER_BLK_READ / DDRIVER_BLK_WRITE
+ * @return void* 指向blks个连续块的指针，失败返回NULL
+ */
+void *ddriver_get_range(int fd, off_t offset, int blks, int flags);
+
+/**
+ * @brief 归还ddriver_get_range取得的块，见ddriver_put_block
+ * 
+ * @param fd ddriver设备handler
+ * @param ptr ddriver_get_range的返回值
+ * @param dirty 非0表示内容已被修改
+ * @return int 0成功，否则失败
+ */
+int ddriver_put_range(int fd, void *ptr, int dirty);
+
+/**
+ * @brief 创建异步提交/完成队列及nr_workers个工作线程，
+ *        请求在后台完成，调用者可在等待模拟IO延迟时处理其他工作
+ * 
+ * @param fd ddriver设备handler
+ * @param entries 队列深度，向上取整为2的幂
+ * @param nr_workers 工作线程数
+ * @return struct ddriver_ring* 失败返回NULL
+ */
+struct ddriver_ring *ddriver_ring_setup(int fd, unsigned int entries, int nr_workers);
+
+/**
+ * @brief 取一个空闲的提交队列项，填写后由ddriver_ring_submit提交
+ * 
+ * @param ring 队列
+ * @return struct ddriver_sqe* 未收割的请求达到队列深度时返回NULL
+ */
+struct ddriver_sqe *ddriver_ring_get_sqe(struct ddriver_ring *ring);
+
+/**
+ * @brief 提交所有已填写的提交队列项
+ * 
+ * @param ring 队列
+ * @return int 本次提交的请求数
+ */
+int ddriver_ring_submit(struct ddriver_ring *ring);
+
+/**
+ * @brief 收割完成事件
+ * 
+ * @param ring 队列
+ * @param cqes 完成事件Buf
+ * @param nr cqes容量
+ * @param min_complete 至少等待的完成数，0为不等待
+ * @return int 收割的个数
+ */
+int ddriver_ring_reap(struct ddriver_ring *ring, struct ddriver_cqe *cqes, int nr, int min_complete);
+
+/**
+ * @brief 等待已提交的请求全部完成后销毁队列，须在ddriver_close之前调用
+ * 
+ * @param ring 队列
+ * @return int 0成功，否则失败
+ */
+int ddriver_ring_exit(struct ddriver_ring *ring);
+
 /**
  * @brief ddriver IO控制
  * 
@@ -45,8 +45,9 @@ int   			   newfs_opendir(const char *, struct fuse_file_info *);
 *******************************************************************************/
 char* 			     newfs_get_fname(const char* path);
 int 			     newfs_calc_lvl(const char * path);
-int 			     newfs_driver_read(int offset, uint8_t *out_content, int size);
-int 			     newfs_driver_write(int offset, uint8_t *in_content, int size);
+int 			     newfs_driver_read(off_t offset, uint8_t *out_content, int size);
+int 			     newfs_driver_write(off_t offset, uint8_t *in_content, int size);
+int 			     fillDataMap(off_t offset);
 
 
 int 			     newfs_mount(struct custom_options options);
@@ -51,6 +51,7 @@ struct custom_options {
 * SECTION: Macro Function
 *******************************************************************************/
 #define NEWFS_IO_SZ()                     (newfs_super.sz_io)
+#define NEWFS_DEV_IO_SZ()                 (newfs_super.sz_dev_io)
 #define NEWFS_DISK_SZ()                   (newfs_super.sz_disk)
 #define NEWFS_DRIVER()                    (newfs_super.driver_fd)
 
@@ -60,8 +61,8 @@ struct custom_options {
 #define NEWFS_BLKS_SZ(blks)               (blks * NEWFS_IO_SZ())
 #define NEWFS_ASSIGN_FNAME(psfs_dentry, _fname)\ 
                                         memcpy(psfs_dentry->fname, _fname, strlen(_fname))
-#define NEWFS_INO_OFS(ino)                newfs_super.inode_offset + NEWFS_BLKS_SZ(ino)
-#define NEWFS_DATA_OFS(ino)               newfs_super.data_offset + ino*NEWFS_BLKS_SZ(NEWFS_DATA_PER_FILE)
+#define NEWFS_INO_OFS(ino)                ((off_t)newfs_super.inode_offset + (off_t)NEWFS_BLKS_SZ(ino))
+#define NEWFS_DATA_OFS(ino)               ((off_t)newfs_super.data_offset + (off_t)(ino)*NEWFS_BLKS_SZ(NEWFS_DATA_PER_FILE))
 
 #define NEWFS_IS_DIR(pinode)              (pinode->dentry->ftype == NEWFS_DIR)
 #define NEWFS_IS_REG(pinode)              (pinode->dentry->ftype == NEWFS_REG_FILE)
@@ -79,7 +80,8 @@ struct newfs_super {
     int      driver_fd;
     /* TODO: Define yourself */
     int                sz_io;
-    int                sz_disk;
+    int                sz_dev_io;                 /* 设备块大小，驱动读写按它对齐 */
+    off_t              sz_disk;
     int                sz_usage;
     
     int                max_ino;
@@ -66,25 +66,19 @@ int newfs_alloc_dentry(struct newfs_inode* inode, struct newfs_dentry* dentry) {
  * @param size 
  * @return int 
  */
-int newfs_driver_read(int offset, uint8_t *out_content, int size) {
-    int      offset_aligned = NEWFS_ROUND_DOWN(offset, NEWFS_IO_SZ());
+int newfs_driver_read(off_t offset, uint8_t *out_content, int size) {
+    off_t    offset_aligned = NEWFS_ROUND_DOWN(offset, NEWFS_DEV_IO_SZ());
     int      bias           = offset - offset_aligned;
-    int      size_aligned   = NEWFS_ROUND_UP((size + bias), NEWFS_IO_SZ());
-    uint8_t* temp_content   = (uint8_t*)malloc(size_aligned);
-    uint8_t* cur            = temp_content;
-    // lseek(NEWFS_DRIVER(), offset_aligned, SEEK_SET);
-    ddriver_seek(NEWFS_DRIVER(), offset_aligned, SEEK_SET);
-    while (size_aligned != 0)
-    {
-        // read(NEWFS_DRIVER(), cur, NEWFS_IO_SZ());
-        ddriver_read(NEWFS_DRIVER(), cur, 512);
-        cur          += 512;
-        ddriver_read(NEWFS_DRIVER(), cur, 512);
-        cur          += 512;
-        size_aligned -= NEWFS_IO_SZ();   
+    int      size_aligned   = NEWFS_ROUND_UP((size + bias), NEWFS_DEV_IO_SZ());
+    uint8_t* blocks;
+                                                      /* 直接访问设备数据，一次请求读出全部对齐块 */
+    blocks = (uint8_t *)ddriver_get_range(NEWFS_DRIVER(), offset_aligned, 
+                                          size_aligned / NEWFS_DEV_IO_SZ(), DDRIVER_BLK_READ);
+    if (blocks == NULL) {
+        return -NEWFS_ERROR_IO;
     }
-    memcpy(out_content, temp_content + bias, size);
-    free(temp_content);
+    memcpy(out_content, blocks + bias, size);
+    ddriver_put_range(NEWFS_DRIVER(), blocks, 0);
     return NEWFS_ERROR_NONE;
 }
 
@@ -96,28 +90,26 @@ int newfs_driver_read(int offset, uint8_t *out_content, int size) {
  * @param size 
  * @return int 
  */
-int newfs_driver_write(int offset, uint8_t *in_content, int size) {
-    int      offset_aligned = NEWFS_ROUND_DOWN(offset, NEWFS_IO_SZ());
+int newfs_driver_write(off_t offset, uint8_t *in_content, int size) {
+    off_t    offset_aligned = NEWFS_ROUND_DOWN(offset, NEWFS_DEV_IO_SZ());
     int      bias           = offset - offset_aligned;
-    int      size_aligned   = NEWFS_ROUND_UP((size + bias), NEWFS_IO_SZ());
-    uint8_t* temp_content   = (uint8_t*)malloc(size_aligned);
-    uint8_t* cur            = temp_content;
-    newfs_driver_read(offset_aligned, temp_content, size_aligned);
-    memcpy(temp_content + bias, in_content, size);
-    
-    // lseek(NEWFS_DRIVER(), offset_aligned, SEEK_SET);
-    ddriver_seek(NEWFS_DRIVER(), offset_aligned, SEEK_SET);
-    while (size_aligned != 0)
-    {
-        // write(NEWFS_DRIVER(), cur, NEWFS_IO_SZ());
-        ddriver_write(NEWFS_DRIVER(), cur, 512);
-        cur          += 512;
-        ddriver_write(NEWFS_DRIVER(), cur, 512);
-        cur          += 512;
-        size_aligned -= NEWFS_IO_SZ();   
-    }
+    int      size_aligned   = NEWFS_ROUND_UP((size + bias), NEWFS_DEV_IO_SZ());
+    int      flags          = DDRIVER_BLK_WRITE;
+    uint8_t* blocks;
 
-    free(temp_content);
+    if (bias != 0 || size != size_aligned) {       /* 只有部分覆盖的块才需要先读 */
+        flags |= DDRIVER_BLK_READ;
+    }
+    blocks = (uint8_t *)ddriver_get_range(NEWFS_DRIVER(), offset_aligned, 
+                                          size_aligned / NEWFS_DEV_IO_SZ(), flags);
+    if (blocks == NULL) {
+        return -NEWFS_ERROR_IO;
+    }
+    memcpy(blocks + bias, in_content, size);
+                                                      /* 一次请求写回全部对齐块 */
+    if (ddriver_put_range(NEWFS_DRIVER(), blocks, 1) < 0) {
+        return -NEWFS_ERROR_IO;
+    }
     return NEWFS_ERROR_NONE;
 }
 
@@ -191,7 +183,7 @@ int newfs_sync_inode(struct newfs_inode * inode) {
     memcpy(inode_d.target_path, inode->target_path, NEWFS_MAX_FILE_NAME);
     inode_d.ftype       = inode->dentry->ftype;
     inode_d.dir_cnt     = inode->dir_cnt;
-    int offset;
+    off_t offset;
     
     if (newfs_driver_write(NEWFS_INO_OFS(ino), (uint8_t *)&inode_d, 
                      sizeof(struct newfs_inode_d)) != NEWFS_ERROR_NONE) {
@@ -394,12 +386,12 @@ struct newfs_dentry* newfs_lookup(const char * path, boolean* is_find, boolean*
     return dentry_ret;
 }
 
-int fillDataMap(int offset)
+int fillDataMap(off_t offset)
 {
     int byte_cursor,bit_cursor;
     int data_cursor = 0;
     int is_find_free_entry = FALSE;
-    int relative_offset = offset - newfs_super.data_offset;
+    off_t relative_offset = offset - newfs_super.data_offset;
     int data_map_no = NEWFS_ROUND_UP(relative_offset,NEWFS_IO_SZ())/NEWFS_IO_SZ();
     byte_cursor = data_map_no/8;
     bit_cursor = data_map_no % 8;
@@ -425,6 +417,7 @@ int newfs_mount(struct custom_options options){
     struct newfs_super_d  newfs_super_d; 
     struct newfs_dentry*  root_dentry;
     struct newfs_inode*   root_inode;
+    struct ddriver_geometry geometry;
 
     int                 inode_num;
     int                 map_inode_blks;
@@ -446,9 +439,12 @@ int newfs_mount(struct custom_options options){
 
     //向内存超级块中标记驱动并写入磁盘大小和单次IO大小
     newfs_super.driver_fd = fd;
-    ddriver_ioctl(NEWFS_DRIVER(), IOC_REQ_DEVICE_SIZE,  &newfs_super.sz_disk);
-    // ddriver_ioctl(NEWFS_DRIVER(), IOC_REQ_DEVICE_IO_SZ, &newfs_super.sz_io);
-    newfs_super.sz_io = 1024;
+    if (ddriver_ioctl(NEWFS_DRIVER(), IOC_REQ_DEVICE_GEOMETRY, &geometry) < 0) {
+        return -NEWFS_ERROR_IO;
+    }
+    newfs_super.sz_disk = geometry.layout_size;
+    newfs_super.sz_dev_io = geometry.iounit_size;    /* 驱动读写的对齐单位 */
+    newfs_super.sz_io = 1024;                        /* 文件系统布局的块大小，与设备块无关 */
     
     //创建根目录项并读取磁盘超级块到内存
     root_dentry = new_dentry("/", NEWFS_DIR);
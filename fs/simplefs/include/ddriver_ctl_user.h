@@ -13,9 +13,88 @@ struct ddriver_state
     int seek_cnt;
 };
 
+struct ddriver_geometry
+{
+    unsigned long long layout_size;
+    unsigned int       iounit_size;
+};
+
+struct ddriver_range
+{
+    unsigned long long offset;
+    unsigned long long size;
+};
+
+#define DDRIVER_STATS_VERSION   5
+#define DDRIVER_LAT_BUCKETS     32
+
+struct ddriver_stats
+{
+    unsigned int       version;
+    unsigned int       size;
+    unsigned long long read_cnt;
+    unsigned long long write_cnt;
+    unsigned long long seek_cnt;
+    unsigned long long merge_cnt;
+    unsigned long long read_bytes;
+    unsigned long long write_bytes;
+    unsigned long long seq_cnt;
+    unsigned long long rand_cnt;
+    unsigned long long seek_dist;
+    unsigned long long clock_us;
+    unsigned long long lat_model[2][DDRIVER_LAT_BUCKETS];
+    unsigned long long lat_wall[2][DDRIVER_LAT_BUCKETS];
+    unsigned long long discard_cnt;
+    unsigned long long discard_bytes;
+    unsigned long long cache_hit;
+    unsigned long long cache_miss;
+    unsigned long long cache_writeback;
+    unsigned long long flash_host_pages;
+    unsigned long long flash_nand_pages;
+    unsigned long long flash_gc_pages;
+    unsigned long long flash_erase_cnt;
+    unsigned long long flash_waf_milli;
+    unsigned long long integrity_errors;             /* Blocks that failed their checksum */
+    unsigned long long integrity_bytes;              /* Checksummed on read and write */
+    unsigned long long integrity_ns;                 /* Spent checksumming */
+};
+
+#define DDRIVER_MON_MAGIC       0x6e6f6d64           /* "dmon" */
+#define DDRIVER_MON_DIR         "/dev/shm"
+#define DDRIVER_MON_PREFIX      "ddriver"
+
+/* Live stats page of a user ddriver device, see bin/ddriver-mon */
+struct ddriver_mon
+{
+    unsigned int       magic;                        /* Set once the page is ready */
+    unsigned int       version;                      /* DDRIVER_STATS_VERSION */
+    int                pid;                          /* Process that has the device open */
+    unsigned int       iounit_size;
+    unsigned long long layout_size;
+    long long          inflight;                     /* Requests inside the driver */
+    char               path[128];
+    struct ddriver_stats stats;                      /* Updated in place, never locked */
+};
+
 #define IOC_REQ_DEVICE_SIZE     _IOR(IOC_MAGIC, 0, int)
 #define IOC_REQ_DEVICE_STATE    _IOR(IOC_MAGIC, 1, struct ddriver_state)
 #define IOC_REQ_DEVICE_RESET    _IO(IOC_MAGIC, 2)
 #define IOC_REQ_DEVICE_IO_SZ    _IOR(IOC_MAGIC, 3, int)
+#define IOC_REQ_DEVICE_FLUSH    _IO(IOC_MAGIC, 4)
+#define IOC_REQ_DEVICE_CLOCK    _IOR(IOC_MAGIC, 5, unsigned long long)
+#define IOC_REQ_DEVICE_GEOMETRY _IOR(IOC_MAGIC, 6, struct ddriver_geometry)
+#define IOC_REQ_DEVICE_SET_GEOMETRY _IOW(IOC_MAGIC, 7, struct ddriver_geometry)
+#define IOC_REQ_DEVICE_SCHED    _IOW(IOC_MAGIC, 8, int)
+#define IOC_REQ_DEVICE_STATS    _IO(IOC_MAGIC, 9)
+#define IOC_REQ_DEVICE_RESET_STATS _IO(IOC_MAGIC, 10)
+#define IOC_REQ_DEVICE_DISCARD  _IOW(IOC_MAGIC, 11, struct ddriver_range)
+#define IOC_REQ_DEVICE_SNAPSHOT _IO(IOC_MAGIC, 12)
+#define IOC_REQ_DEVICE_ROLLBACK _IO(IOC_MAGIC, 13)
+#define IOC_REQ_DEVICE_DROP_OVERLAY _IO(IOC_MAGIC, 14)
+
+#define DDRIVER_SCHED_FIFO      0
+#define DDRIVER_SCHED_SCAN      1
+#define DDRIVER_SCHED_CLOOK     2
+#define DDRIVER_SCHED_DEADLINE  3
 
 #endif
\ No newline at end of file
@@ -23,8 +23,11 @@
 *******************************************************************************/
 char* 			   sfs_get_fname(const char* path);
 int 			   sfs_calc_lvl(const char * path);
-int 			   sfs_driver_read(int offset, uint8_t *out_content, int size);
-int 			   sfs_driver_write(int offset, uint8_t *in_content, int size);
+int 			   sfs_driver_read(off_t offset, uint8_t *out_content, int size);
+int 			   sfs_driver_write(off_t offset, uint8_t *in_content, int size);
+int 			   sfs_driver_discard(off_t offset, int size);
+int 			   sfs_batch_add(struct sfs_batch* batch, off_t offset, uint8_t *in_content, int size);
+int 			   sfs_batch_submit(struct sfs_batch* batch);
 
 
 int 			   sfs_mount(struct custom_options options);
@@ -60,7 +60,7 @@ typedef enum sfs_file_type {
 #define SFS_BLKS_SZ(blks)               (blks * SFS_IO_SZ())
 #define SFS_ASSIGN_FNAME(psfs_dentry, _fname)\ 
                                         memcpy(psfs_dentry->fname, _fname, strlen(_fname))
-#define SFS_INO_OFS(ino)                (sfs_super.data_offset + ino * SFS_BLKS_SZ((\
+#define SFS_INO_OFS(ino)                ((off_t)sfs_super.data_offset + (off_t)(ino) * SFS_BLKS_SZ((\
                                         SFS_INODE_PER_FILE + SFS_DATA_PER_FILE)))
 #define SFS_DATA_OFS(ino)               (SFS_INO_OFS(ino) + SFS_BLKS_SZ(SFS_INODE_PER_FILE))
 
@@ -105,7 +105,7 @@ struct sfs_super
     int                driver_fd;
     
     int                sz_io;
-    int                sz_disk;
+    off_t              sz_disk;
     int                sz_usage;
     
     int                max_ino;
@@ -120,6 +120,13 @@ struct sfs_super
     struct sfs_dentry* root_dentry;
 };
 
+struct sfs_batch                                      /* 一次刷写中累积的写请求 */
+{
+    struct ddriver_req* reqs;
+    int                 nr;
+    int                 cap;
+};
+
 static inline struct sfs_dentry* new_dentry(char * fname, SFS_FILE_TYPE ftype) {
     struct sfs_dentry * dentry = (struct sfs_dentry *)malloc(sizeof(struct sfs_dentry));
     memset(dentry, 0, sizeof(struct sfs_dentry));
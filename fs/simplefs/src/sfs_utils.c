@@ -45,23 +45,19 @@ int sfs_calc_lvl(const char * path) {
  * @param size 
  * @return int 
  */
-int sfs_driver_read(int offset, uint8_t *out_content, int size) {
-    int      offset_aligned = SFS_ROUND_DOWN(offset, SFS_IO_SZ());
+int sfs_driver_read(off_t offset, uint8_t *out_content, int size) {
+    off_t    offset_aligned = SFS_ROUND_DOWN(offset, SFS_IO_SZ());
     int      bias           = offset - offset_aligned;
     int      size_aligned   = SFS_ROUND_UP((size + bias), SFS_IO_SZ());
-    uint8_t* temp_content   = (uint8_t*)malloc(size_aligned);
-    uint8_t* cur            = temp_content;
-    // lseek(SFS_DRIVER(), offset_aligned, SEEK_SET);
-    ddriver_seek(SFS_DRIVER(), offset_aligned, SEEK_SET);
-    while (size_aligned != 0)
-    {
-        // read(SFS_DRIVER(), cur, SFS_IO_SZ());
-        ddriver_read(SFS_DRIVER(), cur, SFS_IO_SZ());
-        cur          += SFS_IO_SZ();
-        size_aligned -= SFS_IO_SZ();   
+    uint8_t* blocks;
+                                                      /* 直接访问设备数据，一次请求读出全部对齐块 */
+    blocks = (uint8_t *)ddriver_get_range(SFS_DRIVER(), offset_aligned, 
+                                          size_aligned / SFS_IO_SZ(), DDRIVER_BLK_READ);
+    if (blocks == NULL) {
+        return -SFS_ERROR_IO;
     }
-    memcpy(out_content, temp_content + bias, size);
-    free(temp_content);
+    memcpy(out_content, blocks + bias, size);
+    ddriver_put_range(SFS_DRIVER(), blocks, 0);
     return SFS_ERROR_NONE;
 }
 /**
@@ -72,26 +68,43 @@ int sfs_driver_read(int offset, uint8_t *out_content, int size) {
  * @param size 
  * @return int 
  */
-int sfs_driver_write(int offset, uint8_t *in_content, int size) {
-    int      offset_aligned = SFS_ROUND_DOWN(offset, SFS_IO_SZ());
+int sfs_driver_write(off_t offset, uint8_t *in_content, int size) {
+    off_t    offset_aligned = SFS_ROUND_DOWN(offset, SFS_IO_SZ());
     int      bias           = offset - offset_aligned;
     int      size_aligned   = SFS_ROUND_UP((size + bias), SFS_IO_SZ());
-    uint8_t* temp_content   = (uint8_t*)malloc(size_aligned);
-    uint8_t* cur            = temp_content;
-    sfs_driver_read(offset_aligned, temp_content, size_aligned);
-    memcpy(temp_content + bias, in_content, size);
-    
-    // lseek(SFS_DRIVER(), offset_aligned, SEEK_SET);
-    ddriver_seek(SFS_DRIVER(), offset_aligned, SEEK_SET);
-    while (size_aligned != 0)
-    {
-        // write(SFS_DRIVER(), cur, SFS_IO_SZ());
-        ddriver_write(SFS_DRIVER(), cur, SFS_IO_SZ());
-        cur          += SFS_IO_SZ();
-        size_aligned -= SFS_IO_SZ();   
-    }
+    int      flags          = DDRIVER_BLK_WRITE;
+    uint8_t* blocks;
 
-    free(temp_content);
+    if (bias != 0 || size != size_aligned) {       /* 只有部分覆盖的块才需要先读 */
+        flags |= DDRIVER_BLK_READ;
+    }
+    blocks = (uint8_t *)ddriver_get_range(SFS_DRIVER(), offset_aligned, 
+                                          size_aligned / SFS_IO_SZ(), flags);
+    if (blocks == NULL) {
+        return -SFS_ERROR_IO;
+    }
+    memcpy(blocks + bias, in_content, size);
+                                                      /* 一次请求写回全部对齐块 */
+    if (ddriver_put_range(SFS_DRIVER(), blocks, 1) < 0) {
+        return -SFS_ERROR_IO;
+    }
+    return SFS_ERROR_NONE;
+}
+/**
+ * @brief 驱动丢弃，被释放的块不再占用镜像空间，之后读出为0
+ * 
+ * @param offset 须与IO单位对齐
+ * @param size 
+ * @return int 
+ */
+int sfs_driver_discard(off_t offset, int size) {
+    struct ddriver_range range = {
+        .offset = offset,
+        .size   = SFS_ROUND_UP(size, SFS_IO_SZ())
+    };
+    if (ddriver_ioctl(SFS_DRIVER(), IOC_REQ_DEVICE_DISCARD, &range) < 0) {
+        return -SFS_ERROR_IO;
+    }
     return SFS_ERROR_NONE;
 }
 /**
@@ -197,61 +210,151 @@ struct sfs_inode* sfs_alloc_inode(struct sfs_dentry * dentry) {
     return inode;
 }
 /**
- * @brief 将内存inode及其下方结构全部刷回磁盘
+ * @brief 将一次对齐的整块写加入批量请求，内容被拷贝并补零到块边界
+ * 
+ * @param batch 
+ * @param offset 须与IO单位对齐
+ * @param in_content 
+ * @param size 
+ * @return int 
+ */
+int sfs_batch_add(struct sfs_batch* batch, off_t offset, uint8_t *in_content, int size) {
+    int                 size_aligned = SFS_ROUND_UP(size, SFS_IO_SZ());
+    struct ddriver_req* reqs;
+    uint8_t*            temp_content;
+    int                 cap;
+
+    if (offset % SFS_IO_SZ() != 0) {
+        return -SFS_ERROR_INVAL;
+    }
+    if (batch->nr == batch->cap) {
+        cap  = batch->cap == 0 ? 32 : batch->cap * 2;
+        reqs = (struct ddriver_req*)realloc(batch->reqs, cap * sizeof(struct ddriver_req));
+        if (reqs == NULL) {
+            return -SFS_ERROR_NOSPACE;
+        }
+        batch->reqs = reqs;
+        batch->cap  = cap;
+    }
+    temp_content = (uint8_t*)calloc(1, size_aligned);
+    if (temp_content == NULL) {
+        return -SFS_ERROR_NOSPACE;
+    }
+    memcpy(temp_content, in_content, size);
+
+    batch->reqs[batch->nr].op     = DDRIVER_REQ_WRITE;
+    batch->reqs[batch->nr].offset = offset;
+    batch->reqs[batch->nr].buf    = (char *)temp_content;
+    batch->reqs[batch->nr].size   = size_aligned;
+    batch->nr++;
+    return SFS_ERROR_NONE;
+}
+/**
+ * @brief 一次提交全部请求，由ddriver排序合并后写出，并释放批量请求
+ * 
+ * @param batch 
+ * @return int 
+ */
+int sfs_batch_submit(struct sfs_batch* batch) {
+    int ret = SFS_ERROR_NONE;
+
+    if (batch->nr > 0 && 
+        ddriver_submit(SFS_DRIVER(), batch->reqs, batch->nr) != batch->nr) {
+        ret = -SFS_ERROR_IO;
+    }
+    for (int i = 0; i < batch->nr; i++) {
+        free(batch->reqs[i].buf);
+    }
+    free(batch->reqs);
+    batch->reqs = NULL;
+    batch->nr   = batch->cap = 0;
+    return ret;
+}
+/**
+ * @brief 将inode及其下的目录项、数据与子inode加入批量请求
  * 
  * @param inode 
+ * @param batch 
  * @return int 
  */
-int sfs_sync_inode(struct sfs_inode * inode) {
-    struct sfs_inode_d  inode_d;
-    struct sfs_dentry*  dentry_cursor;
-    struct sfs_dentry_d dentry_d;
+static int sfs_sync_inode_batch(struct sfs_inode * inode, struct sfs_batch* batch) {
+    struct sfs_inode_d   inode_d;
+    struct sfs_dentry*   dentry_cursor;
+    struct sfs_dentry_d* dentrys_d;
     int ino             = inode->ino;
+    int dentry_cnt      = 0;
     inode_d.ino         = ino;
     inode_d.size        = inode->size;
     memcpy(inode_d.target_path, inode->target_path, SFS_MAX_FILE_NAME);
     inode_d.ftype       = inode->dentry->ftype;
     inode_d.dir_cnt     = inode->dir_cnt;
-    int offset;
-    
-    if (sfs_driver_write(SFS_INO_OFS(ino), (uint8_t *)&inode_d, 
-                     sizeof(struct sfs_inode_d)) != SFS_ERROR_NONE) {
+                                                      /* Cycle 1: 写 INODE */
+    if (sfs_batch_add(batch, SFS_INO_OFS(ino), (uint8_t *)&inode_d, 
+                      sizeof(struct sfs_inode_d)) != SFS_ERROR_NONE) {
         SFS_DBG("[%s] io error\n", __func__);
         return -SFS_ERROR_IO;
     }
-                                                      /* Cycle 1: 写 INODE */
                                                       /* Cycle 2: 写 数据 */
-    if (SFS_IS_DIR(inode)) {                          
-        dentry_cursor = inode->dentrys;
-        offset        = SFS_DATA_OFS(ino);
-        while (dentry_cursor != NULL)
-        {
-            memcpy(dentry_d.fname, dentry_cursor->fname, SFS_MAX_FILE_NAME);
-            dentry_d.ftype = dentry_cursor->ftype;
-            dentry_d.ino = dentry_cursor->ino;
-            if (sfs_driver_write(offset, (uint8_t *)&dentry_d, 
-                                 sizeof(struct sfs_dentry_d)) != SFS_ERROR_NONE) {
-                SFS_DBG("[%s] io error\n", __func__);
-                return -SFS_ERROR_IO;                     
-            }
-            
-            if (dentry_cursor->inode != NULL) {
-                sfs_sync_inode(dentry_cursor->inode);
+    if (SFS_IS_DIR(inode)) {
+        for (dentry_cursor = inode->dentrys; dentry_cursor != NULL; 
+             dentry_cursor = dentry_cursor->brother) {
+            dentry_cnt++;
+        }
+        if (dentry_cnt == 0) {
+            return SFS_ERROR_NONE;
+        }
+        dentrys_d = (struct sfs_dentry_d*)calloc(dentry_cnt, sizeof(struct sfs_dentry_d));
+        if (dentrys_d == NULL) {
+            return -SFS_ERROR_NOSPACE;
+        }
+        dentry_cnt = 0;
+        for (dentry_cursor = inode->dentrys; dentry_cursor != NULL; 
+             dentry_cursor = dentry_cursor->brother) {
+            memcpy(dentrys_d[dentry_cnt].fname, dentry_cursor->fname, SFS_MAX_FILE_NAME);
+            dentrys_d[dentry_cnt].ftype = dentry_cursor->ftype;
+            dentrys_d[dentry_cnt].ino   = dentry_cursor->ino;
+            dentry_cnt++;
+        }
+        if (sfs_batch_add(batch, SFS_DATA_OFS(ino), (uint8_t *)dentrys_d, 
+                          dentry_cnt * sizeof(struct sfs_dentry_d)) != SFS_ERROR_NONE) {
+            SFS_DBG("[%s] io error\n", __func__);
+            free(dentrys_d);
+            return -SFS_ERROR_IO;
+        }
+        free(dentrys_d);
+                                                      /* Cycle 3: 递归子节点 */
+        for (dentry_cursor = inode->dentrys; dentry_cursor != NULL; 
+             dentry_cursor = dentry_cursor->brother) {
+            if (dentry_cursor->inode != NULL && 
+                sfs_sync_inode_batch(dentry_cursor->inode, batch) != SFS_ERROR_NONE) {
+                return -SFS_ERROR_IO;
             }
-
-            dentry_cursor = dentry_cursor->brother;
-            offset += sizeof(struct sfs_dentry_d);
         }
     }
     else if (SFS_IS_REG(inode)) {
-        if (sfs_driver_write(SFS_DATA_OFS(ino), inode->data, 
-                             SFS_BLKS_SZ(SFS_DATA_PER_FILE)) != SFS_ERROR_NONE) {
+        if (sfs_batch_add(batch, SFS_DATA_OFS(ino), inode->data, 
+                          SFS_BLKS_SZ(SFS_DATA_PER_FILE)) != SFS_ERROR_NONE) {
             SFS_DBG("[%s] io error\n", __func__);
             return -SFS_ERROR_IO;
         }
     }
     return SFS_ERROR_NONE;
 }
+/**
+ * @brief 将内存inode及其下方结构全部刷回磁盘
+ *   整棵子树的块写先收集为一批，再一次提交给ddriver排序合并
+ * @param inode 
+ * @return int 
+ */
+int sfs_sync_inode(struct sfs_inode * inode) {
+    struct sfs_batch batch = { .reqs = NULL, .nr = 0, .cap = 0 };
+    int ret = sfs_sync_inode_batch(inode, &batch);
+    if (ret != SFS_ERROR_NONE) {
+        sfs_batch_submit(&batch);
+        return ret;
+    }
+    return sfs_batch_submit(&batch);
+}
 /**
  * @brief 删除内存中的一个inode， 暂时不释放
  * Case 1: Reg File
@@ -322,6 +425,12 @@ int sfs_drop_inode(struct sfs_inode * inode) {
             if (is_find == TRUE) {
                 break;
             }
+        }
+                                                      /* 释放的inode与数据块交给设备丢弃 */
+        if (sfs_driver_discard(SFS_INO_OFS(inode->ino), 
+                               SFS_BLKS_SZ((SFS_INODE_PER_FILE + SFS_DATA_PER_FILE))) 
+            != SFS_ERROR_NONE) {
+            SFS_DBG("[%s] discard error\n", __func__);
         }
         if (inode->data)
             free(inode->data);
@@ -499,6 +608,7 @@ int sfs_mount(struct custom_options options){
     struct sfs_super_d  sfs_super_d; 
     struct sfs_dentry*  root_dentry;
     struct sfs_inode*   root_inode;
+    struct ddriver_geometry geometry;
 
     int                 inode_num;
     int                 map_inode_blks;
@@ -516,8 +626,11 @@ int sfs_mount(struct custom_options options){
     }
 
     sfs_super.driver_fd = driver_fd;
-    ddriver_ioctl(SFS_DRIVER(), IOC_REQ_DEVICE_SIZE,  &sfs_super.sz_disk);
-    ddriver_ioctl(SFS_DRIVER(), IOC_REQ_DEVICE_IO_SZ, &sfs_super.sz_io);
+    if (ddriver_ioctl(SFS_DRIVER(), IOC_REQ_DEVICE_GEOMETRY, &geometry) < 0) {
+        return -SFS_ERROR_IO;
+    }
+    sfs_super.sz_disk   = geometry.layout_size;       /* 64位设备大小，支持大于2G的镜像 */
+    sfs_super.sz_io     = geometry.iounit_size;
     
     root_dentry = new_dentry("/", SFS_DIR);
 
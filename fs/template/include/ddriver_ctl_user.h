@@ -13,9 +13,87 @@ struct ddriver_state
     int seek_cnt;
 };
 
+struct ddriver_geometry
+{
+    unsigned long long layout_size;                   /* 设备大小(字节) */
+    unsigned int       iounit_size;                   /* 设备IO单位(字节) */
+};
+
+struct ddriver_range
+{
+    unsigned long long offset;                        /* 起始位置(字节)，须与设备IO单位对齐 */
+    unsigned long long size;                          /* 长度(字节)，须为设备IO单位的整数倍 */
+};
+
+#define DDRIVER_STATS_VERSION   5                     /* ddriver_stats只在末尾追加字段，追加时版本加1 */
+#define DDRIVER_LAT_BUCKETS     32                    /* 延迟直方图桶数，第i桶为[2^i, 2^(i+1)) us，第0桶含0 */
+
+struct ddriver_stats
+{
+    unsigned int       version;                       /* 返回：驱动填写的版本 */
+    unsigned int       size;                          /* 传入：调用者的sizeof(struct ddriver_stats)；返回：实际填写的字节数 */
+    unsigned long long read_cnt;
+    unsigned long long write_cnt;
+    unsigned long long seek_cnt;
+    unsigned long long merge_cnt;                     /* 被合并进相邻请求的请求数 */
+    unsigned long long read_bytes;
+    unsigned long long write_bytes;
+    unsigned long long seq_cnt;                       /* 紧接上一个请求结尾的请求数 */
+    unsigned long long rand_cnt;                      /* 其余请求数 */
+    unsigned long long seek_dist;                     /* 磁盘头累计移动距离(字节) */
+    unsigned long long clock_us;                      /* 设备模型时钟(us) */
+    unsigned long long lat_model[2][DDRIVER_LAT_BUCKETS]; /* [读/写]模型延迟直方图，含之前的寻道 */
+    unsigned long long lat_wall[2][DDRIVER_LAT_BUCKETS];  /* [读/写]实际耗时直方图 */
+    unsigned long long discard_cnt;                   /* 以下为版本2追加 */
+    unsigned long long discard_bytes;
+    unsigned long long cache_hit;                     /* 以下为版本3追加：块缓存命中的块数 */
+    unsigned long long cache_miss;                    /* 块缓存未命中的块数 */
+    unsigned long long cache_writeback;               /* 写回设备的脏块数 */
+    unsigned long long flash_host_pages;              /* 以下为版本4追加，仅model = flash：主机写入的闪存页数 */
+    unsigned long long flash_nand_pages;              /* 实际编程的闪存页数，含垃圾回收的搬移 */
+    unsigned long long flash_gc_pages;                /* 垃圾回收搬移的有效页数 */
+    unsigned long long flash_erase_cnt;               /* 擦除块次数 */
+    unsigned long long flash_waf_milli;               /* 写放大系数 x 1000，即flash_nand_pages * 1000 / flash_host_pages */
+    unsigned long long integrity_errors;              /* 以下为版本5追加，仅integrity开启时：校验失败的块数 */
+    unsigned long long integrity_bytes;               /* 读写时校验过的字节数 */
+    unsigned long long integrity_ns;                  /* 校验耗时(ns) */
+};
+
+#define DDRIVER_MON_MAGIC       0x6e6f6d64            /* "dmon"，页面就绪后才写入 */
+#define DDRIVER_MON_DIR         "/dev/shm"            /* 实时统计页所在目录 */
+#define DDRIVER_MON_PREFIX      "ddriver"             /* 页面名为 ddriver.<设备路径，'/'换成'.'> */
+
+struct ddriver_mon                                    /* 用户态ddriver设备的实时统计页，见 bin/ddriver-mon */
+{
+    unsigned int       magic;                         /* DDRIVER_MON_MAGIC，页面就绪后才写入 */
+    unsigned int       version;                       /* DDRIVER_STATS_VERSION */
+    int                pid;                           /* 打开设备的进程 */
+    unsigned int       iounit_size;                   /* 设备IO单位(字节) */
+    unsigned long long layout_size;                   /* 设备大小(字节) */
+    long long          inflight;                      /* 驱动内的在途请求数 */
+    char               path[128];                     /* 设备路径 */
+    struct ddriver_stats stats;                       /* 原地更新，不加锁 */
+};
+
 #define IOC_REQ_DEVICE_SIZE     _IOR(IOC_MAGIC, 0, int)                     /* 请求查看设备大小 */
 #define IOC_REQ_DEVICE_STATE    _IOR(IOC_MAGIC, 1, struct ddriver_state)    /* 请求设备状态，返回 ddriver_state */
 #define IOC_REQ_DEVICE_RESET    _IO(IOC_MAGIC, 2)                           /* 请求重置设备 */
 #define IOC_REQ_DEVICE_IO_SZ    _IOR(IOC_MAGIC, 3, int)                     /* 请求设备IO大小 */
+#define IOC_REQ_DEVICE_FLUSH    _IO(IOC_MAGIC, 4)                           /* 写回缓存中的脏块并刷回持久存储 */
+#define IOC_REQ_DEVICE_CLOCK    _IOR(IOC_MAGIC, 5, unsigned long long)      /* 请求设备模型时钟(us)，即累计的模拟IO耗时 */
+#define IOC_REQ_DEVICE_GEOMETRY _IOR(IOC_MAGIC, 6, struct ddriver_geometry) /* 请求设备几何参数(64位大小)，返回 ddriver_geometry */
+#define IOC_REQ_DEVICE_SET_GEOMETRY _IOW(IOC_MAGIC, 7, struct ddriver_geometry) /* 按 ddriver_geometry 重新设定设备大小与IO单位 */
+#define IOC_REQ_DEVICE_SCHED    _IOW(IOC_MAGIC, 8, int)                     /* 设定ddriver_submit的调度策略，取值 DDRIVER_SCHED_* */
+#define IOC_REQ_DEVICE_STATS    _IO(IOC_MAGIC, 9)                           /* 请求扩展统计，调用前填写size，返回 ddriver_stats；命令号不含结构大小，新旧版本靠size与version兼容 */
+#define IOC_REQ_DEVICE_RESET_STATS _IO(IOC_MAGIC, 10)                       /* 只清零统计与模型时钟，不清除磁盘内容 */
+#define IOC_REQ_DEVICE_DISCARD  _IOW(IOC_MAGIC, 11, struct ddriver_range)   /* 丢弃 ddriver_range 指定的一段，之后读出为0且不占用镜像空间 */
+#define IOC_REQ_DEVICE_SNAPSHOT _IO(IOC_MAGIC, 12)                          /* thin后端：冻结当前内容，之后的写入进入新的覆盖层 */
+#define IOC_REQ_DEVICE_ROLLBACK _IO(IOC_MAGIC, 13)                          /* thin后端：丢弃最近一次快照以来的写入 */
+#define IOC_REQ_DEVICE_DROP_OVERLAY _IO(IOC_MAGIC, 14)                      /* thin后端：丢弃所有快照与写入，回到base镜像 */
+
+#define DDRIVER_SCHED_FIFO      0                     /* 按到达顺序 */
+#define DDRIVER_SCHED_SCAN      1                     /* 电梯算法，扫到磁盘边缘再折返 */
+#define DDRIVER_SCHED_CLOOK     2                     /* 单向扫描，到最后一个请求后回绕(缺省) */
+#define DDRIVER_SCHED_DEADLINE  3                     /* C-LOOK，但超时请求优先(读50ms/写500ms模型时间) */
 
 #endif
\ No newline at end of file
@@ -3,11 +3,62 @@
 
 #include "ddriver_ctl_user.h"
 #include "stdio.h"
+#include <sys/uio.h>
+
+#define DDRIVER_REQ_READ        0
+#define DDRIVER_REQ_WRITE       1
+#define DDRIVER_REQ_FLUSH       2
+#define DDRIVER_REQ_DISCARD     3
+
+#define DDRIVER_BLK_READ        0x1
+#define DDRIVER_BLK_WRITE       0x2
+
+struct ddriver_req
+{
+    int    op;
+    off_t  offset;
+    char  *buf;
+    size_t size;
+    int    result;
+};
+
+struct ddriver_sqe
+{
+    int    op;
+    off_t  offset;
+    char  *buf;
+    size_t size;
+    void  *user_data;
+};
+
+struct ddriver_cqe
+{
+    void  *user_data;
+    int    result;
+};
+
+struct ddriver_ring;
 
 int ddriver_open(char *path);
-int ddriver_seek(int fd, off_t offset, int whence);
+off_t ddriver_seek(int fd, off_t offset, int whence);
 int ddriver_write(int fd, char *buf, size_t size);
 int ddriver_read(int fd, char *buf, size_t size);
+int ddriver_readv(int fd, const struct iovec *iov, int iovcnt);
+int ddriver_writev(int fd, const struct iovec *iov, int iovcnt);
+int ddriver_pread(int fd, char *buf, size_t size, off_t offset);
+int ddriver_pwrite(int fd, char *buf, size_t size, off_t offset);
+int ddriver_pread_blocks(int fd, char *buf, int blks, off_t offset);
+int ddriver_pwrite_blocks(int fd, char *buf, int blks, off_t offset);
+int ddriver_submit(int fd, struct ddriver_req *reqs, int nr);
+void *ddriver_get_block(int fd, off_t offset, int flags);
+int ddriver_put_block(int fd, void *blk, int dirty);
+void *ddriver_get_range(int fd, off_t offset, int blks, int flags);
+int ddriver_put_range(int fd, void *ptr, int dirty);
+struct ddriver_ring *ddriver_ring_setup(int fd, unsigned int entries, int nr_workers);
+struct ddriver_sqe *ddriver_ring_get_sqe(struct ddriver_ring *ring);
+int ddriver_ring_submit(struct ddriver_ring *ring);
+int ddriver_ring_reap(struct ddriver_ring *ring, struct ddriver_cqe *cqes, int nr, int min_complete);
+int ddriver_ring_exit(struct ddriver_ring *ring);
 int ddriver_ioctl(int fd, unsigned long cmd, void *ret);
 int ddriver_close(int fd);
 
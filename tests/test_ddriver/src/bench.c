@@ -0,0 +1,553 @@
+#include "../include/ddriver.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <pwd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+/******************************************************************************
+* SECTION: ddriver-bench, an fio-style benchmark for the user and kernel ddriver
+*
+* Every thread opens its own handle and keeps iodepth requests in flight:
+* one at a time with pread/pwrite, or through a ddriver_ring of iodepth
+* entries when iodepth > 1. Random offsets are uniform over the tested span,
+* sequential threads each walk their own slice of it. Latencies go into
+* log-linear histograms (BENCH_SUB_BITS sub-buckets per power of two, so
+* percentiles are within ~3%), merged at the end.
+*
+* The kernel ddriver (/dev/ddriver) is opened exclusively, so it is driven
+* by one thread at iodepth 1 with lseek + read/write. Modules built before
+* multi-block transfers reject anything but one block with -EIO; requests
+* are then split into blocks.
+*
+* With integrity = on the user ddriver times its own checksumming
+* (integrity_ns in struct ddriver_stats), and the report shows that share
+* on its own line, so the cost of the checksums is known apart from the
+* rest of the run.
+*******************************************************************************/
+#define BENCH_SUB_BITS          5
+#define BENCH_BUCKETS           ((64 - BENCH_SUB_BITS + 1) << BENCH_SUB_BITS)
+#define BENCH_MAX_THREADS       64
+#define BENCH_MAX_DEPTH         256
+#define BENCH_READ              0
+#define BENCH_WRITE             1
+
+struct bench_stat
+{
+    unsigned long long ios;
+    unsigned long long bytes;
+    unsigned long long lat_sum;                       /* ns */
+    unsigned long long lat_max;
+    unsigned long long hist[BENCH_BUCKETS];
+};
+
+struct bench_thread
+{
+    int                id;
+    pthread_t          thread;
+    unsigned int       seed;
+    off_t              start;                         /* Slice of a sequential thread */
+    off_t              size;
+    off_t              pos;
+    int                errors;
+    struct bench_stat  stat[2];
+};
+
+struct bench_slot
+{
+    char              *buf;
+    int                op;
+    unsigned long long start;
+};
+
+static struct
+{
+    int                kernel;
+    char               device[128];
+    int                random;
+    int                rwmix;                         /* Percent reads */
+    const char        *rw;
+    size_t             bs;
+    int                iodepth;
+    int                threads;
+    double             runtime;                       /* Seconds */
+    unsigned long long ios;                           /* 0: no limit */
+    off_t              span;
+    int                json;
+} opts = {
+    .rw       = "randread",
+    .rwmix    = 50,
+    .iodepth  = 1,
+    .threads  = 1,
+    .runtime  = 10
+};
+
+static unsigned long long bench_start, bench_deadline, bench_issued;
+static int kernel_fd = -1, iounit;
+static size_t kernel_chunk;
+
+static unsigned long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int parse_size(const char *str, unsigned long long *size) {
+    char *end;
+    unsigned long long val = strtoull(str, &end, 10);
+
+    switch (*end)
+    {
+    case 'k': case 'K': val <<= 10; end++; break;
+    case 'm': case 'M': val <<= 20; end++; break;
+    case 'g': case 'G': val <<= 30; end++; break;
+    default: break;
+    }
+    if (end == str || *end != '\0')
+        return -EINVAL;
+    *size = val;
+    return 0;
+}
+/******************************************************************************
+* SECTION: Latency histogram
+*******************************************************************************/
+static int hist_index(unsigned long long ns) {
+    int msb;
+    if (ns < (1ULL << BENCH_SUB_BITS))
+        return ns;
+    msb = 63 - __builtin_clzll(ns);
+    return ((msb - BENCH_SUB_BITS + 1) << BENCH_SUB_BITS) +
+           ((ns >> (msb - BENCH_SUB_BITS)) & ((1 << BENCH_SUB_BITS) - 1));
+}
+
+static unsigned long long hist_value(int index) {
+    int msb, sub;
+    if (index < (1 << BENCH_SUB_BITS))
+        return index;
+    msb = (index >> BENCH_SUB_BITS) + BENCH_SUB_BITS - 1;
+    sub = index & ((1 << BENCH_SUB_BITS) - 1);
+    return (1ULL << msb) + ((unsigned long long)sub << (msb - BENCH_SUB_BITS)) +
+           (1ULL << (msb - BENCH_SUB_BITS)) / 2;      /* Middle of the bucket */
+}
+
+static double hist_percentile(const struct bench_stat *stat, double p) {
+    unsigned long long target = stat->ios * p, seen = 0;
+    if (target >= stat->ios)
+        target = stat->ios - 1;
+    for (int i = 0; i < BENCH_BUCKETS; i++) {
+        seen += stat->hist[i];
+        if (seen > target)
+            return hist_value(i) / 1000.0;
+    }
+    return stat->lat_max / 1000.0;
+}
+
+static void stat_account(struct bench_stat *stat, unsigned long long ns, size_t bytes) {
+    stat->ios++;
+    stat->bytes   += bytes;
+    stat->lat_sum += ns;
+    if (ns > stat->lat_max)
+        stat->lat_max = ns;
+    stat->hist[hist_index(ns)]++;
+}
+
+static void stat_merge(struct bench_stat *to, const struct bench_stat *from) {
+    to->ios     += from->ios;
+    to->bytes   += from->bytes;
+    to->lat_sum += from->lat_sum;
+    if (from->lat_max > to->lat_max)
+        to->lat_max = from->lat_max;
+    for (int i = 0; i < BENCH_BUCKETS; i++)
+        to->hist[i] += from->hist[i];
+}
+/******************************************************************************
+* SECTION: Device access
+*******************************************************************************/
+static int kernel_io(int op, char *buf, size_t size, off_t offset) {
+    size_t  done = 0, len;
+    ssize_t ret;
+
+    if (lseek(kernel_fd, offset, SEEK_SET) < 0)
+        return -errno;
+    while (done < size) {
+        len = size - done < kernel_chunk ? size - done : kernel_chunk;
+        ret = op == BENCH_READ ? read(kernel_fd, buf + done, len)
+                               : write(kernel_fd, buf + done, len);
+        if (ret < 0 && (errno == EIO || errno == EINVAL) && len > (size_t)iounit) {
+            kernel_chunk = iounit;                    /* One block per call only */
+            continue;
+        }
+        if (ret <= 0)
+            return ret < 0 ? -errno : -EIO;
+        done += ret;
+    }
+    return size;
+}
+
+static int device_io(int fd, int op, char *buf, size_t size, off_t offset) {
+    if (opts.kernel)
+        return kernel_io(op, buf, size, offset);
+    return op == BENCH_READ ? ddriver_pread(fd, buf, size, offset)
+                            : ddriver_pwrite(fd, buf, size, offset);
+}
+
+static int device_open(void) {
+    int fd;
+    if (!opts.kernel)
+        return ddriver_open(opts.device);
+    fd = open(opts.device, O_RDWR);
+    return fd < 0 ? -errno : fd;
+}
+
+static void device_close(int fd) {
+    if (opts.kernel)
+        close(fd);
+    else
+        ddriver_close(fd);
+}
+/******************************************************************************
+* SECTION: Workload
+*******************************************************************************/
+static int bench_next(struct bench_thread *bt, off_t *offset) {
+    unsigned long long blocks = bt->size / opts.bs, r;
+
+    if (opts.random) {
+        r = ((unsigned long long)rand_r(&bt->seed) << 31) ^ rand_r(&bt->seed);
+        *offset = bt->start + (off_t)(r % blocks) * opts.bs;
+    }
+    else {
+        if (bt->pos + (off_t)opts.bs > bt->start + bt->size)
+            bt->pos = bt->start;
+        *offset  = bt->pos;
+        bt->pos += opts.bs;
+    }
+    return rand_r(&bt->seed) % 100 < opts.rwmix ? BENCH_READ : BENCH_WRITE;
+}
+
+static int bench_more(void) {
+    if (now_ns() >= bench_deadline)
+        return 0;
+    return opts.ios == 0 || __atomic_fetch_add(&bench_issued, 1, __ATOMIC_RELAXED) < opts.ios;
+}
+
+static void bench_sync(struct bench_thread *bt, int fd, char *buf) {
+    unsigned long long t0;
+    off_t offset;
+    int   op, ret;
+
+    while (bench_more()) {
+        op  = bench_next(bt, &offset);
+        t0  = now_ns();
+        ret = device_io(fd, op, buf, opts.bs, offset);
+        if (ret != (int)opts.bs)
+            bt->errors++;
+        else
+            stat_account(&bt->stat[op], now_ns() - t0, opts.bs);
+    }
+}
+
+static void bench_ring(struct bench_thread *bt, int fd, struct bench_slot *slots) {
+    struct ddriver_ring *ring = ddriver_ring_setup(fd, opts.iodepth, opts.iodepth);
+    struct bench_slot   *free_slots[BENCH_MAX_DEPTH], *slot;
+    struct ddriver_cqe   cqes[BENCH_MAX_DEPTH];
+    struct ddriver_sqe  *sqe;
+    unsigned long long   t;
+    off_t offset;
+    int   nr_free = opts.iodepth, inflight = 0, more = 1, n;
+
+    if (ring == NULL) {
+        bt->errors++;
+        return;
+    }
+    for (int i = 0; i < opts.iodepth; i++)
+        free_slots[i] = &slots[i];
+    while (more || inflight > 0) {
+        while (more && nr_free > 0 && (more = bench_more())) {
+            sqe          = ddriver_ring_get_sqe(ring);
+            if (sqe == NULL) {                        /* Can't happen below the ring depth */
+                bt->errors++;
+                more = 0;
+                break;
+            }
+            slot         = free_slots[--nr_free];
+            slot->op     = bench_next(bt, &offset);
+            sqe->op      = slot->op == BENCH_READ ? DDRIVER_REQ_READ : DDRIVER_REQ_WRITE;
+            sqe->offset  = offset;
+            sqe->buf     = slot->buf;
+            sqe->size    = opts.bs;
+            sqe->user_data = slot;
+            slot->start  = now_ns();
+            inflight++;
+        }
+        ddriver_ring_submit(ring);
+        if (inflight == 0)
+            break;
+        n = ddriver_ring_reap(ring, cqes, inflight, 1);
+        t = now_ns();
+        for (int i = 0; i < n; i++) {
+            slot = (struct bench_slot *)cqes[i].user_data;
+            if (cqes[i].result != (int)opts.bs)
+                bt->errors++;
+            else
+                stat_account(&bt->stat[slot->op], t - slot->start, opts.bs);
+            free_slots[nr_free++] = slot;
+        }
+        inflight -= n > 0 ? n : 0;
+    }
+    ddriver_ring_exit(ring);
+}
+
+static void *bench_thread_fn(void *arg) {
+    struct bench_thread *bt = (struct bench_thread *)arg;
+    struct bench_slot slots[BENCH_MAX_DEPTH];
+    void *buf;
+    int   fd = opts.kernel ? kernel_fd : device_open();
+
+    if (fd < 0) {
+        fprintf(stderr, "thread %d: can't open %s: %d\n", bt->id, opts.device, fd);
+        bt->errors++;
+        return NULL;
+    }
+    for (int i = 0; i < opts.iodepth; i++) {
+        if (posix_memalign(&buf, 4096, opts.bs) != 0) {
+            bt->errors++;
+            while (i-- > 0)
+                free(slots[i].buf);
+            if (!opts.kernel)
+                device_close(fd);
+            return NULL;
+        }
+        for (size_t j = 0; j < opts.bs; j++)
+            ((char *)buf)[j] = rand_r(&bt->seed);
+        slots[i].buf = (char *)buf;
+    }
+
+    if (opts.iodepth == 1)
+        bench_sync(bt, fd, slots[0].buf);
+    else
+        bench_ring(bt, fd, slots);
+
+    for (int i = 0; i < opts.iodepth; i++)
+        free(slots[i].buf);
+    if (!opts.kernel)
+        device_close(fd);
+    return NULL;
+}
+/******************************************************************************
+* SECTION: Report
+*******************************************************************************/
+static void report_text(const char *name, const struct bench_stat *stat, double secs) {
+    if (stat->ios == 0)
+        return;
+    printf("  %-5s: ios %llu, iops %.1f, bw %.2f MiB/s, lat(us) mean %.1f p50 %.1f "
+           "p99 %.1f p999 %.1f max %.1f\n", name, stat->ios, stat->ios / secs,
+           stat->bytes / secs / 1048576, (double)stat->lat_sum / stat->ios / 1000,
+           hist_percentile(stat, 0.50), hist_percentile(stat, 0.99),
+           hist_percentile(stat, 0.999), stat->lat_max / 1000.0);
+}
+
+static void report_json(const char *name, const struct bench_stat *stat, double secs) {
+    printf("  \"%s\": {\"ios\": %llu, \"bytes\": %llu, \"iops\": %.1f, \"bw_bytes\": %.0f, "
+           "\"lat_us\": {\"mean\": %.1f, \"p50\": %.1f, \"p99\": %.1f, \"p999\": %.1f, "
+           "\"max\": %.1f}},\n", name, stat->ios, stat->bytes, stat->ios / secs,
+           stat->bytes / secs, stat->ios ? (double)stat->lat_sum / stat->ios / 1000 : 0.0,
+           stat->ios ? hist_percentile(stat, 0.50) : 0.0,
+           stat->ios ? hist_percentile(stat, 0.99) : 0.0,
+           stat->ios ? hist_percentile(stat, 0.999) : 0.0, stat->lat_max / 1000.0);
+}
+
+static void usage(const char *prog) {
+    printf("用法: %s [options]\n", prog);
+    printf("  --rw=read|write|randread|randwrite|rw|randrw   负载(缺省randread)，rw为顺序混合\n");
+    printf("  --rwmixread=N      混合负载中读的百分比(缺省50)\n");
+    printf("  --bs=SIZE          请求大小，须为块大小的整数倍(缺省为块大小)，支持K/M/G\n");
+    printf("  --iodepth=N        每个线程同时在途的请求数(缺省1，>1时使用ddriver_ring)\n");
+    printf("  --threads=N        线程数，每个线程一个句柄(缺省1)\n");
+    printf("  --runtime=SEC      运行时间(缺省10)\n");
+    printf("  --ios=N            总请求数上限(缺省不限)\n");
+    printf("  --size=SIZE        只测试设备的前SIZE字节(缺省整个设备)\n");
+    printf("  --kernel           测试内核ddriver(缺省按DDRIVER_TYPE，未设置时为用户态)\n");
+    printf("  --device=PATH      设备路径(缺省~/ddriver或/dev/ddriver)\n");
+    printf("  --json             以JSON输出结果\n");
+}
+
+int main(int argc, char **argv) {
+    static const struct option long_opts[] = {
+        { "rw",        required_argument, NULL, 'w' },
+        { "rwmixread", required_argument, NULL, 'm' },
+        { "bs",        required_argument, NULL, 'b' },
+        { "iodepth",   required_argument, NULL, 'q' },
+        { "threads",   required_argument, NULL, 't' },
+        { "runtime",   required_argument, NULL, 'r' },
+        { "ios",       required_argument, NULL, 'n' },
+        { "size",      required_argument, NULL, 's' },
+        { "kernel",    no_argument,       NULL, 'k' },
+        { "device",    required_argument, NULL, 'd' },
+        { "json",      no_argument,       NULL, 'j' },
+        { "help",      no_argument,       NULL, 'h' },
+        { NULL,        0,                 NULL, 0 }
+    };
+    struct bench_thread *threads;
+    struct bench_stat *total;
+    struct ddriver_geometry geo;
+    struct ddriver_stats stats0 = { .size = sizeof(struct ddriver_stats) };
+    struct ddriver_stats stats1 = { .size = sizeof(struct ddriver_stats) };
+    unsigned long long crc_bytes = 0, crc_ns = 0, crc_errors = 0;
+    unsigned long long clock0 = 0, clock1 = 0, val, bs = 0, span = 0;
+    const char *type = getenv("DDRIVER_TYPE");
+    double secs;
+    int fd, opt, size, errors = 0;
+
+    opts.kernel = type != NULL && strcmp(type, "k") == 0;
+    while ((opt = getopt_long(argc, argv, "w:m:b:q:t:r:n:s:kd:jh", long_opts, NULL)) != -1) {
+        switch (opt)
+        {
+        case 'w': opts.rw = optarg; break;
+        case 'm': opts.rwmix = atoi(optarg); break;
+        case 'b': if (parse_size(optarg, &bs) < 0) opt = '?'; break;
+        case 'q': opts.iodepth = atoi(optarg); break;
+        case 't': opts.threads = atoi(optarg); break;
+        case 'r': opts.runtime = atof(optarg); break;
+        case 'n': if (parse_size(optarg, &opts.ios) < 0) opt = '?'; break;
+        case 's': if (parse_size(optarg, &span) < 0) opt = '?'; break;
+        case 'k': opts.kernel = 1; break;
+        case 'd': snprintf(opts.device, sizeof(opts.device), "%s", optarg); break;
+        case 'j': opts.json = 1; break;
+        default: break;
+        }
+        if (opt == 'h' || opt == '?') {
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (strcmp(opts.rw, "read") == 0 || strcmp(opts.rw, "randread") == 0)
+        opts.rwmix = 100;
+    else if (strcmp(opts.rw, "write") == 0 || strcmp(opts.rw, "randwrite") == 0)
+        opts.rwmix = 0;
+    else if (strcmp(opts.rw, "rw") != 0 && strcmp(opts.rw, "randrw") != 0) {
+        fprintf(stderr, "unknown workload %s\n", opts.rw);
+        return 1;
+    }
+    opts.random = strncmp(opts.rw, "rand", 4) == 0;
+    if (opts.rwmix < 0 || opts.rwmix > 100 || opts.runtime <= 0 ||
+        opts.iodepth < 1 || opts.iodepth > BENCH_MAX_DEPTH ||
+        opts.threads < 1 || opts.threads > BENCH_MAX_THREADS) {
+        fprintf(stderr, "rwmixread 0-100, runtime > 0, iodepth 1-%d, threads 1-%d\n",
+                BENCH_MAX_DEPTH, BENCH_MAX_THREADS);
+        return 1;
+    }
+    if (opts.kernel && (opts.iodepth > 1 || opts.threads > 1)) {
+        fprintf(stderr, "the kernel ddriver takes one opener at iodepth 1\n");
+        return 1;
+    }
+    if (opts.device[0] == '\0') {
+        if (opts.kernel)
+            strcpy(opts.device, "/dev/ddriver");
+        else
+            sprintf(opts.device, "%s/ddriver", getpwuid(getuid())->pw_dir);
+    }
+
+    fd = device_open();                               /* Keeps the device up between threads */
+    if (fd < 0) {
+        fprintf(stderr, "can't open %s: %s\n", opts.device, strerror(-fd));
+        return 1;
+    }
+    if (opts.kernel) {
+        kernel_fd = fd;
+        if (ioctl(fd, IOC_REQ_DEVICE_SIZE, &size) < 0 || ioctl(fd, IOC_REQ_DEVICE_IO_SZ, &iounit) < 0) {
+            fprintf(stderr, "%s: not a ddriver device\n", opts.device);
+            return 1;
+        }
+        geo.layout_size = size;
+    }
+    else {
+        ddriver_ioctl(fd, IOC_REQ_DEVICE_GEOMETRY, &geo);
+        ddriver_ioctl(fd, IOC_REQ_DEVICE_IO_SZ, &iounit);
+    }
+    opts.bs = bs != 0 ? bs : (size_t)iounit;
+    opts.span = span != 0 && span < geo.layout_size ? span : geo.layout_size;
+    kernel_chunk = opts.bs;
+    if (opts.bs % iounit != 0 || opts.bs > (1U << 30) ||
+        opts.span < (off_t)opts.bs * (opts.random ? 1 : opts.threads)) {
+        fprintf(stderr, "bs %zu should be a multiple of the %d byte block and fit the device\n",
+                opts.bs, iounit);
+        return 1;
+    }
+
+    threads = (struct bench_thread *)calloc(opts.threads, sizeof(struct bench_thread));
+    total   = (struct bench_stat *)calloc(2, sizeof(struct bench_stat));
+    for (int i = 0; i < opts.threads; i++) {
+        struct bench_thread *bt = &threads[i];
+        val      = opts.span / opts.bs / opts.threads * opts.bs;
+        bt->id   = i;
+        bt->seed = 0x9e3779b9u * (i + 1);
+        bt->start = opts.random ? 0 : (off_t)val * i;
+        bt->size  = opts.random ? (off_t)(opts.span / opts.bs * opts.bs) : (off_t)val;
+        bt->pos   = bt->start;
+    }
+    if (!opts.kernel) {
+        ddriver_ioctl(fd, IOC_REQ_DEVICE_CLOCK, &clock0);
+        ddriver_ioctl(fd, IOC_REQ_DEVICE_STATS, &stats0);
+    }
+
+    bench_start    = now_ns();
+    bench_deadline = bench_start + (unsigned long long)(opts.runtime * 1e9);
+    for (int i = 0; i < opts.threads; i++)
+        pthread_create(&threads[i].thread, NULL, bench_thread_fn, &threads[i]);
+    for (int i = 0; i < opts.threads; i++) {
+        pthread_join(threads[i].thread, NULL);
+        stat_merge(&total[BENCH_READ], &threads[i].stat[BENCH_READ]);
+        stat_merge(&total[BENCH_WRITE], &threads[i].stat[BENCH_WRITE]);
+        errors += threads[i].errors;
+    }
+    secs = (now_ns() - bench_start) / 1e9;
+    if (!opts.kernel) {
+        ddriver_ioctl(fd, IOC_REQ_DEVICE_CLOCK, &clock1);
+        ddriver_ioctl(fd, IOC_REQ_DEVICE_STATS, &stats1);
+        if (stats1.version >= 5) {
+            crc_bytes  = stats1.integrity_bytes - stats0.integrity_bytes;
+            crc_ns     = stats1.integrity_ns - stats0.integrity_ns;
+            crc_errors = stats1.integrity_errors - stats0.integrity_errors;
+        }
+    }
+    device_close(fd);
+
+    if (opts.json) {
+        printf("{\n  \"driver\": \"%s\", \"device\": \"%s\", \"rw\": \"%s\", \"rwmixread\": %d, "
+               "\"bs\": %zu, \"iodepth\": %d, \"threads\": %d, \"span\": %lld,\n",
+               opts.kernel ? "kernel" : "user", opts.device, opts.rw, opts.rwmix, opts.bs,
+               opts.iodepth, opts.threads, (long long)opts.span);
+        report_json("read", &total[BENCH_READ], secs);
+        report_json("write", &total[BENCH_WRITE], secs);
+        printf("  \"runtime_s\": %.3f, \"errors\": %d", secs, errors);
+        if (!opts.kernel)
+            printf(", \"model_clock_us\": %llu", clock1 - clock0);
+        if (crc_bytes > 0)
+            printf(",\n  \"integrity\": {\"bytes\": %llu, \"ns\": %llu, \"errors\": %llu}",
+                   crc_bytes, crc_ns, crc_errors);
+        printf("\n}\n");
+    }
+    else {
+        printf("%s ddriver %s: %s (%d%% read), bs %zu, iodepth %d, threads %d, span %lld, %.2f s\n",
+               opts.kernel ? "kernel" : "user", opts.device, opts.rw, opts.rwmix, opts.bs,
+               opts.iodepth, opts.threads, (long long)opts.span, secs);
+        report_text("read", &total[BENCH_READ], secs);
+        report_text("write", &total[BENCH_WRITE], secs);
+        if (!opts.kernel)
+            printf("  modeled device time %.3f s\n", (clock1 - clock0) / 1e6);
+        if (crc_bytes > 0)
+            printf("  checksums: %.2f MiB in %.3f s, %.2f GiB/s, %.2f%% of the run, "
+                   "%llu mismatches\n", crc_bytes / 1048576.0, crc_ns / 1e9,
+                   crc_ns > 0 ? crc_bytes / (crc_ns / 1e9) / (1 << 30) : 0.0,
+                   100.0 * crc_ns / 1e9 / secs / opts.threads, crc_errors);
+        if (errors > 0)
+            printf("  %d failed\n", errors);
+    }
+    free(threads);
+    free(total);
+    return errors > 0;
+}
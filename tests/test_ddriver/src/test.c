@@ -1,5 +1,24 @@
 #include "../include/ddriver.h"
 #include <linux/fs.h>
+#include <string.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+#define THIN_PATH       "/home/debian/ddriver_thin"
+#define THIN_BASE_PATH  "/home/debian/ddriver_thin.base"
+#define THIN_CLUSTER    (64 * 1024)
+#define CACHE_PATH      "/home/debian/ddriver_cache"
+#define CRC_PATH        "/home/debian/ddriver_crc"
+
+static int is_filled(const char *buf, int c, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (buf[i] != (char)c)
+            return 0;
+    }
+    return 1;
+}
 
 int main(int argc, char const *argv[])
 {
@@ -42,6 +61,292 @@ int main(int argc, char const *argv[])
     printf("write_cnt: %d\n", state.write_cnt);
     printf("seek_cnt: %d\n", state.seek_cnt);
 
+    /* Cycle 5: multi-block read/write test */
+    int io_sz;
+    ddriver_ioctl(fd, IOC_REQ_DEVICE_IO_SZ, &io_sz);
+    size_t msize = 4 * (size_t)io_sz;
+    char *mbuffer = (char *)malloc(msize);
+    char *mrbuffer = (char *)malloc(msize);
+    if (mbuffer == NULL || mrbuffer == NULL) {
+        return -1;
+    }
+    memset(mbuffer, 'b', msize);
+    if (ddriver_pwrite_blocks(fd, mbuffer, 4, 0) != (int)msize ||
+        ddriver_pread_blocks(fd, mrbuffer, 4, 0) != (int)msize ||
+        memcmp(mbuffer, mrbuffer, msize) != 0) {
+        printf("multi-block: mismatch\n");
+        return -1;
+    }
+    printf("multi-block: ok\n");
+
+    ddriver_ioctl(fd, IOC_REQ_DEVICE_STATE, &state);
+    printf("read_cnt: %d\n", state.read_cnt);
+    printf("write_cnt: %d\n", state.write_cnt);
+
+    /* Cycle 6: async ring test */
+    struct ddriver_ring *ring = ddriver_ring_setup(fd, 8, 2);
+    struct ddriver_sqe *sqe;
+    struct ddriver_cqe cqe;
+    if (ring == NULL) {
+        printf("async: ring setup failed\n");
+        return -1;
+    }
+    memset(mbuffer, 'c', msize);
+    sqe = ddriver_ring_get_sqe(ring);
+    if (sqe == NULL) {
+        printf("async: no free sqe\n");
+        return -1;
+    }
+    sqe->op = DDRIVER_REQ_WRITE;
+    sqe->offset = 0;
+    sqe->buf = mbuffer;
+    sqe->size = msize;
+    if (ddriver_ring_submit(ring) != 1 || ddriver_ring_reap(ring, &cqe, 1, 1) != 1 ||
+        cqe.result != (int)msize) {
+        printf("async: write failed\n");
+        return -1;
+    }
+    sqe = ddriver_ring_get_sqe(ring);
+    if (sqe == NULL) {
+        printf("async: no free sqe\n");
+        return -1;
+    }
+    sqe->op = DDRIVER_REQ_READ;
+    sqe->offset = 0;
+    sqe->buf = mrbuffer;
+    sqe->size = msize;
+    if (ddriver_ring_submit(ring) != 1 || ddriver_ring_reap(ring, &cqe, 1, 1) != 1 ||
+        cqe.result != (int)msize || memcmp(mbuffer, mrbuffer, msize) != 0) {
+        printf("async: mismatch\n");
+        return -1;
+    }
+    printf("async: ok\n");
+    ddriver_ring_exit(ring);
+    free(mbuffer);
+    free(mrbuffer);
+
+    /* Cycle 7: thin backend - orphan reclaim, copy-up, discard */
+    char *tbuffer = (char *)malloc(THIN_CLUSTER);
+    char *trbuffer = (char *)malloc(THIN_CLUSTER);
+    struct ddriver_range range = { .offset = THIN_CLUSTER, .size = THIN_CLUSTER };
+    int tfd, img;
+    if (tbuffer == NULL || trbuffer == NULL) {
+        return -1;
+    }
+    unlink(THIN_PATH);
+    unlink(THIN_PATH ".crc");
+    setenv("DDRIVER_BACKEND", "thin", 1);
+    setenv("DDRIVER_THIN_CLUSTER", "64K", 1);
+    memset(tbuffer, 't', THIN_CLUSTER);
+    tfd = ddriver_open(THIN_PATH);
+    if (tfd < 0 || ddriver_pwrite(tfd, tbuffer, THIN_CLUSTER, 0) != THIN_CLUSTER) {
+        printf("thin: write failed\n");
+        return -1;
+    }
+    ddriver_close(tfd);
+    memset(tbuffer, 'g', THIN_CLUSTER);               /* Left unreferenced by a crash */
+    img = open(THIN_PATH, O_WRONLY | O_APPEND);
+    if (img < 0 || write(img, tbuffer, THIN_CLUSTER) != THIN_CLUSTER) {
+        printf("thin: can't append an orphan cluster\n");
+        return -1;
+    }
+    close(img);
+    tfd = ddriver_open(THIN_PATH);                    /* Reclaims the orphan */
+    memset(tbuffer, 'n', io_sz);
+    if (tfd < 0 || ddriver_pwrite(tfd, tbuffer, io_sz, THIN_CLUSTER) != io_sz ||
+        ddriver_pread(tfd, trbuffer, THIN_CLUSTER, THIN_CLUSTER) != THIN_CLUSTER ||
+        !is_filled(trbuffer, 'n', io_sz) || !is_filled(trbuffer + io_sz, 0, THIN_CLUSTER - io_sz)) {
+        printf("thin: orphan cluster exposed\n");
+        return -1;
+    }
+    ddriver_close(tfd);
+    unlink(THIN_PATH);
+    unlink(THIN_PATH ".crc");
+
+    memset(tbuffer, 'b', THIN_CLUSTER);
+    img = open(THIN_BASE_PATH, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+    if (img < 0 || write(img, tbuffer, THIN_CLUSTER) != THIN_CLUSTER ||
+        write(img, tbuffer, THIN_CLUSTER) != THIN_CLUSTER) {
+        printf("thin: can't create the base image\n");
+        return -1;
+    }
+    close(img);
+    setenv("DDRIVER_BASE", THIN_BASE_PATH, 1);
+    tfd = ddriver_open(THIN_PATH);
+    memset(tbuffer, 'w', io_sz);
+    if (tfd < 0 || ddriver_pwrite(tfd, tbuffer, io_sz, io_sz) != io_sz ||
+        ddriver_pread(tfd, trbuffer, THIN_CLUSTER, 0) != THIN_CLUSTER ||
+        !is_filled(trbuffer, 'b', io_sz) || !is_filled(trbuffer + io_sz, 'w', io_sz) ||
+        !is_filled(trbuffer + 2 * io_sz, 'b', THIN_CLUSTER - 2 * io_sz)) {
+        printf("thin: partial write didn't copy the cluster up\n");
+        return -1;
+    }
+    if (ddriver_ioctl(tfd, IOC_REQ_DEVICE_DISCARD, &range) != 0 ||
+        ddriver_pread(tfd, trbuffer, THIN_CLUSTER, THIN_CLUSTER) != THIN_CLUSTER ||
+        !is_filled(trbuffer, 0, THIN_CLUSTER)) {
+        printf("thin: discarded cluster doesn't read as 0\n");
+        return -1;
+    }
+    printf("thin: ok\n");
+    ddriver_close(tfd);
+    unsetenv("DDRIVER_BASE");
+    unsetenv("DDRIVER_THIN_CLUSTER");
+    unsetenv("DDRIVER_BACKEND");
+    unlink(THIN_PATH);
+    unlink(THIN_PATH ".crc");
+    unlink(THIN_BASE_PATH);
+
+    /* Cycle 8: thin backend - snapshot, rollback, drop overlays */
+    setenv("DDRIVER_BACKEND", "thin", 1);
+    setenv("DDRIVER_THIN_CLUSTER", "64K", 1);
+    memset(tbuffer, 's', THIN_CLUSTER);
+    tfd = ddriver_open(THIN_PATH);
+    if (tfd < 0 || ddriver_pwrite(tfd, tbuffer, THIN_CLUSTER, 0) != THIN_CLUSTER ||
+        ddriver_ioctl(tfd, IOC_REQ_DEVICE_SNAPSHOT, NULL) != 0) {
+        printf("overlay: snapshot failed\n");
+        return -1;
+    }
+    memset(tbuffer, 'o', io_sz);
+    if (ddriver_pwrite(tfd, tbuffer, io_sz, 0) != io_sz ||
+        ddriver_pread(tfd, trbuffer, THIN_CLUSTER, 0) != THIN_CLUSTER ||
+        !is_filled(trbuffer, 'o', io_sz) || !is_filled(trbuffer + io_sz, 's', THIN_CLUSTER - io_sz)) {
+        printf("overlay: overwrite over the snapshot failed\n");
+        return -1;
+    }
+    if (ddriver_ioctl(tfd, IOC_REQ_DEVICE_ROLLBACK, NULL) != 0 ||
+        ddriver_pread(tfd, trbuffer, THIN_CLUSTER, 0) != THIN_CLUSTER ||
+        !is_filled(trbuffer, 's', THIN_CLUSTER)) {
+        printf("overlay: rollback didn't restore the snapshot\n");
+        return -1;
+    }
+    if (ddriver_ioctl(tfd, IOC_REQ_DEVICE_SNAPSHOT, NULL) != 0 ||
+        access(THIN_PATH ".snap0", F_OK) != 0 || access(THIN_PATH ".snap1", F_OK) != 0 ||
+        ddriver_ioctl(tfd, IOC_REQ_DEVICE_DROP_OVERLAY, NULL) != 0 ||
+        access(THIN_PATH ".snap0", F_OK) == 0 || access(THIN_PATH ".snap1", F_OK) == 0 ||
+        ddriver_pread(tfd, trbuffer, THIN_CLUSTER, 0) != THIN_CLUSTER ||
+        !is_filled(trbuffer, 0, THIN_CLUSTER)) {
+        printf("overlay: drop didn't remove the snapshots\n");
+        return -1;
+    }
+    printf("overlay: ok\n");
+    ddriver_close(tfd);
+    unsetenv("DDRIVER_THIN_CLUSTER");
+    unsetenv("DDRIVER_BACKEND");
+    unlink(THIN_PATH);
+    unlink(THIN_PATH ".crc");
+    free(tbuffer);
+    free(trbuffer);
+
+    /* Cycle 9: write-back cache - hit/miss counters, data survives flush and reopen */
+    struct ddriver_stats stats = { .size = sizeof(stats) };
+    unsigned long long hits, misses;
+    char *cbuffer = (char *)malloc(2 * io_sz);
+    char *crbuffer = (char *)malloc(2 * io_sz);
+    int cfd;
+    if (cbuffer == NULL || crbuffer == NULL) {
+        return -1;
+    }
+    unlink(CACHE_PATH);
+    unlink(CACHE_PATH ".crc");
+    setenv("DDRIVER_BACKEND", "file", 1);
+    setenv("DDRIVER_CACHE_SIZE", "64K", 1);
+    memset(cbuffer, 'k', 2 * io_sz);
+    cfd = ddriver_open(CACHE_PATH);
+    if (cfd < 0 || ddriver_pwrite(cfd, cbuffer, 2 * io_sz, 0) != 2 * io_sz ||
+        ddriver_pread(cfd, crbuffer, io_sz, 4 * io_sz) != io_sz ||
+        ddriver_ioctl(cfd, IOC_REQ_DEVICE_STATS, &stats) != 0) {
+        printf("cache: io failed\n");
+        return -1;
+    }
+    hits   = stats.cache_hit;
+    misses = stats.cache_miss;
+    if (ddriver_pread(cfd, crbuffer, io_sz, 4 * io_sz) != io_sz ||
+        ddriver_ioctl(cfd, IOC_REQ_DEVICE_STATS, &stats) != 0 ||
+        misses == 0 || stats.cache_hit != hits + 1 || stats.cache_miss != misses) {
+        printf("cache: hit/miss counters wrong\n");
+        return -1;
+    }
+    if (ddriver_ioctl(cfd, IOC_REQ_DEVICE_FLUSH, NULL) != 0) {
+        printf("cache: flush failed\n");
+        return -1;
+    }
+    img = open(CACHE_PATH, O_RDONLY);                 /* Written back to the image */
+    if (img < 0 || pread(img, crbuffer, 2 * io_sz, 0) != 2 * io_sz ||
+        memcmp(cbuffer, crbuffer, 2 * io_sz) != 0) {
+        printf("cache: flush didn't write back\n");
+        return -1;
+    }
+    close(img);
+    ddriver_close(cfd);
+    memset(crbuffer, 0, 2 * io_sz);
+    cfd = ddriver_open(CACHE_PATH);
+    if (cfd < 0 || ddriver_pread(cfd, crbuffer, 2 * io_sz, 0) != 2 * io_sz ||
+        memcmp(cbuffer, crbuffer, 2 * io_sz) != 0) {
+        printf("cache: data lost across reopen\n");
+        return -1;
+    }
+    printf("cache: ok\n");
+    ddriver_close(cfd);
+    unsetenv("DDRIVER_CACHE_SIZE");
+    unsetenv("DDRIVER_BACKEND");
+    unlink(CACHE_PATH);
+    unlink(CACHE_PATH ".crc");
+
+    /* Cycle 10: integrity - a block corrupted behind the driver reads as -EIO */
+    unsigned long long errors;
+    char corrupt = 0x5a;
+    memset(cbuffer, 'i', 2 * io_sz);
+    unlink(CRC_PATH);
+    unlink(CRC_PATH ".crc");
+    setenv("DDRIVER_BACKEND", "file", 1);
+    setenv("DDRIVER_CACHE_SIZE", "0", 1);
+    setenv("DDRIVER_INTEGRITY", "on", 1);
+    cfd = ddriver_open(CRC_PATH);
+    if (cfd < 0 || ddriver_pwrite(cfd, cbuffer, 2 * io_sz, 0) != 2 * io_sz ||
+        ddriver_ioctl(cfd, IOC_REQ_DEVICE_FLUSH, NULL) != 0 ||
+        ddriver_ioctl(cfd, IOC_REQ_DEVICE_STATS, &stats) != 0) {
+        printf("integrity: io failed\n");
+        return -1;
+    }
+    img = open(CRC_PATH, O_WRONLY);
+    if (img < 0 || pwrite(img, &corrupt, 1, io_sz + 100) != 1) {
+        printf("integrity: can't corrupt the image\n");
+        return -1;
+    }
+    close(img);
+    errors = stats.integrity_errors;
+    if (ddriver_pread(cfd, crbuffer, io_sz, 0) != io_sz ||
+        ddriver_pread(cfd, crbuffer, io_sz, io_sz) != -EIO ||
+        ddriver_ioctl(cfd, IOC_REQ_DEVICE_STATS, &stats) != 0 ||
+        stats.integrity_errors != errors + 1) {
+        printf("integrity: corruption not detected\n");
+        return -1;
+    }
+    printf("integrity: ok\n");
+    ddriver_close(cfd);
+    unsetenv("DDRIVER_INTEGRITY");
+    unsetenv("DDRIVER_CACHE_SIZE");
+    unsetenv("DDRIVER_BACKEND");
+    unlink(CRC_PATH);
+    unlink(CRC_PATH ".crc");
+
+    /* Cycle 11: zero-copy range - a pinned write shows up in a later read */
+    char *pinned = (char *)ddriver_get_range(fd, 8 * io_sz, 2, DDRIVER_BLK_READ | DDRIVER_BLK_WRITE);
+    if (pinned == NULL) {
+        printf("range: get failed\n");
+        return -1;
+    }
+    memset(pinned, 'p', 2 * io_sz);
+    if (ddriver_put_range(fd, pinned, 1) != 0 ||
+        ddriver_pread(fd, crbuffer, 2 * io_sz, 8 * io_sz) != 2 * io_sz ||
+        !is_filled(crbuffer, 'p', 2 * io_sz)) {
+        printf("range: pinned write lost\n");
+        return -1;
+    }
+    printf("range: ok\n");
+    free(cbuffer);
+    free(crbuffer);
+
     ddriver_close(fd);
 
     printf("Test Pass :)\n");